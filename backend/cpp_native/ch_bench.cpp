@@ -0,0 +1,262 @@
+// backend/cpp_native/ch_bench.cpp
+// Standalone query benchmark on the ch_native engine (ch_engine.h), without
+// Python in the timings. Build with `make bench`.
+//
+//   ch_bench GRAPH [--queries N] [--threads T] [--seed S]
+//                  [--workload random|rank|FILE] [--variants dist,path,astar,alt]
+//                  [--landmarks K] [--heap lazy|dary4|radix] [--json]
+//
+// GRAPH is a file written by CHGraph::save. FILE holds one "origin dest"
+// pair of node indices per line. The rank workload runs a full Dijkstra from
+// each of N random sources and queries the nodes it settles 2^r-th, for
+// every r; results are reported per r (Dijkstra rank). --heap picks the
+// priority queue of the dist and path queries (default: the build's
+// CH_QUERY_HEAP). --json prints one JSON object to stdout instead of the
+// table.
+#include "ch_engine.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <sstream>
+
+namespace {
+
+struct Query {
+    int origin, dest;
+    int rank_log;   // log2 of the Dijkstra rank, -1 outside the rank workload
+};
+
+struct Sample {
+    double micros;
+    long long settled, relaxed;
+};
+
+struct Result {
+    std::string variant;
+    int rank_log;
+    size_t queries;
+    double qps, mean_us, p50_us, p99_us, settled, relaxed;
+};
+
+[[noreturn]] void usage(const char* msg) {
+    if (msg) std::fprintf(stderr, "ch_bench: %s\n", msg);
+    std::fprintf(stderr,
+                 "usage: ch_bench GRAPH [--queries N] [--threads T] [--seed S]\n"
+                 "                [--workload random|rank|FILE] [--variants dist,path,astar,alt]\n"
+                 "                [--landmarks K] [--heap lazy|dary4|radix] [--json]\n");
+    std::exit(2);
+}
+
+std::vector<Query> random_workload(const CHGraph& g, int count, std::mt19937_64& rng) {
+    std::uniform_int_distribution<int> node(0, g.num_nodes - 1);
+    std::vector<Query> qs(count);
+    for (auto& q : qs) q = {node(rng), node(rng), -1};
+    return qs;
+}
+
+std::vector<Query> file_workload(const CHGraph& g, const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("cannot open workload " + path);
+    std::vector<Query> qs;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        int o, d;
+        if (!(fields >> o >> d)) continue;
+        if (o < 0 || o >= g.num_nodes || d < 0 || d >= g.num_nodes) {
+            throw std::runtime_error("workload node out of range: " + line);
+        }
+        qs.push_back({o, d, -1});
+    }
+    return qs;
+}
+
+std::vector<Query> rank_workload(const CHGraph& g, int sources, std::mt19937_64& rng, int threads) {
+    std::uniform_int_distribution<int> node(0, g.num_nodes - 1);
+    std::vector<int> source(sources);
+    for (int& s : source) s = node(rng);
+    auto m = g.metric_snapshot();
+    std::vector<std::vector<Query>> per_source(sources);
+    parallel_for(sources, threads, [&](int i, int) {
+        std::vector<double> dist;
+        g.base_dijkstra(g.base_out, m->base_weight.data(), source[i], -1, dist);
+        std::vector<int> settled;
+        for (int v = 0; v < g.num_nodes; ++v) {
+            if (std::isfinite(dist[v])) settled.push_back(v);
+        }
+        std::sort(settled.begin(), settled.end(),
+                  [&](int a, int b) { return dist[a] < dist[b] || (dist[a] == dist[b] && a < b); });
+        for (int r = 0; (size_t(1) << r) < settled.size(); ++r) {
+            per_source[i].push_back({source[i], settled[size_t(1) << r], r});
+        }
+    });
+    std::vector<Query> qs;
+    for (auto& p : per_source) qs.insert(qs.end(), p.begin(), p.end());
+    return qs;
+}
+
+template <bool DistOnly, typename Heap>
+void run_query(const CHGraph& g, const Query& q, QueryContext& ctx) {
+    if (DistOnly) g.query_dist<Heap>(q.origin, q.dest, ctx);
+    else g.query<Heap>(q.origin, q.dest, ctx);
+}
+
+template <bool DistOnly>
+void run_query(const CHGraph& g, const std::string& heap, const Query& q, QueryContext& ctx) {
+    if (heap == "lazy") run_query<DistOnly, LazyBinaryHeap>(g, q, ctx);
+    else if (heap == "dary4") run_query<DistOnly, IndexedDaryHeap<4>>(g, q, ctx);
+    else if (heap == "radix") run_query<DistOnly, RadixHeap>(g, q, ctx);
+    else run_query<DistOnly, CH_QUERY_HEAP>(g, q, ctx);
+}
+
+double percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t k = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(sorted.size() - 1, k > 0 ? k - 1 : 0)];
+}
+
+Result summarize(const std::string& variant, int rank_log, const std::vector<const Sample*>& samples,
+                 double wall_seconds) {
+    Result r{variant, rank_log, samples.size(), 0, 0, 0, 0, 0, 0};
+    if (samples.empty()) return r;
+    std::vector<double> micros;
+    for (const Sample* s : samples) {
+        micros.push_back(s->micros);
+        r.mean_us += s->micros;
+        r.settled += s->settled;
+        r.relaxed += s->relaxed;
+    }
+    std::sort(micros.begin(), micros.end());
+    double n = (double)samples.size();
+    r.qps = wall_seconds > 0 ? n / wall_seconds : 0.0;
+    r.mean_us /= n;
+    r.settled /= n;
+    r.relaxed /= n;
+    r.p50_us = percentile(micros, 0.50);
+    r.p99_us = percentile(micros, 0.99);
+    return r;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) usage(nullptr);
+    std::string graph_path = argv[1], workload = "random", variant_list = "dist,path", heap = "default";
+    int queries = 10000, threads = 1, landmarks = 16;
+    uint64_t seed = 1;
+    bool json = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (++i >= argc) usage(("missing value for " + arg).c_str());
+            return argv[i];
+        };
+        if (arg == "--queries") queries = std::atoi(value().c_str());
+        else if (arg == "--threads") threads = std::atoi(value().c_str());
+        else if (arg == "--seed") seed = std::strtoull(value().c_str(), nullptr, 10);
+        else if (arg == "--workload") workload = value();
+        else if (arg == "--variants") variant_list = value();
+        else if (arg == "--landmarks") landmarks = std::atoi(value().c_str());
+        else if (arg == "--heap") heap = value();
+        else if (arg == "--json") json = true;
+        else usage(("unknown option " + arg).c_str());
+    }
+    if (queries <= 0) usage("--queries must be positive");
+    if (heap != "default" && heap != "lazy" && heap != "dary4" && heap != "radix") usage(("unknown heap " + heap).c_str());
+    threads = resolve_threads(threads);
+
+    std::vector<std::string> variants;
+    {
+        std::istringstream list(variant_list);
+        for (std::string v; std::getline(list, v, ',');) {
+            if (v != "dist" && v != "path" && v != "astar" && v != "alt") usage(("unknown variant " + v).c_str());
+            variants.push_back(v);
+        }
+    }
+
+    try {
+        auto g = CHGraph::load(graph_path);
+        if (g->num_nodes == 0) throw std::runtime_error("graph has no nodes");
+        if (std::find(variants.begin(), variants.end(), "alt") != variants.end()) {
+            g->build_landmarks(landmarks, threads);
+        }
+
+        std::mt19937_64 rng(seed);
+        std::vector<Query> qs = workload == "random" ? random_workload(*g, queries, rng)
+                              : workload == "rank"   ? rank_workload(*g, queries, rng, threads)
+                                                     : file_workload(*g, workload);
+        if (qs.empty()) throw std::runtime_error("empty workload");
+
+        std::vector<Result> results;
+        std::vector<Sample> samples(qs.size());
+        std::vector<QueryContext> contexts(threads);
+        for (const std::string& variant : variants) {
+            auto run = [&](int i, int t) {
+                QueryContext& ctx = contexts[t];
+                auto start = std::chrono::steady_clock::now();
+                if (variant == "dist") run_query<true>(*g, heap, qs[i], ctx);
+                else if (variant == "path") run_query<false>(*g, heap, qs[i], ctx);
+                else g->astar(qs[i].origin, qs[i].dest, ctx, 1.0, variant == "alt");
+                auto stop = std::chrono::steady_clock::now();
+                samples[i] = {std::chrono::duration<double, std::micro>(stop - start).count(),
+                              ctx.settled_nodes, ctx.relaxed_edges};
+            };
+            // Warm-up pass (page cache, context buffers), then the timed one.
+            parallel_for(std::min((int)qs.size(), 1000), threads, run);
+            auto start = std::chrono::steady_clock::now();
+            parallel_for((int)qs.size(), threads, run);
+            double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::map<int, std::vector<const Sample*>> by_rank;
+            std::vector<const Sample*> all;
+            for (size_t i = 0; i < qs.size(); ++i) {
+                all.push_back(&samples[i]);
+                if (qs[i].rank_log >= 0) by_rank[qs[i].rank_log].push_back(&samples[i]);
+            }
+            results.push_back(summarize(variant, -1, all, wall));
+            // Per-rank QPS is the overall rate scaled by that rank's share
+            // of the summed latency, since the ranks run interleaved.
+            double total_us = 0;
+            for (const Sample* s : all) total_us += s->micros;
+            for (const auto& [r, group] : by_rank) {
+                double group_us = 0;
+                for (const Sample* s : group) group_us += s->micros;
+                results.push_back(summarize(variant, r, group, wall * group_us / total_us));
+            }
+        }
+
+        if (json) {
+            std::printf("{\"graph\": \"%s\", \"nodes\": %d, \"customizable\": %s, \"threads\": %d, "
+                        "\"workload\": \"%s\", \"heap\": \"%s\", \"seed\": %llu, \"results\": [",
+                        graph_path.c_str(), g->num_nodes, g->customizable ? "true" : "false", threads,
+                        workload.c_str(), heap.c_str(), (unsigned long long)seed);
+            for (size_t i = 0; i < results.size(); ++i) {
+                const Result& r = results[i];
+                std::printf("%s\n  {\"variant\": \"%s\", \"rank\": ", i ? "," : "", r.variant.c_str());
+                if (r.rank_log >= 0) std::printf("%d", r.rank_log);
+                else std::printf("null");
+                std::printf(", \"queries\": %zu, \"qps\": %.1f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+                            "\"p99_us\": %.3f, \"settled\": %.1f, \"relaxed\": %.1f}",
+                            r.queries, r.qps, r.mean_us, r.p50_us, r.p99_us, r.settled, r.relaxed);
+            }
+            std::printf("\n]}\n");
+        } else {
+            std::printf("%s: %d nodes, %d threads, workload %s, heap %s\n", graph_path.c_str(), g->num_nodes,
+                        threads, workload.c_str(), heap.c_str());
+            std::printf("%-8s %5s %9s %11s %10s %10s %10s %10s %10s\n", "variant", "rank", "queries", "qps",
+                        "mean_us", "p50_us", "p99_us", "settled", "relaxed");
+            for (const Result& r : results) {
+                std::string rank = r.rank_log >= 0 ? std::to_string(r.rank_log) : "all";
+                std::printf("%-8s %5s %9zu %11.1f %10.2f %10.2f %10.2f %10.1f %10.1f\n", r.variant.c_str(),
+                            rank.c_str(), r.queries, r.qps, r.mean_us, r.p50_us, r.p99_us, r.settled, r.relaxed);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "ch_bench: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
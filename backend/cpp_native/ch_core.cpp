@@ -1,326 +1,610 @@
 // backend/cpp_native/ch_core.cpp
+// Python bindings (module ch_native) for the engine in ch_engine.h.
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
-#include <vector>
-#include <queue>
-#include <tuple>
-#include <limits>
-#include <iostream>
-#include <algorithm>
+#include <pybind11/numpy.h>
+#include "ch_engine.h"
 
 namespace py = pybind11;
 
-struct Edge {
-    int target;
-    double weight;
-    bool is_shortcut;
-    int via_node; 
-};
-
-class CHGraph {
-public:
-    int num_nodes;
-    std::vector<std::vector<Edge>> adj_out;
-    std::vector<std::vector<Edge>> adj_in;
-    std::vector<bool> contracted;
-    std::vector<int> rank;
-    std::vector<int> node_order;
-
-    CHGraph(int n) : num_nodes(n) {
-        adj_out.resize(n);
-        adj_in.resize(n);
-        contracted.assign(n, false);
-        rank.assign(n, -1);
-    }
-
-    void add_edge(int u, int v, double weight) {
-        adj_out[u].push_back({v, weight, false, -1});
-        adj_in[v].push_back({u, weight, false, -1});
-    }
-
-    void add_ch_edge(int u, int v, double weight, bool is_shortcut, int via) {
-        adj_out[u].push_back({v, weight, is_shortcut, via});
-        adj_in[v].push_back({u, weight, is_shortcut, via});
-    }
-
-    void set_rank(int u, int r) {
-        if (u >= 0 && u < num_nodes) rank[u] = r;
-    }
-
-    // --- BUILD LOGIC (Same as before) ---
-    bool witness_search(int u, int v, double max_dist, int exclude_node, int hop_limit) {
-        for (const auto& edge : adj_out[u]) {
-            if (edge.target == v && edge.weight <= max_dist) return true;
+namespace {
+
+// Asyncio front end of QueryPool: submit() returns a future of the running
+// event loop, completed through loop.call_soon_threadsafe once its
+// micro-batch is done. Workers take the GIL once per batch; `pending` and
+// `next_tag` are only touched with the GIL held.
+struct AsyncQueryPool {
+    std::unique_ptr<QueryPool> pool;
+    std::unordered_map<uint64_t, std::pair<py::object, py::object>> pending;   // tag -> (future, loop)
+    uint64_t next_tag = 0;
+    py::object complete;   // complete(future, value, error) on the loop thread
+
+    ~AsyncQueryPool() { close(); }
+
+    // Stops the workers (queued requests still complete). Needs the GIL.
+    void close() {
+        if (!pool) return;
+        {
+            py::gil_scoped_release release;
+            pool->stop();
         }
-        std::priority_queue<std::tuple<double, int, int>, std::vector<std::tuple<double, int, int>>, std::greater<>> pq;
-        pq.push({0.0, u, 0});
-
-        while (!pq.empty()) {
-            auto [d, curr, h] = pq.top();
-            pq.pop();
-            if (d > max_dist) return false;
-            if (curr == v) return true;
-            if (h >= hop_limit) continue;
-
-            for (const auto& edge : adj_out[curr]) {
-                if (contracted[edge.target] && edge.target != v) continue;
-                if (edge.target == exclude_node) continue;
-                double new_dist = d + edge.weight;
-                if (new_dist <= max_dist) pq.push({new_dist, edge.target, h + 1});
-            }
-        }
-        return false;
+        pool.reset();
     }
 
-    int contract_node(int node) {
-        contracted[node] = true;
-        int shortcuts_added = 0;
-        std::vector<Edge> in_neighbors;
-        for (const auto& e : adj_in[node]) { if (!contracted[e.target]) in_neighbors.push_back(e); }
-        std::vector<Edge> out_neighbors;
-        for (const auto& e : adj_out[node]) { if (!contracted[e.target]) out_neighbors.push_back(e); }
-
-        long long complexity = (long long)in_neighbors.size() * out_neighbors.size();
-        bool skip_witness = complexity > 500; 
-        int max_shortcuts = 100;
-
-        for (const auto& in_edge : in_neighbors) {
-            int u = in_edge.target;
-            double d_uv = in_edge.weight;
-            for (const auto& out_edge : out_neighbors) {
-                int w = out_edge.target;
-                if (u == w) continue;
-                if (shortcuts_added >= max_shortcuts) return shortcuts_added;
-                
-                double d_vw = out_edge.weight;
-                double total = d_uv + d_vw;
-                bool needed = true;
-                if (!skip_witness) {
-                    if (witness_search(u, w, total, node, 3)) needed = false;
-                } else {
-                    if (witness_search(u, w, total, node, 1)) needed = false;
-                }
-
-                if (needed) {
-                    adj_out[u].push_back({w, total, true, node});
-                    adj_in[w].push_back({u, total, true, node});
-                    shortcuts_added++;
-                }
+    // Runs on a worker thread.
+    void finish(std::vector<QueryPool::Result>& results) {
+        py::gil_scoped_acquire gil;
+        for (auto& r : results) {
+            auto it = pending.find(r.tag);
+            if (it == pending.end()) continue;
+            py::object future = std::move(it->second.first);
+            py::object loop = std::move(it->second.second);
+            pending.erase(it);
+            py::object value = py::none(), error = py::none();
+            if (!r.error.empty()) {
+                error = py::str(r.error);
+            } else if (r.kind == QueryPool::DIST) {
+                value = py::make_tuple(r.km, r.metric_version);
+            } else if (r.kind == QueryPool::PATH) {
+                value = py::make_tuple(std::move(r.path), r.km, r.metric_version);
+            } else {
+                py::array_t<double> latlon({(py::ssize_t)r.latlon.size() / 2, (py::ssize_t)2});
+                std::copy(r.latlon.begin(), r.latlon.end(), latlon.mutable_data());
+                value = py::make_tuple(std::move(latlon), r.km, r.metric_version);
+            }
+            try {
+                loop.attr("call_soon_threadsafe")(complete, future, value, error);
+            } catch (py::error_already_set&) {
+                // the loop is closed; nobody is waiting any more
             }
         }
-        return shortcuts_added;
     }
+};
 
-    void build_ch(std::vector<int> order) {
-        node_order = order;
-        int r = 0;
-        for (int node : node_order) {
-            rank[node] = r++;
-            contract_node(node);
-            if (r % 5000 == 0) std::cout << "Progress: " << r << "/" << node_order.size() << std::endl;
-        }
-    }
+}  // namespace
 
-    py::dict get_graph_data() {
-        py::list edges;
-        for (int u = 0; u < num_nodes; ++u) {
-            for (const auto& e : adj_out[u]) {
-                edges.append(py::make_tuple(u, e.target, e.weight, e.is_shortcut, e.via_node));
-            }
-        }
-        py::dict result;
-        result["edges"] = edges;
-        result["ranks"] = rank;
+PYBIND11_MODULE(ch_native, m) {
+    // C-contiguous inputs; forcecast converts lists and other dtypes once.
+    using IntArray = py::array_t<int, py::array::c_style | py::array::forcecast>;
+    using Int64Array = py::array_t<int64_t, py::array::c_style | py::array::forcecast>;
+    using DoubleArray = py::array_t<double, py::array::c_style | py::array::forcecast>;
+    using BoolArray = py::array_t<bool, py::array::c_style | py::array::forcecast>;
+    auto require_size = [](const py::array& a, py::ssize_t n, const char* name) {
+        if (a.size() != n) throw py::value_error(std::string(name) + " has the wrong length");
+    };
+    // Route geometry as a (k, 2) float64 array of (lat, lon), or as an
+    // encoded polyline string.
+    auto geometry_result = [](const std::vector<double>& latlon, bool polyline) -> py::object {
+        if (polyline) return py::str(geometry::encode_polyline(latlon));
+        py::array_t<double> out({(py::ssize_t)latlon.size() / 2, (py::ssize_t)2});
+        std::copy(latlon.begin(), latlon.end(), out.mutable_data());
+        return std::move(out);
+    };
+    // Per-query stats of the last query run on a context.
+    auto query_stats = [](const QueryContext& qc) {
+        py::dict stats;
+        stats["settled_fwd"] = qc.settled_fwd;
+        stats["settled_bwd"] = qc.settled_bwd;
+        stats["heap_pushes"] = qc.heap_pushes;
+        stats["relaxed_edges"] = qc.relaxed_edges;
+        stats["meet_rank"] = qc.meet_rank;
+        stats["path_nodes"] = qc.path_nodes;
+        stats["search_ns"] = qc.search_ns;
+        stats["unpack_ns"] = qc.unpack_ns;
+        stats["cache_hit"] = qc.cache_hit;
+        return stats;
+    };
+    // Runs query(qc) with timings on whenever the caller asked for stats.
+    auto with_stats = [](QueryContext& qc, bool stats, auto&& query) {
+        bool timed = qc.timed;
+        qc.timed = timed || stats;
+        auto result = query();
+        qc.timed = timed;
         return result;
-    }
+    };
 
-    // --- QUERY ENGINE FIX ---
-    
-    void unpack(int u, int v, std::vector<int>& path) {
-        // FIX: Iterate through ALL edges to find a valid shortcut.
-        // Do not just return the first edge you see.
-        for (const auto& e : adj_out[u]) {
-            if (e.target == v) {
-                if (e.is_shortcut && e.via_node != -1) {
-                    // Found a shortcut! Recurse immediately.
-                    unpack(u, e.via_node, path);
-                    unpack(e.via_node, v, path);
-                    return; 
-                }
+    py::class_<CHGraph>(m, "CHGraph")
+        .def(py::init<int>())
+        .def("add_edge", &CHGraph::add_edge)
+        .def("add_ch_edge", &CHGraph::add_ch_edge)
+        .def("set_rank", &CHGraph::set_rank)
+        .def("build_ch", &CHGraph::build_ch, py::call_guard<py::gil_scoped_release>())
+        .def("build_ch_auto", &CHGraph::build_ch_auto, py::arg("num_threads") = 0,
+             py::call_guard<py::gil_scoped_release>())
+        .def("freeze", &CHGraph::freeze)
+        // Customizable CH: metric-independent build, then customize() per metric.
+        .def("build_cch", &CHGraph::build_cch, py::arg("order") = std::vector<int>(),
+             py::arg("num_threads") = 0, py::call_guard<py::gil_scoped_release>())
+        .def("customize", [=](CHGraph& g, DoubleArray weights, int num_threads) {
+            require_size(weights, (py::ssize_t)g.base_src.size(), "weights");
+            py::gil_scoped_release release;
+            g.customize(weights.data(), weights.size(), num_threads);
+        }, py::arg("weights"), py::arg("num_threads") = 0)
+        // Incremental: returns the number of hierarchy arcs recomputed.
+        .def("update_weights", [=](CHGraph& g, IntArray edges, DoubleArray weights) {
+            require_size(weights, edges.size(), "weights");
+            g.ensure_frozen();
+            py::gil_scoped_release release;
+            return g.update_weights(edges.data(), weights.data(), edges.size());
+        }, py::arg("edges"), py::arg("weights"))
+        .def_readonly("is_customizable", &CHGraph::customizable)
+        // freeze() numbers the query-time graphs by descending rank (the
+        // top of the hierarchy first). Node ids in the API stay external.
+        .def_readwrite("renumber_nodes", &CHGraph::renumber_nodes)
+        .def("get_node_order", [](const CHGraph& g) {
+            py::array_t<int> order(g.num_nodes);
+            int* out = order.mutable_data();
+            for (int i = 0; i < g.num_nodes; ++i) out[i] = g.external(i);
+            return order;
+        })
+        .def_property_readonly("has_edge_geometry", [](const CHGraph& g) { return !g.geom_offsets.empty(); })
+        .def_property_readonly("has_time_profiles", [](const CHGraph& g) { return (bool)std::atomic_load(&g.time_profiles); })
+        // Base edges in id order (the order customize() expects weights in).
+        .def("get_base_edges", [](const CHGraph& g) {
+            py::ssize_t m = (py::ssize_t)g.base_src.size();
+            py::array_t<int> src(m), dst(m);
+            py::array_t<double> weight(m);
+            std::copy(g.base_src.begin(), g.base_src.end(), src.mutable_data());
+            std::copy(g.base_dst.begin(), g.base_dst.end(), dst.mutable_data());
+            auto metric = g.metric_snapshot();
+            const Buffer<double>& w = metric ? metric->base_weight : g.base_weight;
+            std::copy(w.begin(), w.end(), weight.mutable_data());
+            py::dict out;
+            out["src"] = src;
+            out["dst"] = dst;
+            out["weight"] = weight;
+            return out;
+        })
+        .def("cache_top_shortcuts", &CHGraph::cache_top_shortcuts,
+             py::arg("top_nodes"), py::arg("max_cached_nodes") = 50000000,
+             py::call_guard<py::gil_scoped_release>())
+        .def("set_node", &CHGraph::set_node, py::arg("u"), py::arg("id"), py::arg("lat"), py::arg("lon"))
+        .def("get_node_ids", [](const CHGraph& g) {
+            py::array_t<int64_t> ids((py::ssize_t)g.node_ids.size());
+            std::copy(g.node_ids.begin(), g.node_ids.end(), ids.mutable_data());
+            return ids;
+        })
+        // --- Bulk numpy I/O (no per-edge Python objects) ---
+        .def("add_edges", [=](CHGraph& g, IntArray src, IntArray dst, DoubleArray weight) {
+            require_size(dst, src.size(), "dst");
+            require_size(weight, src.size(), "weight");
+            py::gil_scoped_release release;
+            g.add_edges(src.data(), dst.data(), weight.data(), nullptr, nullptr, src.size());
+        }, py::arg("src"), py::arg("dst"), py::arg("weight"))
+        .def("add_ch_edges", [=](CHGraph& g, IntArray src, IntArray dst, DoubleArray weight,
+                                 BoolArray is_shortcut, IntArray via) {
+            require_size(dst, src.size(), "dst");
+            require_size(weight, src.size(), "weight");
+            require_size(is_shortcut, src.size(), "is_shortcut");
+            require_size(via, src.size(), "via");
+            py::gil_scoped_release release;
+            g.add_edges(src.data(), dst.data(), weight.data(), is_shortcut.data(), via.data(), src.size());
+        }, py::arg("src"), py::arg("dst"), py::arg("weight"), py::arg("is_shortcut"), py::arg("via"))
+        .def("set_ranks", [](CHGraph& g, IntArray ranks) {
+            g.set_ranks(ranks.data(), ranks.size());
+        }, py::arg("ranks"))
+        .def("set_nodes", [=](CHGraph& g, Int64Array ids, DoubleArray lat, DoubleArray lon) {
+            require_size(lat, ids.size(), "lat");
+            require_size(lon, ids.size(), "lon");
+            g.set_nodes(ids.data(), lat.data(), lon.data(), ids.size());
+        }, py::arg("ids"), py::arg("lat"), py::arg("lon"))
+        // Edge shapes in base edge order: edge e has points
+        // [offsets[e], offsets[e + 1]) of lat / lon, without its end nodes.
+        .def("set_edge_geometry", [=](CHGraph& g, Int64Array offsets, DoubleArray lat, DoubleArray lon) {
+            require_size(offsets, (py::ssize_t)g.base_src.size() + 1, "offsets");
+            require_size(lon, lat.size(), "lon");
+            const int64_t* off = offsets.data();
+            if (off[0] != 0 || off[offsets.size() - 1] != lat.size()) {
+                throw py::value_error("offsets must run from 0 to len(lat)");
             }
-        }
-        // If we finish the loop and found no shortcuts, 
-        // it means u->v is a real base edge.
-        path.push_back(v);
-    }
-
-    double query_dist(int origin, int dest) {
-        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes) {
-            return std::numeric_limits<double>::infinity();
-        }
-
-        // Standard Bi-directional Dijkstra (simplified for distance only)
-        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> fwd_pq, bwd_pq;
-        std::vector<double> fwd_dist(num_nodes, std::numeric_limits<double>::infinity());
-        std::vector<double> bwd_dist(num_nodes, std::numeric_limits<double>::infinity());
-
-        fwd_pq.push({0.0, origin});
-        fwd_dist[origin] = 0.0;
-        bwd_pq.push({0.0, dest});
-        bwd_dist[dest] = 0.0;
-
-        double mu = std::numeric_limits<double>::infinity();
-
-        while (!fwd_pq.empty() || !bwd_pq.empty()) {
-            if (!fwd_pq.empty()) {
-                auto [d, u] = fwd_pq.top(); fwd_pq.pop();
-                if (d > mu) { /* Optimization: Prune */ } 
-                else {
-                    for (const auto& e : adj_out[u]) {
-                        if (rank[e.target] > rank[u]) {
-                            double new_dist = d + e.weight;
-                            if (new_dist < fwd_dist[e.target]) {
-                                fwd_dist[e.target] = new_dist;
-                                fwd_pq.push({new_dist, e.target});
-                                if (bwd_dist[e.target] != std::numeric_limits<double>::infinity()) {
-                                    mu = std::min(mu, new_dist + bwd_dist[e.target]);
-                                }
-                            }
-                        }
-                    }
-                }
+            g.set_edge_geometry(off, lat.data(), lon.data(), g.base_src.size());
+        }, py::arg("offsets"), py::arg("lat"), py::arg("lon"))
+        // Every edge (base + shortcut) as parallel numpy arrays, plus ranks.
+        .def("get_graph_arrays", [](const CHGraph& g, int num_threads) {
+            py::ssize_t m = (py::ssize_t)g.num_edges();
+            py::array_t<int> src(m), dst(m), via(m);
+            py::array_t<double> weight(m);
+            py::array_t<bool> is_shortcut(m);
+            py::array_t<int> ranks((py::ssize_t)g.rank.size());
+            std::copy(g.rank.begin(), g.rank.end(), ranks.mutable_data());
+            {
+                py::gil_scoped_release release;
+                g.export_edges(src.mutable_data(), dst.mutable_data(), weight.mutable_data(),
+                               is_shortcut.mutable_data(), via.mutable_data(), num_threads);
             }
-            if (!bwd_pq.empty()) {
-                auto [d, u] = bwd_pq.top(); bwd_pq.pop();
-                if (d > mu) { /* Prune */ }
-                else {
-                    for (const auto& e : adj_in[u]) {
-                        if (rank[e.target] > rank[u]) {
-                            double new_dist = d + e.weight;
-                            if (new_dist < bwd_dist[e.target]) {
-                                bwd_dist[e.target] = new_dist;
-                                bwd_pq.push({new_dist, e.target});
-                                if (fwd_dist[e.target] != std::numeric_limits<double>::infinity()) {
-                                    mu = std::min(mu, new_dist + fwd_dist[e.target]);
-                                }
-                            }
-                        }
-                    }
-                }
+            py::dict out;
+            out["src"] = src;
+            out["dst"] = dst;
+            out["weight"] = weight;
+            out["is_shortcut"] = is_shortcut;
+            out["via"] = via;
+            out["ranks"] = ranks;
+            return out;
+        }, py::arg("num_threads") = 0)
+        .def("save", [](CHGraph& g, const std::string& path) {
+            g.ensure_frozen();
+            py::gil_scoped_release release;
+            g.save(path);
+        }, py::arg("path"))
+        .def_static("load", &CHGraph::load, py::arg("path"))
+        // Unbuilt graph streamed from an osmnx GraphML file (no NetworkX);
+        // run build_ch_auto() / build_cch() and save() on it.
+        .def_static("from_graphml", [](const std::string& path, int num_threads, size_t chunk_mb) {
+            return CHGraph::from_graphml(path, num_threads, chunk_mb << 20);
+        }, py::arg("path"), py::arg("num_threads") = 0, py::arg("chunk_mb") = 64,
+           py::call_guard<py::gil_scoped_release>())
+        .def("get_build_stats", [](const CHGraph& g) {
+            long long total = 0;
+            for (long long c : g.shortcuts_per_level) total += c;
+            py::dict stats;
+            stats["shortcuts_per_level"] = g.shortcuts_per_level;
+            stats["total_shortcuts"] = total;
+            stats["levels"] = g.shortcuts_per_level.size();
+            return stats;
+        })
+        // Random CH queries vs. plain Dijkstra on the base edges.
+        .def("verify", [](CHGraph& g, int num_samples, unsigned seed, int num_threads) {
+            g.ensure_frozen();
+            CHGraph::VerifyResult res;
+            {
+                py::gil_scoped_release release;
+                res = g.verify(num_samples, seed, num_threads);
             }
-        }
-        
-        // Return infinity if no path, otherwise km
-        return (mu == std::numeric_limits<double>::infinity()) ? -1.0 : mu / 1000.0;
-    }
-
-
-
-    py::tuple query(int origin, int dest) {
-        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes) {
-            return py::make_tuple(py::list(), 0.0);
-        }
-
-        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> fwd_pq, bwd_pq;
-        std::vector<double> fwd_dist(num_nodes, std::numeric_limits<double>::infinity());
-        std::vector<double> bwd_dist(num_nodes, std::numeric_limits<double>::infinity());
-        std::vector<int> fwd_parent(num_nodes, -1);
-        std::vector<int> bwd_parent(num_nodes, -1);
-
-        fwd_pq.push({0.0, origin});
-        fwd_dist[origin] = 0.0;
-        bwd_pq.push({0.0, dest});
-        bwd_dist[dest] = 0.0;
-
-        double mu = std::numeric_limits<double>::infinity();
-        int meet_node = -1;
-
-        while (!fwd_pq.empty() || !bwd_pq.empty()) {
-            if (!fwd_pq.empty()) {
-                auto [d, u] = fwd_pq.top(); fwd_pq.pop();
-                if (d <= mu) {
-                    for (const auto& e : adj_out[u]) {
-                        if (rank[e.target] > rank[u]) {
-                            double new_dist = d + e.weight;
-                            if (new_dist < fwd_dist[e.target]) {
-                                fwd_dist[e.target] = new_dist;
-                                fwd_parent[e.target] = u;
-                                fwd_pq.push({new_dist, e.target});
-                                if (bwd_dist[e.target] != std::numeric_limits<double>::infinity()) {
-                                    double total = new_dist + bwd_dist[e.target];
-                                    if (total < mu) { mu = total; meet_node = e.target; }
-                                }
-                            }
-                        }
-                    }
+            py::dict out;
+            out["checked"] = res.checked;
+            out["mismatches"] = res.mismatches;
+            out["max_error_km"] = res.max_error_km;
+            return out;
+        }, py::arg("num_samples") = 100, py::arg("seed") = 0, py::arg("num_threads") = 0)
+        .def_readwrite("stop_early", &CHGraph::stop_early)
+        .def_readwrite("stall_on_demand", &CHGraph::stall_on_demand)
+        .def_readwrite("skip_settled", &CHGraph::skip_settled)
+        .def_readwrite("witness_settled_limit", &CHGraph::witness_settled_limit)
+        .def_readwrite("witness_hop_limit", &CHGraph::witness_hop_limit)
+        .def("get_graph_data", [](const CHGraph& g) {
+            py::list edges;
+            for (int u = 0; u < g.num_nodes; ++u) {
+                for (const auto& e : g.adj[u]) {
+                    if (e.has(Edge::FWD)) edges.append(py::make_tuple(u, e.target, e.weight, e.is_shortcut(), e.via_node()));
                 }
             }
-            if (!bwd_pq.empty()) {
-                auto [d, u] = bwd_pq.top(); bwd_pq.pop();
-                if (d <= mu) {
-                    for (const auto& e : adj_in[u]) {
-                        if (rank[e.target] > rank[u]) {
-                            double new_dist = d + e.weight;
-                            if (new_dist < bwd_dist[e.target]) {
-                                bwd_dist[e.target] = new_dist;
-                                bwd_parent[e.target] = u;
-                                bwd_pq.push({new_dist, e.target});
-                                if (fwd_dist[e.target] != std::numeric_limits<double>::infinity()) {
-                                    double total = new_dist + fwd_dist[e.target];
-                                    if (total < mu) { mu = total; meet_node = e.target; }
-                                }
-                            }
-                        }
-                    }
-                }
+            py::dict result;
+            result["edges"] = edges;
+            result["ranks"] = g.rank;
+            return result;
+        })
+        // Version of the weight snapshot new queries will use.
+        .def_property_readonly("metric_version", [](const CHGraph& g) {
+            auto metric = g.metric_snapshot();
+            return metric ? metric->version : 0;
+        })
+        // Queries freeze under the GIL if needed, then search without it;
+        // the result is converted to Python objects once the GIL is back.
+        // Every result ends with the metric version it was computed on,
+        // followed by a dict of search stats if stats=True. query() and
+        // query_geometry() go through the route cache once one is set.
+        // Sharded LRU of query results per (origin, dest, metric version);
+        // max_mb = 0 turns it off. Updating weights invalidates it.
+        .def("set_route_cache", [](CHGraph& g, double max_mb, int num_shards) {
+            if (!(max_mb >= 0) || num_shards < 1) throw py::value_error("need max_mb >= 0 and num_shards >= 1");
+            g.set_route_cache((size_t)(max_mb * (1 << 20)), num_shards);
+        }, py::arg("max_mb"), py::arg("num_shards") = 64)
+        .def("route_cache_stats", [](CHGraph& g) {
+            py::dict out;
+            auto cache = std::atomic_load(&g.route_cache);
+            out["enabled"] = (bool)cache;
+            if (!cache) return out;
+            RouteCache::Stats s = cache->stats();
+            out["hits"] = s.hits;
+            out["misses"] = s.misses;
+            out["insertions"] = s.insertions;
+            out["evictions"] = s.evictions;
+            out["invalidations"] = s.invalidations;
+            out["entries"] = s.entries;
+            out["bytes"] = s.bytes;
+            out["max_bytes"] = s.max_bytes;
+            return out;
+        })
+        .def("clear_route_cache", [](CHGraph& g) {
+            if (auto cache = std::atomic_load(&g.route_cache)) cache->clear();
+        })
+        .def("query", [=](CHGraph& g, int origin, int dest, QueryContext* ctx, bool stats) {
+            g.ensure_frozen();
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            std::pair<std::vector<int>, double> result;
+            {
+                py::gil_scoped_release release;
+                result = with_stats(qc, stats, [&] { return g.cached_query(origin, dest, qc); });
             }
-        }
-
-        if (meet_node == -1) return py::make_tuple(py::list(), 0.0);
-
-        std::vector<int> path;
-        
-        // Trace Origin -> Meet
-        std::vector<int> up_path;
-        int curr = meet_node;
-        while (curr != origin) {
-            int p = fwd_parent[curr];
-            up_path.push_back(curr);
-            curr = p;
-        }
-        path.push_back(origin);
-        
-        // Unpack Upward
-        curr = origin;
-        for (int i = up_path.size() - 1; i >= 0; --i) {
-            int next_node = up_path[i];
-            unpack(curr, next_node, path);
-            curr = next_node;
-        }
-
-        // Trace Meet -> Dest
-        curr = meet_node;
-        while (curr != dest) {
-            int next_node = bwd_parent[curr];
-            unpack(curr, next_node, path);
-            curr = next_node;
-        }
-
-        py::list res_path;
-        for (int n : path) res_path.append(n);
-
-        return py::make_tuple(res_path, mu / 1000.0);
-    }
-};
-
-PYBIND11_MODULE(ch_native, m) {
-    py::class_<CHGraph>(m, "CHGraph")
-        .def(py::init<int>())
-        .def("add_edge", &CHGraph::add_edge)
-        .def("add_ch_edge", &CHGraph::add_ch_edge)
-        .def("set_rank", &CHGraph::set_rank)
-        .def("build_ch", &CHGraph::build_ch)
-        .def("get_graph_data", &CHGraph::get_graph_data)
-        .def("query", &CHGraph::query)
-        .def("query_dist", &CHGraph::query_dist);
+            if (stats) return py::make_tuple(std::move(result.first), result.second, qc.metric_version, query_stats(qc));
+            return py::make_tuple(std::move(result.first), result.second, qc.metric_version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("ctx") = nullptr, py::arg("stats") = false)
+        .def("query_dist", [=](CHGraph& g, int origin, int dest, QueryContext* ctx, bool stats) {
+            g.ensure_frozen();
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            double km;
+            {
+                py::gil_scoped_release release;
+                km = with_stats(qc, stats, [&] { return g.query_dist(origin, dest, qc); });
+            }
+            if (stats) return py::make_tuple(km, qc.metric_version, query_stats(qc));
+            return py::make_tuple(km, qc.metric_version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("ctx") = nullptr, py::arg("stats") = false)
+        // The shortest route followed by up to k via-node alternatives:
+        // ([(path, km), ...], metric version), see query_alternatives.
+        .def("query_alternatives", [=](CHGraph& g, int origin, int dest, int k, double max_stretch,
+                                       double max_sharing, double local_optimality, QueryContext* ctx, bool stats) {
+            if (k < 0) throw std::invalid_argument("k must be >= 0");
+            g.ensure_frozen();
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            std::vector<std::pair<std::vector<int>, double>> routes;
+            {
+                py::gil_scoped_release release;
+                routes = with_stats(qc, stats, [&] {
+                    return g.query_alternatives(origin, dest, k, qc, max_stretch, max_sharing, local_optimality);
+                });
+            }
+            if (stats) return py::make_tuple(std::move(routes), qc.metric_version, query_stats(qc));
+            return py::make_tuple(std::move(routes), qc.metric_version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("k") = 2, py::arg("max_stretch") = 0.25,
+           py::arg("max_sharing") = 0.8, py::arg("local_optimality") = 0.25, py::arg("ctx") = nullptr,
+           py::arg("stats") = false)
+        // query() plus the full road geometry of the route:
+        // (geometry, km, metric version), see path_geometry. The stats
+        // also time the geometry (geometry_ns).
+        .def("query_geometry", [=](CHGraph& g, int origin, int dest, bool polyline, QueryContext* ctx, bool stats) {
+            g.ensure_frozen();
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            std::vector<double> latlon;
+            double km;
+            long long geometry_ns;
+            {
+                py::gil_scoped_release release;
+                auto m = g.metric_snapshot();
+                auto result = with_stats(qc, stats, [&] { return g.cached_query(origin, dest, qc, *m); });
+                auto start = std::chrono::steady_clock::now();
+                latlon = g.path_geometry(result.first, *m);
+                geometry_ns = elapsed_ns(start);
+                km = result.second;
+            }
+            if (stats) {
+                py::dict s = query_stats(qc);
+                s["geometry_ns"] = geometry_ns;
+                return py::make_tuple(geometry_result(latlon, polyline), km, qc.metric_version, s);
+            }
+            return py::make_tuple(geometry_result(latlon, polyline), km, qc.metric_version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("polyline") = false, py::arg("ctx") = nullptr,
+           py::arg("stats") = false)
+        // Geometry of a node path (e.g. from astar()): a (k, 2) array of
+        // (lat, lon), or an encoded polyline (precision 5) if polyline=True.
+        .def("path_geometry", [=](CHGraph& g, IntArray path, bool polyline) {
+            g.ensure_frozen();
+            std::vector<int> nodes(path.data(), path.data() + path.size());
+            std::vector<double> latlon;
+            {
+                py::gil_scoped_release release;
+                latlon = g.path_geometry(nodes, *g.metric_snapshot());
+            }
+            return geometry_result(latlon, polyline);
+        }, py::arg("path"), py::arg("polyline") = false)
+        // A* / weighted A* / ALT on the base edges with live weights;
+        // returns (path, km, metric version) like query().
+        .def("astar", [](CHGraph& g, int origin, int dest, double epsilon, bool landmarks, QueryContext* ctx) {
+            if (!(epsilon >= 1.0)) throw std::invalid_argument("epsilon must be >= 1");
+            g.ensure_frozen();
+            py::gil_scoped_release release;
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            auto [path, km] = g.astar(origin, dest, qc, epsilon, landmarks);
+            return std::make_tuple(std::move(path), km, qc.metric_version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("epsilon") = 1.0,
+           py::arg("landmarks") = false, py::arg("ctx") = nullptr)
+        // Time-dependent profiles, see TravelTimeProfiles: profile p has the
+        // breakpoints [offsets[p], offsets[p + 1]) of times (seconds of day)
+        // and factors; edge_profile holds one profile id per base edge (-1:
+        // none). Free-flow time is weight / speed, weights in metres.
+        .def("set_time_profiles", [=](CHGraph& g, Int64Array offsets, DoubleArray times, DoubleArray factors,
+                                      IntArray edge_profile, double speed_kmh) {
+            require_size(edge_profile, (py::ssize_t)g.base_src.size(), "edge_profile");
+            require_size(factors, times.size(), "factors");
+            const int64_t* off = offsets.data();
+            if (offsets.size() < 1 || off[0] != 0 || off[offsets.size() - 1] != times.size()) {
+                throw py::value_error("offsets must run from 0 to len(times)");
+            }
+            if (!(speed_kmh > 0)) throw py::value_error("speed_kmh must be positive");
+            g.set_time_profiles(off, offsets.size() - 1, times.data(), factors.data(), edge_profile.data(),
+                                edge_profile.size(), 3.6 / speed_kmh);
+        }, py::arg("offsets"), py::arg("times"), py::arg("factors"), py::arg("edge_profile"),
+           py::arg("speed_kmh") = 50.0)
+        // Earliest arrival leaving at `departure` (seconds):
+        // (path, arrival seconds or -1, metric version).
+        .def("td_query", [=](CHGraph& g, int origin, int dest, double departure, bool landmarks, QueryContext* ctx,
+                             bool stats) {
+            g.ensure_frozen();
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            std::pair<std::vector<int>, double> result;
+            {
+                py::gil_scoped_release release;
+                result = with_stats(qc, stats, [&] { return g.td_query(origin, dest, departure, qc, landmarks); });
+            }
+            if (stats) return py::make_tuple(std::move(result.first), result.second, qc.metric_version, query_stats(qc));
+            return py::make_tuple(std::move(result.first), result.second, qc.metric_version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("departure"), py::arg("landmarks") = false,
+           py::arg("ctx") = nullptr, py::arg("stats") = false)
+        // Arrival times for many departures of one pair (a schedule):
+        // (float64 array, -1 where unreachable, metric version).
+        .def("td_earliest_arrivals", [=](CHGraph& g, int origin, int dest, DoubleArray departures, bool landmarks,
+                                         int num_threads) {
+            g.ensure_frozen();
+            py::array_t<double> out(departures.size());
+            double* dst = out.mutable_data();
+            uint64_t version;
+            {
+                py::gil_scoped_release release;
+                version = g.td_earliest_arrivals(origin, dest, departures.data(), departures.size(), dst, landmarks,
+                                                 num_threads);
+            }
+            return py::make_tuple(out, version);
+        }, py::arg("origin"), py::arg("dest"), py::arg("departures"), py::arg("landmarks") = false,
+           py::arg("num_threads") = 0)
+        .def("build_landmarks", [](CHGraph& g, int count, int num_threads) {
+            g.ensure_frozen();
+            py::gil_scoped_release release;
+            return g.build_landmarks(count, num_threads);
+        }, py::arg("count") = 16, py::arg("num_threads") = 0)
+        // Snapping: nearest node index per point (-1 if none).
+        .def("nearest", [=](CHGraph& g, DoubleArray lats, DoubleArray lons, int num_threads) {
+            require_size(lons, lats.size(), "lons");
+            py::array_t<int> out((py::ssize_t)lats.size());
+            int* dst = out.mutable_data();
+            {
+                py::gil_scoped_release release;
+                g.nearest_nodes(lats.data(), lons.data(), lats.size(), dst, num_threads);
+            }
+            return out;
+        }, py::arg("lats"), py::arg("lons"), py::arg("num_threads") = 0)
+        // Returns (base edge ids, fraction along each edge from its source).
+        .def("nearest_edges", [=](CHGraph& g, DoubleArray lats, DoubleArray lons, int num_threads) {
+            require_size(lons, lats.size(), "lons");
+            py::array_t<int> edges((py::ssize_t)lats.size());
+            py::array_t<double> fraction((py::ssize_t)lats.size());
+            int* e = edges.mutable_data();
+            double* f = fraction.mutable_data();
+            {
+                py::gil_scoped_release release;
+                g.nearest_edges(lats.data(), lons.data(), lats.size(), e, f, num_threads);
+            }
+            return py::make_tuple(edges, fraction);
+        }, py::arg("lats"), py::arg("lons"), py::arg("num_threads") = 0)
+        // Landmark node indices in selection order (empty before build_landmarks()).
+        .def("get_landmarks", [](const CHGraph& g) {
+            auto lm = std::atomic_load(&g.landmarks);
+            py::array_t<int> nodes(lm ? (py::ssize_t)lm->nodes.size() : 0);
+            if (lm) std::copy(lm->nodes.begin(), lm->nodes.end(), nodes.mutable_data());
+            return nodes;
+        })
+        // Returns (a (len(sources), len(targets)) float64 array of km with
+        // -1 = unreachable, metric version).
+        .def("distance_matrix", [](CHGraph& g,
+                                   IntArray sources, IntArray targets,
+                                   int num_threads) {
+            g.ensure_frozen();
+            std::vector<int> src(sources.data(), sources.data() + sources.size());
+            std::vector<int> tgt(targets.data(), targets.data() + targets.size());
+            py::array_t<double> result({(py::ssize_t)src.size(), (py::ssize_t)tgt.size()});
+            double* out = result.mutable_data();
+            uint64_t version;
+            {
+                py::gil_scoped_release release;
+                version = g.distance_matrix(src, tgt, out, num_threads);
+            }
+            return py::make_tuple(result, version);
+        }, py::arg("sources"), py::arg("targets"), py::arg("num_threads") = 0)
+        // PHAST one-to-all: (array (len(sources), num_nodes) of km, -1 if
+        // unreachable; metric version).
+        .def("one_to_all", [](CHGraph& g, IntArray sources, int num_threads) {
+            g.ensure_frozen();
+            std::vector<int> src(sources.data(), sources.data() + sources.size());
+            py::array_t<double> result({(py::ssize_t)src.size(), (py::ssize_t)g.num_nodes});
+            double* out = result.mutable_data();
+            uint64_t version;
+            {
+                py::gil_scoped_release release;
+                version = g.one_to_all(src, out, num_threads);
+            }
+            return py::make_tuple(result, version);
+        }, py::arg("sources"), py::arg("num_threads") = 0)
+        // Nodes within max_km of the nearest source: (node array, metric version).
+        .def("isochrone", [](CHGraph& g, IntArray sources, double max_km, QueryContext* ctx) {
+            g.ensure_frozen();
+            std::vector<int> src(sources.data(), sources.data() + sources.size());
+            QueryContext& qc = ctx ? *ctx : QueryContext::local();
+            std::vector<int> nodes;
+            {
+                py::gil_scoped_release release;
+                nodes = g.isochrone(src, max_km, qc);
+            }
+            return py::make_tuple(py::array_t<int>(nodes.size(), nodes.data()), qc.metric_version);
+        }, py::arg("sources"), py::arg("max_km"), py::arg("ctx") = nullptr);
+
+    // Native request queue for asyncio servers, see QueryPool. submit()
+    // must be called on a running event loop and returns an asyncio.Future
+    // of the same result tuple as query_dist / query / query_geometry
+    // (kind "dist", "path" or "geometry"), raising RuntimeError if the
+    // query failed.
+    py::class_<AsyncQueryPool>(m, "QueryPool")
+        .def(py::init([](CHGraph& g, int num_threads, int max_batch) {
+            g.ensure_frozen();
+            auto p = std::make_unique<AsyncQueryPool>();
+            p->complete = py::cpp_function([](py::object future, py::object value, py::object error) {
+                if (future.attr("done")().cast<bool>()) return;   // cancelled
+                if (error.is_none()) future.attr("set_result")(value);
+                else future.attr("set_exception")(py::module_::import("builtins").attr("RuntimeError")(error));
+            });
+            AsyncQueryPool* self = p.get();
+            p->pool = std::make_unique<QueryPool>(
+                g, [self](std::vector<QueryPool::Result>& results) { self->finish(results); }, num_threads,
+                max_batch);
+            return p;
+        }), py::arg("graph"), py::arg("num_threads") = 0, py::arg("max_batch") = 64, py::keep_alive<1, 2>())
+        .def("submit", [](AsyncQueryPool& p, int origin, int dest, const std::string& kind) {
+            if (!p.pool) throw std::logic_error("QueryPool is closed");
+            QueryPool::Kind k;
+            if (kind == "dist") k = QueryPool::DIST;
+            else if (kind == "path") k = QueryPool::PATH;
+            else if (kind == "geometry") k = QueryPool::GEOMETRY;
+            else throw py::value_error("kind must be 'dist', 'path' or 'geometry'");
+            py::object loop = py::module_::import("asyncio").attr("get_running_loop")();
+            py::object future = loop.attr("create_future")();
+            uint64_t tag = p.next_tag++;
+            p.pending[tag] = {future, loop};
+            try {
+                p.pool->submit({tag, origin, dest, k});
+            } catch (...) {
+                p.pending.erase(tag);
+                throw;
+            }
+            return future;
+        }, py::arg("origin"), py::arg("dest"), py::arg("kind") = "path")
+        .def("close", &AsyncQueryPool::close)
+        .def_property_readonly("num_threads", [](const AsyncQueryPool& p) { return p.pool ? p.pool->num_threads() : 0; })
+        .def_property_readonly("stats", [](const AsyncQueryPool& p) {
+            py::dict out;
+            QueryPool::Stats s = p.pool ? p.pool->stats() : QueryPool::Stats();
+            out["submitted"] = s.submitted;
+            out["completed"] = s.completed;
+            out["batches"] = s.batches;
+            out["steals"] = s.steals;
+            out["pending"] = p.pool ? p.pool->pending() : 0;
+            return out;
+        });
+
+    // One per worker thread; reusing it avoids the O(num_nodes) setup per query.
+    py::class_<QueryContext>(m, "QueryContext")
+        .def(py::init<int>(), py::arg("num_nodes") = 0)
+        .def_readonly("settled_nodes", &QueryContext::settled_nodes)
+        .def_readonly("relaxed_edges", &QueryContext::relaxed_edges)
+        .def_readonly("metric_version", &QueryContext::metric_version)
+        // Time every query on this context (search_ns / unpack_ns).
+        .def_readwrite("timed", &QueryContext::timed)
+        .def_property_readonly("stats", query_stats);
+
+    // Process-wide query metrics, summed over all graphs and threads.
+    m.def("enable_query_metrics", [](bool enabled) { QueryMetrics::global().enable(enabled); },
+          py::arg("enabled") = true);
+    m.def("reset_query_metrics", []() { QueryMetrics::global().reset(); });
+    // {counter: total, ..., "latency_ns_hist": [...], "settled_nodes_hist":
+    // [...], "hist_bounds": [...]}; bucket b counts values below
+    // hist_bounds[b] (the last one is open-ended).
+    m.def("query_metrics", []() {
+        QueryMetrics::Snapshot snap = QueryMetrics::global().snapshot();
+        py::dict out;
+        for (int i = 0; i < QueryMetrics::NUM_COUNTERS; ++i) out[QueryMetrics::COUNTER_NAMES[i]] = snap.counters[i];
+        std::vector<uint64_t> bounds;
+        for (int b = 0; b < QueryMetrics::BUCKETS; ++b) bounds.push_back(uint64_t(1) << b);
+        out["enabled"] = QueryMetrics::global().enabled();
+        out["latency_ns_hist"] = std::vector<uint64_t>(snap.latency_ns.begin(), snap.latency_ns.end());
+        out["settled_nodes_hist"] = std::vector<uint64_t>(snap.settled_nodes.begin(), snap.settled_nodes.end());
+        out["hist_bounds"] = bounds;
+        return out;
+    });
 }
\ No newline at end of file
@@ -0,0 +1,4306 @@
+// backend/cpp_native/ch_engine.h
+// Contraction hierarchy engine: graph building, contraction, CCH
+// customization, queries and the binary file format. Free of Python, so
+// the ch_native bindings (ch_core.cpp) and ch_bench.cpp share it.
+#pragma once
+#include <vector>
+#include <cctype>
+#include <cstdlib>
+#include <limits>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <tuple>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <mutex>
+#include <array>
+#include <chrono>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CH_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Build-time adjacency entry, held in the lists of both end nodes (16
+// bytes). FWD: the edge runs from the list's node to `target`; BWD: from
+// `target` to the list's node. A two-way edge with the same weight and
+// via either way is one entry with both bits, so most road segments take
+// two entries instead of four. Direction and shortcut bits share a word
+// with via_node + 1 (0: none).
+struct Edge {
+    static constexpr uint32_t FWD = 1u << 31;
+    static constexpr uint32_t BWD = 1u << 30;
+    static constexpr uint32_t SHORTCUT = 1u << 29;
+    static constexpr uint32_t VIA_MASK = SHORTCUT - 1;
+    static constexpr int MAX_NODES = (int)VIA_MASK - 1;
+
+    double weight;
+    int target;
+    uint32_t bits;
+
+    Edge(int target, double weight, bool is_shortcut, int via, uint32_t dir)
+        : weight(weight), target(target), bits(dir | (is_shortcut ? SHORTCUT : 0) | ((uint32_t)(via + 1) & VIA_MASK)) {}
+
+    bool is_shortcut() const { return bits & SHORTCUT; }
+    int via_node() const { return (int)(bits & VIA_MASK) - 1; }
+    bool has(uint32_t dir) const { return bits & dir; }
+    uint32_t dirs() const { return bits & (FWD | BWD); }
+    void set_via(int via) { bits = (bits & ~VIA_MASK) | ((uint32_t)(via + 1) & VIA_MASK); }
+};
+static_assert(sizeof(Edge) == 16, "Edge should stay 16 bytes");
+
+// Read-only array that either owns its storage or views memory owned by
+// someone else (a mapped CH file). Writes go through resize() /
+// mutable_data(), which first copy a view into owned storage.
+template <typename T>
+class Buffer {
+public:
+    using value_type = T;
+
+    Buffer() = default;
+    Buffer(const Buffer& o) { *this = o; }
+    Buffer(Buffer&&) = default;   // vector moves keep their heap block
+    Buffer& operator=(Buffer&&) = default;
+    Buffer& operator=(const Buffer& o) {
+        if (this == &o) return *this;
+        if (o.is_view()) {
+            owned.clear();
+            ptr = o.ptr;
+            len = o.len;
+        } else {
+            assign(std::vector<T>(o.owned));
+        }
+        return *this;
+    }
+
+    void assign(std::vector<T>&& v) {
+        owned = std::move(v);
+        ptr = owned.data();
+        len = owned.size();
+    }
+
+    void view(const T* data, size_t n) {
+        std::vector<T>().swap(owned);
+        ptr = data;
+        len = n;
+    }
+
+    void resize(size_t n, const T& value = T()) {
+        if (is_view()) owned.assign(ptr, ptr + len);
+        owned.resize(n, value);
+        ptr = owned.data();
+        len = n;
+    }
+
+    T* mutable_data() {
+        if (is_view()) resize(len);
+        return owned.data();
+    }
+
+    void push_back(const T& value) {
+        if (is_view()) owned.assign(ptr, ptr + len);
+        owned.push_back(value);
+        ptr = owned.data();
+        len = owned.size();
+    }
+
+    bool is_view() const { return len > 0 && ptr != owned.data(); }
+    const T* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + len; }
+
+private:
+    std::vector<T> owned;
+    const T* ptr = nullptr;
+    size_t len = 0;
+};
+
+// Flat, query-only view of one search direction of the hierarchy.
+// Only arcs towards higher-ranked nodes are kept, so the query loops
+// never have to look at rank[] or skip downward edges. Targets are
+// sorted per node, so an arc can be found by binary search. Weights and
+// middle nodes are per-arc metric data and live in a Metric.
+struct UpwardGraph {
+    Buffer<int> offsets;   // num_nodes + 1 entries
+    Buffer<int> targets;
+
+    int begin(int u) const { return offsets[u]; }
+    int end(int u) const { return offsets[u + 1]; }
+
+    // Index of arc u -> t, or -1.
+    int find(int u, int t) const {
+        const int* first = targets.data() + begin(u);
+        const int* last = targets.data() + end(u);
+        const int* it = std::lower_bound(first, last, t);
+        return (it != last && *it == t) ? (int)(it - targets.data()) : -1;
+    }
+
+    // Per node: keep upward arcs only, one per target (the cheapest), from
+    // the entries that have direction bit `dir`. `weights` / `via` receive
+    // the arcs' metric data. With a renumbering (order: internal ->
+    // external node, index: the inverse; both null for identity) the
+    // graph, targets and vias use internal node numbers.
+    void build(const std::vector<std::vector<Edge>>& adj, uint32_t dir, const std::vector<int>& rank,
+               const int* order, const int* index, Buffer<double>& weights, Buffer<int>& via) {
+        int n = (int)adj.size();
+        auto internal = [&](int v) { return (!index || v < 0) ? v : index[v]; };
+        std::vector<int> offs(n + 1, 0), tgts, vias;
+        std::vector<double> wts;
+        std::vector<std::tuple<int, double, int>> arcs;
+        for (int iu = 0; iu < n; ++iu) {
+            int u = order ? order[iu] : iu;
+            arcs.clear();
+            for (const auto& e : adj[u]) {
+                if (e.has(dir) && rank[e.target] > rank[u]) {
+                    arcs.push_back({internal(e.target), e.weight, e.is_shortcut() ? internal(e.via_node()) : -1});
+                }
+            }
+            std::sort(arcs.begin(), arcs.end());
+            for (size_t i = 0; i < arcs.size(); ++i) {
+                if (i > 0 && std::get<0>(arcs[i]) == std::get<0>(arcs[i - 1])) continue;
+                tgts.push_back(std::get<0>(arcs[i]));
+                wts.push_back(std::get<1>(arcs[i]));
+                vias.push_back(std::get<2>(arcs[i]));
+            }
+            offs[iu + 1] = (int)tgts.size();
+        }
+        offsets.assign(std::move(offs));
+        targets.assign(std::move(tgts));
+        weights.assign(std::move(wts));
+        via.assign(std::move(vias));
+    }
+};
+
+// CSR over the original edges, one arc per base edge, for the searches
+// that must not see shortcuts. Arcs carry their base edge id, so weights
+// are read from whichever Metric the search pinned.
+struct BaseGraph {
+    std::vector<int> offsets;
+    std::vector<int> targets;
+    std::vector<int> edges;
+
+    int begin(int u) const { return offsets[u]; }
+    int end(int u) const { return offsets[u + 1]; }
+
+    // Arc from[i] -> to[i] for every base edge i.
+    void build(int n, const int* from, const int* to, size_t m) {
+        offsets.assign(n + 1, 0);
+        for (size_t i = 0; i < m; ++i) offsets[from[i] + 1]++;
+        for (int u = 0; u < n; ++u) offsets[u + 1] += offsets[u];
+        targets.resize(m);
+        edges.resize(m);
+        std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < m; ++i) {
+            int k = fill[from[i]]++;
+            targets[k] = to[i];
+            edges[k] = (int)i;
+        }
+    }
+};
+
+// Landmark distances for ALT lower bounds, node-major so that one bound
+// reads two contiguous rows. Row v holds d(L_k, v) in lanes [0, stride)
+// and d(v, L_k) in [stride, 2 * stride), +inf if unreachable; padding
+// lanes are 0. Rows are 64-byte aligned.
+class LandmarkTable {
+public:
+    std::vector<int> nodes;
+    uint64_t metric_version = 0;   // metric the distances were computed on
+
+    // An n-node table for `count` landmarks, all lanes 0, to be filled
+    // through from() and to().
+    LandmarkTable(int n, int count) : stride(stride_for(count)) {
+        storage.assign(values(n, count) + 8, 0.0);
+        uintptr_t p = (uintptr_t)storage.data();
+        writable = storage.data() + ((64 - p % 64) % 64) / sizeof(double);
+        rows.view(writable, values(n, count));
+    }
+    // A read-only table on `mapped` rows (values(n, count) of them, 64-byte
+    // aligned), used in place, e.g. from a CH file mapping.
+    LandmarkTable(int count, Buffer<double> mapped) : stride(stride_for(count)), rows(std::move(mapped)) {}
+    LandmarkTable(const LandmarkTable&) = delete;
+    LandmarkTable& operator=(const LandmarkTable&) = delete;
+
+    double* from(int v) { return writable + (size_t)v * 2 * stride; }
+    double* to(int v) { return from(v) + stride; }
+
+    // Number of row values of an n-node table for `count` landmarks.
+    static size_t values(int n, int count) { return (size_t)n * 2 * stride_for(count); }
+
+    // All rows of an n-node table, as CHGraph::save stores them.
+    const double* data() const { return rows.data(); }
+    size_t size(int n) const { return (size_t)n * 2 * stride; }
+
+    // max over k of d(L_k, t) - d(L_k, u) and d(u, L_k) - d(t, L_k), and 0.
+    // inf - inf terms (NaN) are dropped; inf - finite correctly means t is
+    // unreachable from u.
+    double bound(int u, int t) const {
+        const double* a = rows.data() + (size_t)u * 2 * stride;
+        const double* b = rows.data() + (size_t)t * 2 * stride;
+#ifdef CH_SSE2
+        // maxpd returns its second operand if either is NaN
+        __m128d h = _mm_setzero_pd();
+        for (int k = 0; k < stride; k += 2) {
+            __m128d fwd = _mm_sub_pd(_mm_load_pd(b + k), _mm_load_pd(a + k));
+            __m128d bwd = _mm_sub_pd(_mm_load_pd(a + stride + k), _mm_load_pd(b + stride + k));
+            h = _mm_max_pd(fwd, h);
+            h = _mm_max_pd(bwd, h);
+        }
+        return std::max(_mm_cvtsd_f64(h), _mm_cvtsd_f64(_mm_unpackhi_pd(h, h)));
+#else
+        double h = 0.0;
+        for (int k = 0; k < stride; ++k) {
+            double fwd = b[k] - a[k], bwd = a[stride + k] - b[stride + k];
+            if (fwd > h) h = fwd;
+            if (bwd > h) h = bwd;
+        }
+        return h;
+#endif
+    }
+
+private:
+    static int stride_for(int count) { return (count + 3) & ~3; }
+
+    int stride;     // lanes per direction, a multiple of 4 (one row = 64 * k bytes)
+    std::vector<double> storage;   // empty for a mapped table
+    double* writable = nullptr;    // aligned start of storage
+    Buffer<double> rows;           // view of storage or of the mapping
+};
+
+// Time-dependent travel times: a pool of periodic piecewise-linear
+// profiles, each a factor on an edge's free-flow time (live weight times
+// seconds_per_unit). The breakpoints of all profiles are packed into one
+// array at 4 bytes each: time of day in units of PERIOD / 65536 (about
+// 1.3 s) and factor in units of 1/1024 (below 64x). Edges refer to a
+// profile by id, so a few road-class curves serve every edge. Immutable;
+// CHGraph swaps in a new pool as a whole.
+struct TravelTimeProfiles {
+    static constexpr double PERIOD = 86400.0;   // seconds
+    static constexpr double TICKS = 65536.0;    // time units per period
+    static constexpr double FACTOR_UNIT = 1.0 / 1024.0;
+
+    struct Point { uint16_t time, factor; };
+    std::vector<uint32_t> offsets;   // profile p: points [offsets[p], offsets[p + 1])
+    std::vector<Point> points;
+    std::vector<int> edge_profile;   // per base edge, -1: factor 1 at all times
+    double seconds_per_unit = 1.0;
+    double min_factor = 1.0;         // over every profile and 1, for lower bounds
+
+    TravelTimeProfiles() = default;   // filled in by CHGraph::load
+
+    // Profile p has the breakpoints [profile_offsets[p], profile_offsets[p + 1])
+    // of times (seconds of day, increasing) / factors.
+    TravelTimeProfiles(const int64_t* profile_offsets, size_t num_profiles, const double* times,
+                       const double* factors, const int* edges, size_t num_edges, double seconds_per_unit)
+        : seconds_per_unit(seconds_per_unit) {
+        if (!(seconds_per_unit > 0)) throw std::invalid_argument("seconds per weight unit must be positive");
+        offsets.push_back(0);
+        for (size_t p = 0; p < num_profiles; ++p) {
+            if (profile_offsets[p + 1] <= profile_offsets[p]) throw std::invalid_argument("every profile needs a breakpoint");
+            for (int64_t k = profile_offsets[p]; k < profile_offsets[p + 1]; ++k) {
+                if (!(times[k] >= 0 && times[k] < PERIOD)) throw std::invalid_argument("profile times must lie in [0, 86400)");
+                long factor = std::lround(factors[k] / FACTOR_UNIT);
+                if (factor < 1 || factor > 65535) throw std::invalid_argument("profile factors must lie in (0, 64)");
+                Point q{(uint16_t)(times[k] / PERIOD * TICKS), (uint16_t)factor};
+                if (k > profile_offsets[p] && q.time <= points.back().time) {
+                    throw std::invalid_argument("profile times must increase (by at least 1.3 s)");
+                }
+                points.push_back(q);
+                min_factor = std::min(min_factor, q.factor * FACTOR_UNIT);
+            }
+            offsets.push_back((uint32_t)points.size());
+        }
+        edge_profile.assign(edges, edges + num_edges);
+        for (int p : edge_profile) {
+            if (p < -1 || p >= (int)num_profiles) throw std::out_of_range("edge profile id out of range");
+        }
+    }
+
+    // Factor of profile p at time t (seconds, any day), interpolated
+    // linearly between breakpoints and across midnight.
+    double factor(int p, double t) const {
+        if (p < 0) return 1.0;
+        const Point* first = points.data() + offsets[p];
+        const Point* last = points.data() + offsets[p + 1];
+        if (last - first == 1) return first->factor * FACTOR_UNIT;
+        double x = std::fmod(t, PERIOD) / PERIOD * TICKS;
+        if (x < 0) x += TICKS;
+        const Point* hi = std::upper_bound(first, last, x, [](double v, const Point& q) { return v < q.time; });
+        const Point* lo = hi == first ? last - 1 : hi - 1;
+        double t0 = lo->time, t1;
+        if (hi == first) t0 -= TICKS;   // before the first breakpoint: from the previous day's last
+        if (hi == last) {
+            hi = first;
+            t1 = first->time + TICKS;
+        } else {
+            t1 = hi->time;
+        }
+        double a = (x - t0) / (t1 - t0);
+        return (lo->factor + a * ((double)hi->factor - lo->factor)) * FACTOR_UNIT;
+    }
+
+    // Seconds to traverse base edge e (live weight w) when entering it at t.
+    double travel_time(int e, double w, double t) const {
+        return w * seconds_per_unit * factor(edge_profile[e], t);
+    }
+};
+
+// Everything that depends on the edge weights: arc weights, shortcut
+// middle nodes and child arcs, the path cache and the base edge weights.
+// Queries pin one version through a shared_ptr for their whole run, so a
+// writer never changes a Metric that is still being read.
+struct Metric {
+    uint64_t version = 0;
+    Buffer<double> fwd_weights, bwd_weights;   // per upward CSR arc
+    Buffer<int> fwd_via, bwd_via;              // contracted middle node, -1 for base arcs
+    Buffer<int> first;                         // per global arc: child arc u -> x, -1 for a base arc
+    Buffer<int> second;                        // child arc x -> v
+    Buffer<double> base_weight;                // per base edge
+
+    // Optional flattened expansions of top-level shortcuts.
+    std::vector<int> cache_offset;   // num_arcs + 1 entries, or empty
+    std::vector<int> cache_nodes;
+};
+
+// Shortcut unpacking table, built once at freeze time. Arcs get global ids:
+// forward-upward CSR arcs first, then backward-upward ones (offset by
+// num_fwd). A shortcut u -> v via x refers directly to its two child arcs
+// u -> x and x -> v (stored in the Metric); `head` is where an arc ends in
+// travel direction.
+struct UnpackTable {
+    int num_fwd = 0;
+    Buffer<int> head;
+
+    int bwd_arc(int i) const { return num_fwd + i; }
+
+    // Fills head and the child arcs of m from the middle nodes in m.
+    void build(const UpwardGraph& fwd, const UpwardGraph& bwd, Metric& m) {
+        int n = (int)fwd.offsets.size() - 1;
+        num_fwd = (int)fwd.targets.size();
+        int total = num_fwd + (int)bwd.targets.size();
+        std::vector<int> f(total, -1), s(total, -1), h(total, -1);
+        // Child arcs of a shortcut via x both live at x: the half leading
+        // down into x in bwd[x], the half leading up out of x in fwd[x].
+        auto link = [&](int a, int via, int from, int to) {
+            if (via < 0) return;
+            int down = bwd.find(via, from);
+            int up = fwd.find(via, to);
+            if (down < 0 || up < 0) return;   // inconsistent input: treat as base arc
+            f[a] = bwd_arc(down);
+            s[a] = up;
+        };
+        for (int u = 0; u < n; ++u) {
+            for (int i = fwd.begin(u); i < fwd.end(u); ++i) {   // u -> t
+                h[i] = fwd.targets[i];
+                link(i, m.fwd_via[i], u, fwd.targets[i]);
+            }
+            for (int i = bwd.begin(u); i < bwd.end(u); ++i) {   // t -> u
+                h[bwd_arc(i)] = u;
+                link(bwd_arc(i), m.bwd_via[i], bwd.targets[i], u);
+            }
+        }
+        m.first.assign(std::move(f));
+        m.second.assign(std::move(s));
+        head.assign(std::move(h));
+        m.cache_offset.clear();
+        m.cache_nodes.clear();
+    }
+};
+
+// Read-only memory mapping of a whole file. Every process that maps the
+// same file shares its physical pages.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open " + path);
+        LARGE_INTEGER sz;
+        GetFileSizeEx(file, &sz);
+        len = (size_t)sz.QuadPart;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) { CloseHandle(file); throw std::runtime_error("cannot map " + path); }
+        ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!ptr) { CloseHandle(mapping); CloseHandle(file); throw std::runtime_error("cannot map " + path); }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) { ::close(fd); throw std::runtime_error("cannot stat " + path); }
+        len = (size_t)st.st_size;
+        void* p = len ? mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+        ptr = (const char*)p;
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        UnmapViewOfFile(ptr);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        if (ptr) munmap((void*)ptr, len);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+    const char* ptr = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+// Binary CH file: a header, a section directory, then one 64-byte aligned
+// array per section. Bump VERSION whenever the layout changes.
+namespace chfile {
+    constexpr char MAGIC[8] = {'C', 'H', 'G', 'R', 'A', 'P', 'H', '\0'};
+    constexpr uint32_t VERSION = 4;   // 2: unpacking table, 3: base edges + CCH flag, 4: node order
+    constexpr uint32_t ENDIAN_TAG = 0x01020304;
+    constexpr size_t ALIGN = 64;
+
+    enum Section : uint32_t {
+        RANK = 1,
+        FWD_OFFSETS, FWD_TARGETS, FWD_WEIGHTS, FWD_VIA,
+        BWD_OFFSETS, BWD_TARGETS, BWD_WEIGHTS, BWD_VIA,
+        NODE_LAT, NODE_LON, NODE_IDS,
+        ARC_FIRST, ARC_SECOND, ARC_HEAD,
+        BASE_SRC, BASE_DST, BASE_WEIGHT, BASE_ARC,
+        GEOM_OFFSETS, GEOM_DATA,   // optional edge shapes
+        NODE_ORDER,                // internal -> external node; absent: identity
+        LANDMARK_NODES, LANDMARK_ROWS,   // optional ALT table (LandmarkTable layout)
+        TIME_OFFSETS, TIME_POINTS, TIME_EDGE_PROFILE, TIME_SCALE,   // optional TravelTimeProfiles
+    };
+
+    enum Flags : uint32_t {
+        FLAG_CUSTOMIZABLE = 1,   // CCH topology; BASE_ARC is present
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t endian_tag;
+        uint64_t num_nodes;
+        uint32_t num_sections;
+        uint32_t flags;
+    };
+
+    struct SectionEntry {
+        uint32_t id;
+        uint32_t elem_size;
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct PendingSection {
+        uint32_t id;
+        uint32_t elem_size;
+        const void* data;
+        uint64_t count;
+    };
+
+    template <typename T>
+    PendingSection section(uint32_t id, const Buffer<T>& b) {
+        return {id, (uint32_t)sizeof(T), b.data(), b.size()};
+    }
+
+    inline void write(const std::string& path, uint64_t num_nodes, const std::vector<PendingSection>& sections,
+                      uint32_t flags = 0) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("cannot write " + path);
+
+        Header h{};
+        std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = VERSION;
+        h.endian_tag = ENDIAN_TAG;
+        h.num_nodes = num_nodes;
+        h.num_sections = (uint32_t)sections.size();
+        h.flags = flags;
+
+        std::vector<SectionEntry> dir;
+        uint64_t pos = sizeof(Header) + sections.size() * sizeof(SectionEntry);
+        for (const auto& sec : sections) {
+            pos = (pos + ALIGN - 1) / ALIGN * ALIGN;
+            dir.push_back({sec.id, sec.elem_size, pos, sec.count});
+            pos += sec.count * sec.elem_size;
+        }
+
+        out.write((const char*)&h, sizeof(h));
+        out.write((const char*)dir.data(), dir.size() * sizeof(SectionEntry));
+        static const char zeros[ALIGN] = {};
+        for (size_t i = 0; i < sections.size(); ++i) {
+            uint64_t here = (uint64_t)out.tellp();
+            out.write(zeros, dir[i].offset - here);
+            out.write((const char*)sections[i].data, sections[i].count * sections[i].elem_size);
+        }
+        if (!out) throw std::runtime_error("error writing " + path);
+    }
+}
+
+// Edge shapes are stored as fixed-point (1e-6 degree) lat / lon deltas
+// from the previous point, zigzag varint coded: a few bytes per point.
+namespace geometry {
+    constexpr double SCALE = 1e6;
+
+    inline void put_varint(std::vector<uint8_t>& out, int64_t v) {
+        uint64_t z = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+        while (z >= 0x80) { out.push_back((uint8_t)(z | 0x80)); z >>= 7; }
+        out.push_back((uint8_t)z);
+    }
+
+    inline int64_t get_varint(const uint8_t*& p) {
+        uint64_t z = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t b = *p++;
+            z |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+    }
+
+    // Google encoded polyline of interleaved (lat, lon) pairs.
+    inline std::string encode_polyline(const std::vector<double>& latlon, int precision = 5) {
+        const double factor = std::pow(10.0, precision);
+        std::string out;
+        int64_t prev[2] = {0, 0};
+        for (size_t i = 0; i < latlon.size(); ++i) {
+            int64_t v = (int64_t)std::llround(latlon[i] * factor);
+            int64_t d = v - prev[i % 2];
+            prev[i % 2] = v;
+            uint64_t z = d < 0 ? ~((uint64_t)d << 1) : (uint64_t)d << 1;
+            while (z >= 0x20) { out.push_back((char)((0x20 | (z & 0x1f)) + 63)); z >>= 5; }
+            out.push_back((char)(z + 63));
+        }
+        return out;
+    }
+}
+
+// Uniform grid over the node coordinates for nearest-node and
+// nearest-edge snapping. Coordinates are projected to metres around the
+// mean latitude (fine at city scale); cells hold about two nodes, stored
+// as CSR. An edge is listed in every cell its bounding box touches, so
+// its closest point is always in a listed cell. Queries scan rings of
+// cells outward until no unscanned cell can hold anything closer.
+class SpatialIndex {
+public:
+    void build(const double* lat, const double* lon, int n, const int* src, const int* dst, size_t m) {
+        const double R = 6371000.0, RAD = 3.14159265358979323846 / 180.0;
+        double lat_sum = 0.0;
+        int valid = 0;
+        for (int v = 0; v < n; ++v) {
+            if (std::isfinite(lat[v]) && std::isfinite(lon[v])) { lat_sum += lat[v]; valid++; }
+        }
+        if (valid == 0) throw std::logic_error("spatial index needs node coordinates (set_nodes)");
+        kx = R * RAD * std::cos(lat_sum / valid * RAD);
+        ky = R * RAD;
+
+        const double INF = std::numeric_limits<double>::infinity();
+        x.resize(n);
+        y.resize(n);
+        double max_x = -INF, max_y = -INF;
+        min_x = min_y = INF;
+        for (int v = 0; v < n; ++v) {
+            x[v] = lon[v] * kx;
+            y[v] = lat[v] * ky;
+            if (!has_coords(v)) continue;
+            min_x = std::min(min_x, x[v]); max_x = std::max(max_x, x[v]);
+            min_y = std::min(min_y, y[v]); max_y = std::max(max_y, y[v]);
+        }
+        cell = std::max(1.0, std::sqrt(std::max((max_x - min_x) * (max_y - min_y), 1.0) / valid * 2.0));
+        nx = std::min((int)((max_x - min_x) / cell) + 1, 1 << 15);
+        ny = std::min((int)((max_y - min_y) / cell) + 1, 1 << 15);
+        cell = std::max(cell, std::max((max_x - min_x) / nx, (max_y - min_y) / ny) * (1 + 1e-9));
+
+        fill_cells(node_offsets, node_items, n, [&](int v, auto&& add) {
+            if (has_coords(v)) add(cell_x(x[v]), cell_y(y[v]), cell_x(x[v]), cell_y(y[v]));
+        });
+        edge_src.assign(src, src + m);
+        edge_dst.assign(dst, dst + m);
+        fill_cells(edge_offsets, edge_items, (int)m, [&](int e, auto&& add) {
+            int a = src[e], b = dst[e];
+            if (!has_coords(a) || !has_coords(b)) return;
+            add(cell_x(std::min(x[a], x[b])), cell_y(std::min(y[a], y[b])),
+                cell_x(std::max(x[a], x[b])), cell_y(std::max(y[a], y[b])));
+        });
+    }
+
+    // Closest node with coordinates, -1 if there is none.
+    int nearest_node(double lat, double lon) const {
+        double qx = lon * kx, qy = lat * ky;
+        return scan(qx, qy, node_offsets, node_items, [&](int v) { return std::hypot(x[v] - qx, y[v] - qy); });
+    }
+
+    // Closest base edge (-1 if none) and the fraction along it, from its
+    // source, of the point closest to (lat, lon).
+    std::pair<int, double> nearest_edge(double lat, double lon) const {
+        double qx = lon * kx, qy = lat * ky;
+        int e = scan(qx, qy, edge_offsets, edge_items, [&](int e) {
+            double t = project(e, qx, qy);
+            int a = edge_src[e], b = edge_dst[e];
+            return std::hypot(x[a] + t * (x[b] - x[a]) - qx, y[a] + t * (y[b] - y[a]) - qy);
+        });
+        return {e, e >= 0 ? project(e, qx, qy) : 0.0};
+    }
+
+private:
+    double kx = 0, ky = 0;          // degrees -> metres
+    double min_x = 0, min_y = 0, cell = 1;
+    int nx = 0, ny = 0;
+    std::vector<double> x, y;       // projected node coordinates, NaN if unknown
+    std::vector<int> edge_src, edge_dst;
+    std::vector<int> node_offsets, node_items;   // per cell: nodes
+    std::vector<int> edge_offsets, edge_items;   // per cell: base edges
+
+    bool has_coords(int v) const { return std::isfinite(x[v]) && std::isfinite(y[v]); }
+    int cell_x(double px) const { return std::max(0, std::min(nx - 1, (int)((px - min_x) / cell))); }
+    int cell_y(double py) const { return std::max(0, std::min(ny - 1, (int)((py - min_y) / cell))); }
+
+    // Parameter of the point on edge e closest to (qx, qy), in [0, 1].
+    double project(int e, double qx, double qy) const {
+        int a = edge_src[e], b = edge_dst[e];
+        double dx = x[b] - x[a], dy = y[b] - y[a], len2 = dx * dx + dy * dy;
+        if (len2 <= 0.0) return 0.0;
+        return std::max(0.0, std::min(1.0, ((qx - x[a]) * dx + (qy - y[a]) * dy) / len2));
+    }
+
+    // Two passes over the items: count per cell, then fill. `cells(i, add)`
+    // calls add(x0, y0, x1, y1) with the cell range item i covers.
+    template <class F>
+    void fill_cells(std::vector<int>& offsets, std::vector<int>& items, int count, F&& cells) {
+        offsets.assign((size_t)nx * ny + 1, 0);
+        cells_each(count, cells, [&](int, size_t c) { offsets[c + 1]++; });
+        for (size_t c = 0; c + 1 < offsets.size(); ++c) offsets[c + 1] += offsets[c];
+        items.resize(offsets.back());
+        std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+        cells_each(count, cells, [&](int i, size_t c) { items[fill[c]++] = i; });
+    }
+
+    template <class F, class G>
+    void cells_each(int count, F& cells, G&& emit) const {
+        for (int i = 0; i < count; ++i) {
+            cells(i, [&](int x0, int y0, int x1, int y1) {
+                for (int cy = y0; cy <= y1; ++cy)
+                    for (int cx = x0; cx <= x1; ++cx) emit(i, (size_t)cy * nx + cx);
+            });
+        }
+    }
+
+    // Ring search around the query's cell (clamped to one cell outside the
+    // grid, which keeps the ring bound valid). After ring r every unscanned
+    // item is at least r * cell away.
+    template <class F>
+    int scan(double qx, double qy, const std::vector<int>& offsets, const std::vector<int>& items, F&& dist) const {
+        if (!(std::isfinite(qx) && std::isfinite(qy)) || items.empty()) return -1;
+        int cx = (int)std::floor((std::max(min_x - cell, std::min(qx, min_x + nx * cell)) - min_x) / cell);
+        int cy = (int)std::floor((std::max(min_y - cell, std::min(qy, min_y + ny * cell)) - min_y) / cell);
+        int best = -1;
+        double best_dist = std::numeric_limits<double>::infinity();
+        int r_max = std::max(nx, ny) + 1;
+        for (int r = 0; r <= r_max; ++r) {
+            if (best >= 0 && best_dist <= (r - 1) * cell) break;
+            for (int j = std::max(cy - r, 0); j <= std::min(cy + r, ny - 1); ++j) {
+                int step = (r == 0 || j == cy - r || j == cy + r) ? 1 : 2 * r;   // ring border only
+                for (int i = cx - r; i <= cx + r; i += step) {
+                    if (i < 0 || i >= nx) continue;
+                    size_t c = (size_t)j * nx + i;
+                    for (int k = offsets[c]; k < offsets[c + 1]; ++k) {
+                        double d = dist(items[k]);
+                        if (d < best_dist || (d == best_dist && items[k] < best)) { best_dist = d; best = items[k]; }
+                    }
+                }
+            }
+        }
+        return best;
+    }
+};
+
+// Priority queues for the Dijkstra-style searches, picked at compile time
+// (CH_QUERY_HEAP, CH_ASTAR_HEAP, CH_WITNESS_HEAP below; the Heap parameter
+// of CHGraph::query / query_dist and BasicWitnessSearch). All share one interface: reset(n) before a search
+// over n nodes, update(u, key) to insert u or lower its key, pop() for the
+// (key, node) with the smallest key, plus empty() and min_key().
+
+// std::push_heap binary heap with lazy deletion: update() always pushes, so
+// a node can be popped again with an outdated key and the search has to
+// skip such stale entries.
+class LazyBinaryHeap {
+public:
+    using Entry = std::pair<double, int>;
+
+    void reset(int) { heap.clear(); }
+    bool empty() const { return heap.empty(); }
+    double min_key() const { return heap.front().first; }
+
+    void update(int u, double key) {
+        heap.push_back({key, u});
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+
+    Entry pop() {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+        Entry top = heap.back();
+        heap.pop_back();
+        return top;
+    }
+
+private:
+    std::vector<Entry> heap;
+};
+
+// D-ary heap with a position map, so update() decreases a key in place and
+// every node is in the heap at most once (no stale entries). The heap array
+// only holds touched nodes; the map is reset through a generation stamp.
+template <int D>
+class IndexedDaryHeap {
+public:
+    using Entry = std::pair<double, int>;
+
+    void reset(int n) {
+        if ((int)stamp.size() != n) {
+            pos.resize(n);
+            stamp.assign(n, 0);
+            generation = 0;
+        }
+        if (++generation == 0) {
+            std::fill(stamp.begin(), stamp.end(), 0);
+            generation = 1;
+        }
+        heap.clear();
+    }
+
+    bool empty() const { return heap.empty(); }
+    double min_key() const { return heap.front().first; }
+
+    void update(int u, double key) {
+        if (stamp[u] != generation || pos[u] < 0) {   // new, or popped earlier
+            stamp[u] = generation;
+            heap.push_back({key, u});
+            sift_up((int)heap.size() - 1);
+        } else if (key < heap[pos[u]].first) {
+            heap[pos[u]].first = key;
+            sift_up(pos[u]);
+        }
+    }
+
+    Entry pop() {
+        Entry top = heap.front();
+        pos[top.second] = -1;
+        Entry last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            heap[0] = last;
+            sift_down(0);
+        }
+        return top;
+    }
+
+private:
+    std::vector<Entry> heap;
+    std::vector<int> pos;   // index in heap, -1 once popped
+    std::vector<uint32_t> stamp;
+    uint32_t generation = 0;
+
+    void sift_up(int i) {
+        Entry e = heap[i];
+        while (i > 0) {
+            int parent = (i - 1) / D;
+            if (!(e.first < heap[parent].first)) break;
+            heap[i] = heap[parent];
+            pos[heap[i].second] = i;
+            i = parent;
+        }
+        heap[i] = e;
+        pos[e.second] = i;
+    }
+
+    void sift_down(int i) {
+        Entry e = heap[i];
+        const int n = (int)heap.size();
+        while (true) {
+            int first = D * i + 1;
+            if (first >= n) break;
+            int best = first;
+            for (int c = first + 1; c < std::min(first + D, n); ++c) {
+                if (heap[c].first < heap[best].first) best = c;
+            }
+            if (!(heap[best].first < e.first)) break;
+            heap[i] = heap[best];
+            pos[heap[i].second] = i;
+            i = best;
+        }
+        heap[i] = e;
+        pos[e.second] = i;
+    }
+};
+
+// Radix heap over the bit patterns of the keys, which for non-negative
+// doubles order like the values. Only valid for monotone searches (no key
+// below the last popped one), which Dijkstra and the CH upward searches
+// are. Bucket b > 0 holds keys whose highest bit differing from the last
+// popped key is bit b - 1. Lazy deletion like LazyBinaryHeap.
+class RadixHeap {
+public:
+    using Entry = std::pair<double, int>;
+
+    void reset(int) {
+        for (auto& b : buckets) b.clear();
+        count = 0;
+        last = 0;
+    }
+
+    bool empty() const { return count == 0; }
+    double min_key() { refill(); return to_key(buckets[0].back().first); }
+
+    void update(int u, double key) {
+        uint64_t bits = to_bits(key);
+        buckets[bucket(bits)].push_back({bits, u});
+        ++count;
+    }
+
+    Entry pop() {
+        refill();
+        auto [bits, u] = buckets[0].back();
+        buckets[0].pop_back();
+        --count;
+        return {to_key(bits), u};
+    }
+
+private:
+    std::array<std::vector<std::pair<uint64_t, int>>, 65> buckets;
+    size_t count = 0;
+    uint64_t last = 0;
+
+    static uint64_t to_bits(double key) { uint64_t b; std::memcpy(&b, &key, sizeof b); return b; }
+    static double to_key(uint64_t bits) { double k; std::memcpy(&k, &bits, sizeof k); return k; }
+
+    int bucket(uint64_t bits) const {
+        uint64_t diff = bits ^ last;
+        if (diff == 0) return 0;
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, diff);
+        return (int)index + 1;
+#else
+        return 64 - __builtin_clzll(diff);
+#endif
+    }
+
+    // Moves the smallest keys into bucket 0 (equal to the new `last`).
+    void refill() {
+        if (!buckets[0].empty()) return;
+        int b = 1;
+        while (buckets[b].empty()) ++b;
+        last = std::min_element(buckets[b].begin(), buckets[b].end())->first;
+        for (const auto& e : buckets[b]) buckets[bucket(e.first)].push_back(e);
+        buckets[b].clear();
+    }
+};
+
+// Default heaps; override at build time (e.g. -DCH_QUERY_HEAP=RadixHeap)
+// to benchmark the alternatives. The indexed 4-ary heap was fastest for
+// both on our grids (queries ~25%, contraction ~10% over LazyBinaryHeap).
+// CH_QUERY_HEAP serves every CH search and base-edge Dijkstra;
+// CH_ASTAR_HEAP the A* and time-dependent searches, whose keys need not
+// be monotone (epsilon > 1), so it must not be RadixHeap.
+#ifndef CH_QUERY_HEAP
+#define CH_QUERY_HEAP IndexedDaryHeap<4>
+#endif
+#ifndef CH_ASTAR_HEAP
+#define CH_ASTAR_HEAP IndexedDaryHeap<4>
+#endif
+#ifndef CH_WITNESS_HEAP
+#define CH_WITNESS_HEAP IndexedDaryHeap<4>
+#endif
+
+// Distance / parent slots for one search direction. A slot is only valid
+// when its stamp matches the current generation, so starting a new query
+// costs O(1) instead of refilling num_nodes entries.
+struct SearchSpace {
+    std::vector<double> dist;
+    std::vector<int> parent;
+    std::vector<int> parent_arc;   // CSR index of the arc parent -> u
+    std::vector<uint32_t> stamp;
+    uint32_t generation = 0;
+
+    void reset(int n) {
+        if ((int)stamp.size() != n) {
+            dist.resize(n);
+            parent.resize(n);
+            parent_arc.resize(n);
+            stamp.assign(n, 0);
+            generation = 0;
+        }
+        if (++generation == 0) {   // wrapped: stale stamps could look current
+            std::fill(stamp.begin(), stamp.end(), 0);
+            generation = 1;
+        }
+    }
+
+    bool reached(int u) const { return stamp[u] == generation; }
+    double dist_of(int u) const { return reached(u) ? dist[u] : std::numeric_limits<double>::infinity(); }
+
+    void visit(int u, double d, int p, int arc = -1) {
+        stamp[u] = generation;
+        dist[u] = d;
+        parent[u] = p;
+        parent_arc[u] = arc;
+    }
+};
+
+// Reusable workspace for CHGraph queries. Not thread-safe: each thread
+// should own one (the queries fall back to a thread_local instance).
+class QueryContext {
+public:
+    SearchSpace fwd, bwd;
+
+    // Search heaps, one pair per supported heap type (any other type does
+    // not compile); capacity is reused across queries.
+    template <typename Heap>
+    struct HeapPair { Heap fwd, bwd; };
+
+    template <typename Heap>
+    HeapPair<Heap>& heaps() { return std::get<HeapPair<Heap>>(search_heaps); }
+    std::vector<int> arcs, unpack_stack;        // path reconstruction scratch
+
+    // Work done by the last query run on this context (astar() leaves the
+    // backward, meeting and unpack fields at 0). The timings are 0 unless
+    // `timed` is set or QueryMetrics collection is on.
+    long long settled_nodes = 0;             // both directions
+    long long settled_fwd = 0, settled_bwd = 0;
+    long long relaxed_edges = 0;
+    long long heap_pushes = 0;
+    int meet_rank = -1;                      // rank of the meeting node, -1: none
+    long long path_nodes = 0;                // nodes on the returned path
+    long long search_ns = 0, unpack_ns = 0;
+    bool cache_hit = false;                  // answered by CHGraph::route_cache
+    uint64_t metric_version = 0;   // weight snapshot the last query used
+    bool timed = false;
+
+    explicit QueryContext(int n = 0) { if (n > 0) reset(n); }
+
+    void reset(int n) {
+        fwd.reset(n);
+        bwd.reset(n);
+        clear_stats();
+    }
+
+    void clear_stats() {
+        settled_nodes = settled_fwd = settled_bwd = 0;
+        relaxed_edges = heap_pushes = path_nodes = 0;
+        search_ns = unpack_ns = 0;
+        meet_rank = -1;
+        cache_hit = false;
+    }
+
+    static QueryContext& local() {
+        thread_local QueryContext ctx;
+        return ctx;
+    }
+
+private:
+    std::tuple<HeapPair<LazyBinaryHeap>, HeapPair<IndexedDaryHeap<4>>, HeapPair<RadixHeap>> search_heaps;
+};
+
+// Process-wide query counters and log2 histograms, cheap to scrape into a
+// metrics pipeline. Off by default; a disabled query pays one relaxed load.
+// Each thread adds to one of SHARDS cache-line-aligned copies, so busy
+// threads do not contend; snapshot() sums them.
+class QueryMetrics {
+public:
+    enum Counter {
+        DIST_QUERIES, PATH_QUERIES, ASTAR_QUERIES, ALTERNATIVE_QUERIES, TD_QUERIES, UNREACHABLE,
+        SETTLED_NODES, RELAXED_EDGES, HEAP_PUSHES, PATH_NODES, SEARCH_NS, UNPACK_NS,
+        NUM_COUNTERS
+    };
+    static constexpr const char* COUNTER_NAMES[NUM_COUNTERS] = {
+        "dist_queries", "path_queries", "astar_queries", "alternative_queries", "td_queries", "unreachable",
+        "settled_nodes", "relaxed_edges", "heap_pushes", "path_nodes", "search_ns", "unpack_ns",
+    };
+    // Bucket b > 0 counts values in [2^(b-1), 2^b), bucket 0 the zeros; the
+    // last bucket also takes everything larger.
+    static constexpr int BUCKETS = 40;
+
+    struct Snapshot {
+        std::array<uint64_t, NUM_COUNTERS> counters{};
+        std::array<uint64_t, BUCKETS> latency_ns{};      // search + unpack
+        std::array<uint64_t, BUCKETS> settled_nodes{};
+    };
+
+    static QueryMetrics& global() {
+        static QueryMetrics metrics;
+        return metrics;
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+    void enable(bool value) { on.store(value, std::memory_order_relaxed); }
+
+    static int bucket(uint64_t v) {
+        int b = 0;
+        while (v && b < BUCKETS - 1) { v >>= 1; ++b; }
+        return b;
+    }
+
+    // Adds the stats of the query just run on ctx (kind: DIST_QUERIES,
+    // PATH_QUERIES, ASTAR_QUERIES, ALTERNATIVE_QUERIES or TD_QUERIES).
+    void record(Counter kind, bool reached, const QueryContext& ctx) {
+        Shard& s = shards[shard_index()];
+        auto add = [](std::atomic<uint64_t>& c, uint64_t v) { c.fetch_add(v, std::memory_order_relaxed); };
+        add(s.counters[kind], 1);
+        if (!reached) add(s.counters[UNREACHABLE], 1);
+        add(s.counters[SETTLED_NODES], ctx.settled_nodes);
+        add(s.counters[RELAXED_EDGES], ctx.relaxed_edges);
+        add(s.counters[HEAP_PUSHES], ctx.heap_pushes);
+        add(s.counters[PATH_NODES], ctx.path_nodes);
+        add(s.counters[SEARCH_NS], ctx.search_ns);
+        add(s.counters[UNPACK_NS], ctx.unpack_ns);
+        add(s.latency_ns[bucket(ctx.search_ns + ctx.unpack_ns)], 1);
+        add(s.settled_nodes[bucket(ctx.settled_nodes)], 1);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot out;
+        for (const Shard& s : shards) {
+            for (int i = 0; i < NUM_COUNTERS; ++i) out.counters[i] += s.counters[i].load(std::memory_order_relaxed);
+            for (int b = 0; b < BUCKETS; ++b) {
+                out.latency_ns[b] += s.latency_ns[b].load(std::memory_order_relaxed);
+                out.settled_nodes[b] += s.settled_nodes[b].load(std::memory_order_relaxed);
+            }
+        }
+        return out;
+    }
+
+    void reset() {
+        for (Shard& s : shards) {
+            for (auto& c : s.counters) c.store(0, std::memory_order_relaxed);
+            for (auto& c : s.latency_ns) c.store(0, std::memory_order_relaxed);
+            for (auto& c : s.settled_nodes) c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static constexpr int SHARDS = 16;
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[NUM_COUNTERS] = {};
+        std::atomic<uint64_t> latency_ns[BUCKETS] = {};
+        std::atomic<uint64_t> settled_nodes[BUCKETS] = {};
+    };
+
+    static int shard_index() {
+        static std::atomic<int> next{0};
+        thread_local int index = next.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return index;
+    }
+
+    std::atomic<bool> on{false};
+    Shard shards[SHARDS];
+};
+
+// Nanoseconds since `start` on the steady clock.
+inline long long elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Sharded LRU cache of query() results keyed on (origin, dest, metric
+// version). Each shard has its own mutex, LRU list and byte budget, so
+// threads only contend when their keys land in the same shard. Paths are
+// stored as zigzag varint deltas of node ids, usually 1-2 bytes a node.
+// A shard drops all its entries the first time it sees a newer metric
+// version, so no route outlives the traffic snapshot it was computed on.
+class RouteCache {
+public:
+    struct Stats {
+        uint64_t hits = 0, misses = 0, insertions = 0, evictions = 0, invalidations = 0;
+        size_t entries = 0, bytes = 0, max_bytes = 0;
+    };
+
+    explicit RouteCache(size_t max_bytes, int num_shards = 64)
+        : shards(std::max(1, num_shards)), shard_budget(max_bytes / shards.size()) {}
+
+    bool lookup(int origin, int dest, uint64_t version, std::vector<int>& path, double& km) {
+        uint64_t k = key(origin, dest);
+        Shard& s = shard(k);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (!current(s, version)) { s.misses++; return false; }
+        auto it = s.index.find(k);
+        if (it == s.index.end()) { s.misses++; return false; }
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        const Entry& e = *it->second;
+        km = e.km;
+        path.clear();
+        const uint8_t* p = e.packed.data();
+        const uint8_t* end = p + e.packed.size();
+        int64_t node = 0;
+        while (p < end) path.push_back((int)(node += geometry::get_varint(p)));
+        s.hits++;
+        return true;
+    }
+
+    // Stores a result computed on metric `version`; ignored if the shard
+    // has already moved on to a newer one or the entry exceeds its budget.
+    void insert(int origin, int dest, uint64_t version, const std::vector<int>& path, double km) {
+        Entry e{key(origin, dest), km, {}};
+        int64_t prev = 0;
+        for (int v : path) {
+            geometry::put_varint(e.packed, (int64_t)v - prev);
+            prev = v;
+        }
+        e.packed.shrink_to_fit();
+        size_t size = entry_bytes(e);
+        Shard& s = shard(e.key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (!current(s, version) || size > shard_budget) return;
+        auto it = s.index.find(e.key);
+        if (it != s.index.end()) erase(s, it->second);
+        while (!s.lru.empty() && s.bytes + size > shard_budget) {
+            erase(s, std::prev(s.lru.end()));
+            s.evictions++;
+        }
+        s.lru.push_front(std::move(e));
+        s.index[s.lru.front().key] = s.lru.begin();
+        s.bytes += size;
+        s.insertions++;
+    }
+
+    void clear() {
+        for (Shard& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.lru.clear();
+            s.index.clear();
+            s.bytes = 0;
+        }
+    }
+
+    Stats stats() {
+        Stats out;
+        out.max_bytes = shard_budget * shards.size();
+        for (Shard& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            out.hits += s.hits;
+            out.misses += s.misses;
+            out.insertions += s.insertions;
+            out.evictions += s.evictions;
+            out.invalidations += s.invalidations;
+            out.entries += s.lru.size();
+            out.bytes += s.bytes;
+        }
+        return out;
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        double km;
+        std::vector<uint8_t> packed;
+    };
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;   // most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        uint64_t version = 0;
+        size_t bytes = 0;
+        uint64_t hits = 0, misses = 0, insertions = 0, evictions = 0, invalidations = 0;
+    };
+
+    std::vector<Shard> shards;
+    size_t shard_budget;
+
+    static uint64_t key(int origin, int dest) { return (uint64_t)(uint32_t)origin << 32 | (uint32_t)dest; }
+
+    Shard& shard(uint64_t k) {
+        k ^= k >> 29;
+        k *= 0xbf58476d1ce4e5b9ull;   // splitmix64 finalizer
+        k ^= k >> 32;
+        return shards[k % shards.size()];
+    }
+
+    // List node, index node and payload, roughly.
+    static size_t entry_bytes(const Entry& e) { return sizeof(Entry) + 64 + e.packed.capacity(); }
+
+    // False for lookups on a metric older than the shard's; a newer one
+    // invalidates the shard first.
+    bool current(Shard& s, uint64_t version) {
+        if (version < s.version) return false;
+        if (version > s.version) {
+            if (!s.lru.empty()) s.invalidations++;
+            s.lru.clear();
+            s.index.clear();
+            s.bytes = 0;
+            s.version = version;
+        }
+        return true;
+    }
+
+    void erase(Shard& s, std::list<Entry>::iterator it) {
+        s.bytes -= entry_bytes(*it);
+        s.index.erase(it->key);
+        s.lru.erase(it);
+    }
+};
+
+// Local Dijkstra used to find witnesses while contracting. One search from
+// an in-neighbour u answers the witness question for every out-neighbour w
+// of the contracted node at once. Heap and distance slots are kept between
+// calls and reset lazily through a generation stamp, so a search only costs
+// the nodes it touches. One instance per thread.
+template <typename Heap>
+class BasicWitnessSearch {
+public:
+    // Distance found to v in the last run (an upper bound if v was not
+    // settled), infinity if v was not reached.
+    double dist_of(int v) const {
+        return stamp[v] == generation ? dist[v] : std::numeric_limits<double>::infinity();
+    }
+
+    // Searches from `source` along FWD entries of the remaining graph
+    // (skipping contracted nodes and `exclude`). Only the first live[u]
+    // entries of adj[u] are scanned. Stops once every node in `targets` is settled,
+    // above max_dist, or after settled_limit nodes (<= 0: unlimited).
+    // hop_limit > 0 stops relaxing from nodes that many edges away.
+    void run(const std::vector<std::vector<Edge>>& adj, const std::vector<uint32_t>& live,
+             const std::vector<bool>& contracted, int source, int exclude, double max_dist,
+             const std::vector<int>& targets, int settled_limit, int hop_limit) {
+        reset((int)adj.size());
+        int remaining_targets = 0;
+        for (int w : targets) {
+            if (target_stamp[w] != generation) { target_stamp[w] = generation; remaining_targets++; }
+        }
+
+        visit(source, 0.0, 0);
+        heap.update(source, 0.0);
+        int settled = 0;
+        while (!heap.empty()) {
+            auto [d, u] = heap.pop();
+            if (d > dist[u]) continue;   // stale entry
+            if (d > max_dist) break;
+            if (target_stamp[u] == generation && --remaining_targets == 0) break;
+            if (settled_limit > 0 && ++settled >= settled_limit) break;
+            if (hop_limit > 0 && hops[u] >= hop_limit) continue;
+
+            const Edge* entries = adj[u].data();
+            for (uint32_t i = 0; i < live[u]; ++i) {
+                const Edge& e = entries[i];
+                int v = e.target;
+                if (!e.has(Edge::FWD) || v == exclude || contracted[v]) continue;
+                double new_dist = d + e.weight;
+                if (new_dist <= max_dist && new_dist < dist_of(v)) {
+                    visit(v, new_dist, hops[u] + 1);
+                    heap.update(v, new_dist);
+                }
+            }
+        }
+    }
+
+private:
+    std::vector<double> dist;
+    std::vector<int> hops;
+    std::vector<uint32_t> stamp;
+    std::vector<uint32_t> target_stamp;
+    uint32_t generation = 0;
+    Heap heap;
+
+    void reset(int n) {
+        if ((int)stamp.size() != n) {
+            dist.resize(n);
+            hops.resize(n);
+            stamp.assign(n, 0);
+            target_stamp.assign(n, 0);
+            generation = 0;
+        }
+        if (++generation == 0) {
+            std::fill(stamp.begin(), stamp.end(), 0);
+            std::fill(target_stamp.begin(), target_stamp.end(), 0);
+            generation = 1;
+        }
+        heap.reset(n);
+    }
+
+    void visit(int u, double d, int h) {
+        stamp[u] = generation;
+        dist[u] = d;
+        hops[u] = h;
+    }
+};
+
+using WitnessSearch = BasicWitnessSearch<CH_WITNESS_HEAP>;
+
+// Maps a user-facing thread count (0 = all cores) to a concrete one.
+inline int resolve_threads(int num_threads) {
+    return num_threads > 0 ? num_threads : (int)std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Threads behind parallel_for, started on first use and kept for the
+// process lifetime, so short parallel calls (a matrix per request) do not
+// pay for thread creation. Never destroyed: idle threads just wait.
+class WorkerThreads {
+public:
+    static WorkerThreads& shared() {
+        static WorkerThreads* pool = new WorkerThreads();
+        return *pool;
+    }
+
+    // Runs body(t) for t in [0, count): t = 0 on the calling thread, the
+    // rest on pool threads. Helpers no thread has picked up by the time the
+    // caller's own body(0) returns are dropped, so body must share its work
+    // out dynamically; in exchange nested and concurrent calls never wait
+    // for a busy pool. Rethrows the first exception of any body.
+    void run(int count, const std::function<void(int)>& body) {
+        Job job;
+        job.body = &body;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while ((int)threads.size() < count - 1) threads.emplace_back([this] { work(); });
+            for (int t = 1; t < count; ++t) tasks.push_back({&job, t});
+        }
+        wake.notify_all();
+        std::exception_ptr error;
+        try {
+            body(0);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.erase(std::remove_if(tasks.begin(), tasks.end(), [&](const Task& k) { return k.job == &job; }),
+                    tasks.end());
+        done.wait(lock, [&] { return job.running == 0; });
+        if (!error) error = job.error;
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    struct Job {
+        const std::function<void(int)>* body = nullptr;
+        int running = 0;   // helpers inside body, guarded by mutex
+        std::exception_ptr error;
+    };
+    struct Task {
+        Job* job;
+        int index;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::deque<Task> tasks;
+    std::vector<std::thread> threads;
+
+    WorkerThreads() = default;
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return !tasks.empty(); });
+            Task task = tasks.front();
+            tasks.pop_front();
+            task.job->running++;
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                (*task.job->body)(task.index);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            if (error && !task.job->error) task.job->error = error;
+            if (--task.job->running == 0) done.notify_all();
+        }
+    }
+};
+
+// Runs fn(i, thread_id) for every i in [0, n) on up to num_threads threads
+// (0 = all cores) of WorkerThreads, thread_id < num_threads and distinct
+// per thread. Indices are handed out dynamically in small chunks.
+template <typename F>
+void parallel_for(int n, int num_threads, F&& fn) {
+    num_threads = resolve_threads(num_threads);
+    num_threads = std::max(1, std::min(num_threads, n));
+    if (num_threads == 1) {
+        for (int i = 0; i < n; ++i) fn(i, 0);
+        return;
+    }
+    const int chunk = 16;
+    std::atomic<int> next{0};
+    WorkerThreads::shared().run(num_threads, [&](int t) {
+        for (int begin; (begin = next.fetch_add(chunk)) < n;) {
+            int end = std::min(n, begin + chunk);
+            for (int i = begin; i < end; ++i) fn(i, t);
+        }
+    });
+}
+
+// Streaming reader for the GraphML files osmnx writes (download_map.py),
+// so the CH file can be built without NetworkX. Only <key>, <node> and
+// <edge> elements are read: node y / x, edge weight (else length, else 1)
+// and geometry (WKT LINESTRING of "lon lat" pairs, end nodes included).
+namespace graphml {
+    // Data key ids of the attributes we use; empty if the file has none.
+    struct Keys { std::string lat, lon, weight, length, geometry; };
+
+    // Nodes and edges of one slice of the file, in file order. Edge shapes
+    // are already in geometry:: coding (without the end nodes), geom_bytes
+    // per edge.
+    struct Records {
+        std::vector<int64_t> node_ids;
+        std::vector<double> lat, lon;
+        std::vector<int64_t> src, dst;
+        std::vector<double> weight;
+        std::vector<uint32_t> geom_bytes;
+        std::vector<uint8_t> geom_data;
+
+        void append(Records& other) {
+            auto move = [](auto& to, auto& from) {
+                to.insert(to.end(), from.begin(), from.end());
+                from.clear();
+            };
+            move(node_ids, other.node_ids);
+            move(lat, other.lat);
+            move(lon, other.lon);
+            move(src, other.src);
+            move(dst, other.dst);
+            move(weight, other.weight);
+            move(geom_bytes, other.geom_bytes);
+            move(geom_data, other.geom_data);
+        }
+    };
+
+    // Value of attribute `name` in the start tag `tag`, empty if missing.
+    inline std::string_view attribute(std::string_view tag, std::string_view name) {
+        for (size_t p = tag.find(name); p != std::string_view::npos; p = tag.find(name, p + 1)) {
+            size_t q = p + name.size();
+            if (p == 0 || !std::isspace((unsigned char)tag[p - 1]) || q + 1 >= tag.size() || tag[q] != '=') continue;
+            char quote = tag[q + 1];
+            if (quote != '"' && quote != '\'') continue;
+            size_t end = tag.find(quote, q + 2);
+            if (end == std::string_view::npos) return {};
+            return tag.substr(q + 2, end - q - 2);
+        }
+        return {};
+    }
+
+    inline Keys parse_keys(std::string_view header) {
+        Keys keys;
+        for (size_t p = header.find("<key"); p != std::string_view::npos; p = header.find("<key", p + 4)) {
+            size_t end = header.find('>', p);
+            if (end == std::string_view::npos) break;
+            std::string_view tag = header.substr(p, end - p);
+            std::string_view kind = attribute(tag, "for"), name = attribute(tag, "attr.name");
+            std::string id(attribute(tag, "id"));
+            if (kind == "node" && name == "y") keys.lat = id;
+            else if (kind == "node" && name == "x") keys.lon = id;
+            else if (kind == "edge" && name == "weight") keys.weight = id;
+            else if (kind == "edge" && name == "length") keys.length = id;
+            else if (kind == "edge" && name == "geometry") keys.geometry = id;
+        }
+        return keys;
+    }
+
+    inline bool is_element(std::string_view text, size_t p) {
+        return p + 5 < text.size() && (text.compare(p, 5, "<node") == 0 || text.compare(p, 5, "<edge") == 0) &&
+               std::isspace((unsigned char)text[p + 5]);
+    }
+
+    // Start of the first <node / <edge element at or after p, npos if none.
+    inline size_t next_element(std::string_view text, size_t p) {
+        for (p = text.find('<', p); p != std::string_view::npos; p = text.find('<', p + 1)) {
+            if (is_element(text, p)) return p;
+        }
+        return std::string_view::npos;
+    }
+
+    // Start of the last <node / <edge element, npos if none.
+    inline size_t last_element(std::string_view text) {
+        for (size_t p = text.rfind('<'); p != std::string_view::npos; p = p ? text.rfind('<', p - 1) : std::string_view::npos) {
+            if (is_element(text, p)) return p;
+        }
+        return std::string_view::npos;
+    }
+
+    // Number at the start of `v`; the text behind it must not be numeric
+    // (true inside the file buffer, where a quote or '<' follows).
+    inline double number(std::string_view v, double fallback) {
+        if (v.empty()) return fallback;
+        char* end;
+        double x = std::strtod(v.data(), &end);
+        return end == v.data() ? fallback : x;
+    }
+
+    inline int64_t node_id(std::string_view v, const char* what) {
+        char* end;
+        long long id = std::strtoll(v.data(), &end, 10);
+        if (v.empty() || end == v.data()) throw std::runtime_error(std::string("GraphML ") + what + " is not an integer");
+        return id;
+    }
+
+    // Interior points of a WKT LINESTRING, appended to out in geometry::
+    // coding; returns the number of bytes written.
+    inline uint32_t encode_linestring(std::string_view wkt, std::vector<uint8_t>& out) {
+        size_t open = wkt.find('(');
+        if (open == std::string_view::npos) return 0;
+        std::vector<std::pair<int64_t, int64_t>> points;   // (lat, lon) scaled
+        const char* p = wkt.data() + open + 1;
+        const char* end = wkt.data() + wkt.size();
+        while (p < end) {
+            char* next;
+            double lon = std::strtod(p, &next);
+            if (next == p) break;
+            double lat = std::strtod(next, &next);
+            points.push_back({std::llround(lat * geometry::SCALE), std::llround(lon * geometry::SCALE)});
+            p = next;
+            while (p < end && (*p == ',' || std::isspace((unsigned char)*p))) ++p;
+        }
+        size_t before = out.size();
+        int64_t prev_lat = 0, prev_lon = 0;
+        for (size_t i = 1; i + 1 < points.size(); ++i) {
+            geometry::put_varint(out, points[i].first - prev_lat);
+            geometry::put_varint(out, points[i].second - prev_lon);
+            prev_lat = points[i].first;
+            prev_lon = points[i].second;
+        }
+        return (uint32_t)(out.size() - before);
+    }
+
+    // Parses every <node> / <edge> element starting in `text` (which must
+    // hold them whole) into out.
+    inline void parse(std::string_view text, const Keys& keys, Records& out) {
+        const double NaN = std::numeric_limits<double>::quiet_NaN();
+        for (size_t p = next_element(text, 0); p != std::string_view::npos; p = next_element(text, p + 1)) {
+            bool is_node = text[p + 1] == 'n';
+            size_t tag_end = text.find('>', p);
+            if (tag_end == std::string_view::npos) throw std::runtime_error("GraphML: truncated element");
+            std::string_view tag = text.substr(p, tag_end - p);
+            size_t body_end = tag_end;
+            if (tag.back() != '/') {
+                body_end = text.find(is_node ? "</node>" : "</edge>", tag_end);
+                if (body_end == std::string_view::npos) throw std::runtime_error("GraphML: truncated element");
+            }
+            std::string_view lat, lon, weight, length, shape;
+            for (size_t d = text.find("<data", tag_end); d < body_end; d = text.find("<data", d + 5)) {
+                size_t d_end = text.find('>', d);
+                std::string_view data_tag = text.substr(d, d_end - d);
+                if (data_tag.back() == '/') continue;
+                std::string_view key = attribute(data_tag, "key");
+                std::string_view value = text.substr(d_end + 1, text.find('<', d_end) - d_end - 1);
+                if (is_node) {
+                    if (key == keys.lat) lat = value;
+                    else if (key == keys.lon) lon = value;
+                } else {
+                    if (key == keys.weight) weight = value;
+                    else if (key == keys.length) length = value;
+                    else if (key == keys.geometry) shape = value;
+                }
+            }
+            if (is_node) {
+                out.node_ids.push_back(node_id(attribute(tag, "id"), "node id"));
+                out.lat.push_back(number(lat, NaN));
+                out.lon.push_back(number(lon, NaN));
+            } else {
+                out.src.push_back(node_id(attribute(tag, "source"), "edge source"));
+                out.dst.push_back(node_id(attribute(tag, "target"), "edge target"));
+                out.weight.push_back(number(weight, number(length, 1.0)));
+                out.geom_bytes.push_back(shape.empty() ? 0 : encode_linestring(shape, out.geom_data));
+            }
+            p = body_end;
+        }
+    }
+}
+
+class CHGraph {
+public:
+    int num_nodes;
+    std::vector<std::vector<Edge>> adj;   // build-time graph, see Edge
+    // While contracting: adj[u][0, live_degree[u]) holds u's entries to
+    // remaining nodes, the rest point at contracted ones. Empty otherwise.
+    std::vector<uint32_t> live_degree;
+    std::vector<bool> contracted;
+    std::vector<int> rank;
+    std::vector<int> node_order;
+
+    // Query-time CSR graphs, valid while `frozen` is true. They number
+    // nodes internally (see to_external).
+    UpwardGraph fwd_up;   // u -> v with rank[v] > rank[u]
+    UpwardGraph bwd_up;   // v -> u with rank[v] > rank[u], stored at u
+
+    // freeze() renumbers the query-time graphs by descending rank, so the
+    // top of the hierarchy, which every query visits, is one contiguous
+    // block at the start of every per-node array. Everything outside the
+    // query-time graphs and search spaces keeps external numbers. Both
+    // empty: identity (CCH, or renumber_nodes off).
+    bool renumber_nodes = true;
+    Buffer<int> to_external;       // internal -> external node
+    std::vector<int> to_internal;  // external -> internal node
+    // Internal nodes by descending rank, for the PHAST sweep; empty when
+    // that is the numbering itself (renumbered graphs).
+    std::vector<int> sweep_order;
+
+    UnpackTable unpacking;
+    bool frozen = false;
+
+    // Witness search bounds used while contracting; a search that hits a
+    // bound just adds the shortcut, so these trade shortcuts for speed and
+    // never affect correctness. <= 0 means unlimited.
+    int witness_settled_limit = 500;
+    int witness_hop_limit = 0;
+
+    // Query pruning switches (on by default; off reproduces the original
+    // exhaustive search, for measuring their effect).
+    bool stop_early = true;        // stop a direction once its min key >= mu
+    bool stall_on_demand = true;   // skip nodes reached cheaper from above
+    bool skip_settled = true;      // drop stale heap entries of settled nodes
+
+    // Filled by build_ch / build_ch_auto. A node's level is one more than the
+    // highest level among the neighbours contracted before it.
+    std::vector<int> level;
+    std::vector<long long> shortcuts_per_level;
+
+    // Optional per-node data, stored in the binary file alongside the CH.
+    Buffer<double> node_lat, node_lon;
+    Buffer<int64_t> node_ids;      // external (OSM) node ids
+
+    // Optional shape of each base edge (the points strictly between its end
+    // nodes) in geometry:: coding: edge e is geom_data[geom_offsets[e],
+    // geom_offsets[e + 1]). Empty if no geometry was set.
+    Buffer<int64_t> geom_offsets;
+    Buffer<uint8_t> geom_data;
+
+    // Original (non-shortcut) edges in insertion order. The index of an
+    // edge here is its id for customize().
+    Buffer<int> base_src, base_dst;
+    Buffer<double> base_weight;    // as added; the live values are in the Metric
+
+    // Customizable CH (build_cch): the upward graphs hold the chordal
+    // topology of the order in both directions, and customize() rewrites
+    // only their weights and child arcs.
+    bool customizable = false;
+    Buffer<int> base_arc;                    // global arc id per base edge, -1 for loops
+    std::vector<int> down_offsets;           // per node u: arcs v -> u stored at lower v
+    std::vector<int> down_from, down_arc;
+    std::vector<int> level_offsets, level_nodes;   // nodes grouped by level
+    std::vector<int> arc_base_offsets, arc_base_edges;   // base edges per global arc
+
+    // Current metric. Queries pin it with metric_snapshot(); writers are
+    // serialized by writer_mutex and fill spare_metric (the version before
+    // the current one) once no query holds it any more, then publish it
+    // with an atomic pointer swap, so queries never wait for an update.
+    std::shared_ptr<Metric> metric;
+    std::shared_ptr<Metric> spare_metric;
+    bool spare_stale_all = true;                        // spare_metric must be copied in full
+    std::vector<int> spare_stale_arcs, spare_stale_edges;   // else: arc pairs / base edges to copy
+    std::mutex writer_mutex;
+
+    // Base edges as forward / reverse CSR, rebuilt whenever the graph is
+    // frozen. Used by verify(), A* and landmark preprocessing.
+    BaseGraph base_out, base_in;
+    std::shared_ptr<const LandmarkTable> landmarks;   // atomic_load / atomic_store
+    std::shared_ptr<const TravelTimeProfiles> time_profiles;   // atomic_load / atomic_store
+    std::shared_ptr<RouteCache> route_cache;                   // atomic_load / atomic_store, null: off
+
+    // Built on first use by spatial_index(); dropped when nodes or base
+    // edges change.
+    std::shared_ptr<const SpatialIndex> spatial;
+    std::mutex spatial_mutex;
+
+    // Set when the graph was opened with load(); the frozen arrays then
+    // point into this mapping and the graph is read-only.
+    std::shared_ptr<MappedFile> mapping;
+
+    CHGraph(int n) : num_nodes(n) {
+        if (n < 0 || n > Edge::MAX_NODES) throw std::invalid_argument("node count out of range");
+        adj.resize(n);
+        contracted.assign(n, false);
+        rank.assign(n, -1);
+    }
+
+    void check_mutable() const {
+        if (mapping) throw std::logic_error("CHGraph loaded from a file is read-only");
+    }
+
+    void add_edge(int u, int v, double weight) {
+        add_ch_edge(u, v, weight, false, -1);
+    }
+
+    void add_ch_edge(int u, int v, double weight, bool is_shortcut, int via) {
+        check_mutable();
+        frozen = false;
+        insert_edge(u, v, weight, is_shortcut, is_shortcut ? via : -1);
+        if (!is_shortcut) {
+            base_src.push_back(u);
+            base_dst.push_back(v);
+            base_weight.push_back(weight);
+        }
+    }
+
+    // The entry of the other end node that describes the same edge(s) as
+    // entry e of u's list.
+    Edge& twin(int u, const Edge& e) {
+        uint32_t dirs = (e.has(Edge::FWD) ? Edge::BWD : 0) | (e.has(Edge::BWD) ? Edge::FWD : 0);
+        for (auto& r : adj[e.target]) {
+            if (r.target == u && r.dirs() == dirs && r.weight == e.weight &&
+                (r.bits & ~(Edge::FWD | Edge::BWD)) == (e.bits & ~(Edge::FWD | Edge::BWD))) {
+                return r;
+            }
+        }
+        throw std::logic_error("adjacency lists out of sync");
+    }
+
+    // Adds u -> v, merging it into a matching one-way v -> u entry.
+    void insert_edge(int u, int v, double weight, bool is_shortcut, int via) {
+        Edge e(v, weight, is_shortcut, via, Edge::FWD);
+        if (u != v) {
+            for (auto& r : adj[u]) {
+                if (r.target == v && r.dirs() == Edge::BWD && r.weight == weight &&
+                    (r.bits & ~Edge::BWD) == (e.bits & ~Edge::FWD)) {
+                    twin(u, r).bits |= Edge::BWD;
+                    r.bits |= Edge::FWD;
+                    return;
+                }
+            }
+        }
+        append_entry(u, e);
+        append_entry(v, Edge(u, weight, is_shortcut, via, Edge::BWD));
+    }
+
+    // New entries go into the live prefix during a contraction: both ends
+    // of a shortcut are remaining nodes.
+    void append_entry(int u, const Edge& e) {
+        adj[u].push_back(e);
+        if (!live_degree.empty()) std::swap(adj[u].back(), adj[u][live_degree[u]++]);
+    }
+
+    void set_rank(int u, int r) {
+        check_mutable();
+        if (u >= 0 && u < num_nodes) rank[u] = r;
+        frozen = false;
+    }
+
+    void set_node(int u, int64_t id, double lat, double lon) {
+        if (u < 0 || u >= num_nodes) return;
+        if ((int)node_ids.size() != num_nodes) {
+            node_ids.resize(num_nodes, -1);
+            node_lat.resize(num_nodes, std::numeric_limits<double>::quiet_NaN());
+            node_lon.resize(num_nodes, std::numeric_limits<double>::quiet_NaN());
+        }
+        node_ids.mutable_data()[u] = id;
+        node_lat.mutable_data()[u] = lat;
+        node_lon.mutable_data()[u] = lon;
+        std::atomic_store(&spatial, std::shared_ptr<const SpatialIndex>());
+    }
+
+    // --- BULK I/O ---
+    // Raw-array counterparts of add_ch_edge / set_rank / set_node, so Python
+    // can hand over numpy buffers without per-edge calls.
+
+    // Appends m edges. is_shortcut / via may be null (plain base edges).
+    // Degrees are counted first so each adjacency list grows at most once.
+    void add_edges(const int* src, const int* dst, const double* weight,
+                   const bool* is_shortcut, const int* via, size_t m) {
+        check_mutable();
+        for (size_t i = 0; i < m; ++i) {
+            if (src[i] < 0 || src[i] >= num_nodes || dst[i] < 0 || dst[i] >= num_nodes) {
+                throw std::out_of_range("edge " + std::to_string(i) + " references a node out of range");
+            }
+        }
+        std::vector<int> degree(num_nodes, 0);
+        for (size_t i = 0; i < m; ++i) { degree[src[i]]++; degree[dst[i]]++; }
+        for (int u = 0; u < num_nodes; ++u) adj[u].reserve(adj[u].size() + degree[u]);
+        for (size_t i = 0; i < m; ++i) {
+            bool sc = is_shortcut && is_shortcut[i];
+            int v = sc && via ? via[i] : -1;
+            insert_edge(src[i], dst[i], weight[i], sc, v);
+            if (!sc) {
+                base_src.push_back(src[i]);
+                base_dst.push_back(dst[i]);
+                base_weight.push_back(weight[i]);
+            }
+        }
+        frozen = false;
+    }
+
+    void set_ranks(const int* ranks, size_t n) {
+        check_mutable();
+        if (n != (size_t)num_nodes) throw std::invalid_argument("set_ranks needs one rank per node");
+        rank.assign(ranks, ranks + n);
+        frozen = false;
+    }
+
+    void set_nodes(const int64_t* ids, const double* lat, const double* lon, size_t n) {
+        if (n != (size_t)num_nodes) throw std::invalid_argument("set_nodes needs one entry per node");
+        node_ids.assign(std::vector<int64_t>(ids, ids + n));
+        node_lat.assign(std::vector<double>(lat, lat + n));
+        node_lon.assign(std::vector<double>(lon, lon + n));
+        std::atomic_store(&spatial, std::shared_ptr<const SpatialIndex>());
+    }
+
+    // Shapes for all base edges: edge e has the points [offsets[e],
+    // offsets[e + 1]) of lat / lon, excluding its end nodes.
+    void set_edge_geometry(const int64_t* offsets, const double* lat, const double* lon, size_t m) {
+        if (m != base_src.size()) throw std::invalid_argument("set_edge_geometry needs one entry per base edge");
+        std::vector<int64_t> off(m + 1, 0);
+        std::vector<uint8_t> data;
+        for (size_t e = 0; e < m; ++e) {
+            if (offsets[e + 1] < offsets[e]) throw std::invalid_argument("geometry offsets must not decrease");
+            int64_t prev_lat = 0, prev_lon = 0;
+            for (int64_t k = offsets[e]; k < offsets[e + 1]; ++k) {
+                int64_t qlat = std::llround(lat[k] * geometry::SCALE), qlon = std::llround(lon[k] * geometry::SCALE);
+                geometry::put_varint(data, qlat - prev_lat);
+                geometry::put_varint(data, qlon - prev_lon);
+                prev_lat = qlat;
+                prev_lon = qlon;
+            }
+            off[e + 1] = (int64_t)data.size();
+        }
+        geom_offsets.assign(std::move(off));
+        geom_data.assign(std::move(data));
+    }
+
+    size_t out_degree(int u) const {
+        size_t d = 0;
+        for (const auto& e : adj[u]) d += e.has(Edge::FWD);
+        return d;
+    }
+
+    // Directed edges, a two-way entry counting twice.
+    size_t num_edges() const {
+        size_t m = 0;
+        for (int u = 0; u < num_nodes; ++u) m += out_degree(u);
+        return m;
+    }
+
+    // Writes every directed edge into num_edges()-sized arrays, grouped by
+    // source node. Nodes are filled in parallel from per-node offsets.
+    void export_edges(int* src, int* dst, double* weight, bool* is_shortcut, int* via,
+                      int num_threads = 0) const {
+        std::vector<size_t> offset(num_nodes + 1, 0);
+        for (int u = 0; u < num_nodes; ++u) offset[u + 1] = offset[u] + out_degree(u);
+        parallel_for(num_nodes, num_threads, [&](int u, int) {
+            size_t k = offset[u];
+            for (const auto& e : adj[u]) {
+                if (!e.has(Edge::FWD)) continue;
+                src[k] = u;
+                dst[k] = e.target;
+                weight[k] = e.weight;
+                is_shortcut[k] = e.is_shortcut();
+                via[k] = e.via_node();
+                ++k;
+            }
+        });
+    }
+
+    // Flattens the hierarchy into fwd_up / bwd_up. Must run after the last
+    // add_ch_edge / set_rank / build_ch and before querying.
+    void freeze() {
+        check_mutable();
+        if (customizable) throw std::logic_error("edges changed after build_cch(); run build_cch() again");
+        std::vector<int> order;
+        if (renumber_nodes) {
+            order.resize(num_nodes);
+            for (int u = 0; u < num_nodes; ++u) order[u] = u;
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return rank[a] > rank[b]; });
+        }
+        set_node_order(std::move(order));
+        Metric m;
+        const int* ext = to_external.empty() ? nullptr : to_external.data();
+        const int* in = to_internal.empty() ? nullptr : to_internal.data();
+        fwd_up.build(adj, Edge::FWD, rank, ext, in, m.fwd_weights, m.fwd_via);
+        bwd_up.build(adj, Edge::BWD, rank, ext, in, m.bwd_weights, m.bwd_via);
+        unpacking.build(fwd_up, bwd_up, m);
+        m.base_weight.assign(std::vector<double>(base_weight.begin(), base_weight.end()));
+        reset_metric(std::move(m));
+        index_base_edges();
+        frozen = true;
+    }
+
+    // Installs an internal -> external node order (empty: identity).
+    void set_node_order(std::vector<int> order) {
+        to_internal.clear();
+        sweep_order.clear();
+        if (!order.empty()) {
+            to_internal.assign(num_nodes, -1);
+            for (int i = 0; i < num_nodes; ++i) to_internal[order[i]] = i;
+        } else {
+            sweep_order.resize(num_nodes);
+            for (int u = 0; u < num_nodes; ++u) sweep_order[u] = u;
+            std::stable_sort(sweep_order.begin(), sweep_order.end(), [&](int a, int b) { return rank[a] > rank[b]; });
+        }
+        to_external.assign(std::move(order));
+    }
+
+    int internal(int u) const { return to_internal.empty() ? u : to_internal[u]; }
+    int external(int u) const { return to_external.empty() ? u : to_external[u]; }
+
+    void index_base_edges() {
+        base_out.build(num_nodes, base_src.data(), base_dst.data(), base_src.size());
+        base_in.build(num_nodes, base_dst.data(), base_src.data(), base_src.size());
+        std::atomic_store(&spatial, std::shared_ptr<const SpatialIndex>());
+    }
+
+    void ensure_frozen() {
+        if (!frozen) freeze();
+    }
+
+    // --- METRIC SNAPSHOTS ---
+
+    std::shared_ptr<const Metric> metric_snapshot() const {
+        return std::atomic_load(&metric);
+    }
+
+    // Replaces the metric outright (build / freeze / load time).
+    void reset_metric(Metric m) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        auto current = std::atomic_load(&metric);
+        m.version = current ? current->version + 1 : 1;
+        std::atomic_store(&metric, std::make_shared<Metric>(std::move(m)));
+        spare_metric.reset();
+        spare_stale_all = true;
+    }
+
+    // Returns the Metric the next version is written into: the retired
+    // previous version, once the queries still reading it are done. With
+    // catch_up it is first brought level with the current version, copying
+    // only what the last update changed. Call with writer_mutex held and
+    // record every change in spare_stale_arcs / spare_stale_edges.
+    Metric& begin_metric_update(bool catch_up) {
+        if (!spare_metric) spare_metric = std::make_shared<Metric>();
+        while (spare_metric.use_count() > 1) std::this_thread::yield();
+        const Metric& cur = *std::atomic_load(&metric);
+        Metric& next = *spare_metric;
+        if (catch_up && spare_stale_all) {
+            next = cur;
+        } else if (catch_up) {
+            double* fw = next.fwd_weights.mutable_data();
+            double* bw = next.bwd_weights.mutable_data();
+            int* fv = next.fwd_via.mutable_data();
+            int* bv = next.bwd_via.mutable_data();
+            int* first = next.first.mutable_data();
+            int* second = next.second.mutable_data();
+            for (int i : spare_stale_arcs) {
+                fw[i] = cur.fwd_weights[i];
+                bw[i] = cur.bwd_weights[i];
+                fv[i] = cur.fwd_via[i];
+                bv[i] = cur.bwd_via[i];
+                for (int a : {i, unpacking.bwd_arc(i)}) {
+                    first[a] = cur.first[a];
+                    second[a] = cur.second[a];
+                }
+            }
+            double* base = next.base_weight.mutable_data();
+            for (int e : spare_stale_edges) base[e] = cur.base_weight[e];
+            next.cache_offset = cur.cache_offset;
+            next.cache_nodes = cur.cache_nodes;
+        }
+        spare_stale_all = false;
+        spare_stale_arcs.clear();
+        spare_stale_edges.clear();
+        return next;
+    }
+
+    // Makes the spare the current version. `all`: the update rewrote
+    // everything, rather than only what it listed as stale.
+    void publish_metric(bool all) {
+        auto current = std::atomic_load(&metric);
+        spare_metric->version = current->version + 1;
+        std::atomic_store(&metric, spare_metric);
+        spare_metric = std::move(current);
+        spare_stale_all = all;
+    }
+
+    // --- BINARY FILE ---
+
+    // Writes the frozen hierarchy (and node data, landmarks and time
+    // profiles, if set) to `path`.
+    void save(const std::string& path) const {
+        if (!frozen) throw std::logic_error("CHGraph::save() needs a frozen graph");
+        auto m = metric_snapshot();
+        std::vector<chfile::PendingSection> sections = {
+            {chfile::RANK, (uint32_t)sizeof(int), rank.data(), rank.size()},
+            chfile::section(chfile::FWD_OFFSETS, fwd_up.offsets),
+            chfile::section(chfile::FWD_TARGETS, fwd_up.targets),
+            chfile::section(chfile::FWD_WEIGHTS, m->fwd_weights),
+            chfile::section(chfile::FWD_VIA, m->fwd_via),
+            chfile::section(chfile::BWD_OFFSETS, bwd_up.offsets),
+            chfile::section(chfile::BWD_TARGETS, bwd_up.targets),
+            chfile::section(chfile::BWD_WEIGHTS, m->bwd_weights),
+            chfile::section(chfile::BWD_VIA, m->bwd_via),
+            chfile::section(chfile::ARC_FIRST, m->first),
+            chfile::section(chfile::ARC_SECOND, m->second),
+            chfile::section(chfile::ARC_HEAD, unpacking.head),
+        };
+        if (!to_external.empty()) sections.push_back(chfile::section(chfile::NODE_ORDER, to_external));
+        if ((int)node_ids.size() == num_nodes && num_nodes > 0) {
+            sections.push_back(chfile::section(chfile::NODE_LAT, node_lat));
+            sections.push_back(chfile::section(chfile::NODE_LON, node_lon));
+            sections.push_back(chfile::section(chfile::NODE_IDS, node_ids));
+        }
+        sections.push_back(chfile::section(chfile::BASE_SRC, base_src));
+        sections.push_back(chfile::section(chfile::BASE_DST, base_dst));
+        sections.push_back(chfile::section(chfile::BASE_WEIGHT, m->base_weight));
+        uint32_t flags = 0;
+        if (customizable) {
+            sections.push_back(chfile::section(chfile::BASE_ARC, base_arc));
+            flags |= chfile::FLAG_CUSTOMIZABLE;
+        }
+        if (!geom_offsets.empty()) {
+            sections.push_back(chfile::section(chfile::GEOM_OFFSETS, geom_offsets));
+            sections.push_back(chfile::section(chfile::GEOM_DATA, geom_data));
+        }
+        auto lm = std::atomic_load(&landmarks);
+        if (lm && !lm->nodes.empty()) {
+            sections.push_back({chfile::LANDMARK_NODES, (uint32_t)sizeof(int), lm->nodes.data(), lm->nodes.size()});
+            sections.push_back({chfile::LANDMARK_ROWS, (uint32_t)sizeof(double), lm->data(), lm->size(num_nodes)});
+        }
+        auto tt = std::atomic_load(&time_profiles);
+        if (tt) {
+            sections.push_back({chfile::TIME_OFFSETS, (uint32_t)sizeof(uint32_t), tt->offsets.data(), tt->offsets.size()});
+            sections.push_back({chfile::TIME_POINTS, (uint32_t)sizeof(TravelTimeProfiles::Point), tt->points.data(),
+                                tt->points.size()});
+            sections.push_back({chfile::TIME_EDGE_PROFILE, (uint32_t)sizeof(int), tt->edge_profile.data(),
+                                tt->edge_profile.size()});
+            sections.push_back({chfile::TIME_SCALE, (uint32_t)sizeof(double), &tt->seconds_per_unit, 1});
+        }
+        chfile::write(path, num_nodes, sections, flags);
+    }
+
+    // Opens a file written by save(). The CSR arrays and landmark rows are
+    // used in place from the mapping; only rank[] and the small
+    // time-profile tables are copied. The result is frozen and its
+    // topology read-only; a customizable graph can still be customize()d,
+    // which copies the arrays it rewrites. Every index in the file is range
+    // checked, so a corrupt file throws instead of failing at query time.
+    static std::unique_ptr<CHGraph> load(const std::string& path) {
+        auto file = std::make_shared<MappedFile>(path);
+        const char* base = file->data();
+        if (file->size() < sizeof(chfile::Header)) throw std::runtime_error(path + ": not a CH file");
+        chfile::Header h;
+        std::memcpy(&h, base, sizeof(h));
+        if (std::memcmp(h.magic, chfile::MAGIC, sizeof(h.magic)) != 0) throw std::runtime_error(path + ": not a CH file");
+        if (h.endian_tag != chfile::ENDIAN_TAG) throw std::runtime_error(path + ": written on a machine with different endianness");
+        if (h.version != chfile::VERSION) {
+            throw std::runtime_error(path + ": CH file version " + std::to_string(h.version) +
+                                     ", expected " + std::to_string(chfile::VERSION));
+        }
+        if (h.num_nodes > (uint64_t)std::numeric_limits<int>::max() ||
+            sizeof(h) + (uint64_t)h.num_sections * sizeof(chfile::SectionEntry) > file->size()) {
+            throw std::runtime_error(path + ": corrupt header");
+        }
+        const auto* dir = (const chfile::SectionEntry*)(base + sizeof(h));
+        const int n = (int)h.num_nodes;
+
+        auto find = [&](uint32_t id, uint32_t elem_size) -> const chfile::SectionEntry* {
+            for (uint32_t i = 0; i < h.num_sections; ++i) {
+                if (dir[i].id != id) continue;
+                if (dir[i].elem_size != elem_size || dir[i].offset % chfile::ALIGN != 0 ||
+                    dir[i].offset + dir[i].count * elem_size > file->size()) {
+                    throw std::runtime_error(path + ": corrupt section " + std::to_string(id));
+                }
+                return &dir[i];
+            }
+            return nullptr;
+        };
+        auto bind = [&](auto& buffer, uint32_t id, uint64_t expected, bool required) {
+            using T = typename std::remove_reference_t<decltype(buffer)>::value_type;
+            const auto* sec = find(id, sizeof(T));
+            if (!sec) {
+                if (required) throw std::runtime_error(path + ": missing section " + std::to_string(id));
+                return false;
+            }
+            if (expected != (uint64_t)-1 && sec->count != expected) {
+                throw std::runtime_error(path + ": section " + std::to_string(id) + " has the wrong size");
+            }
+            buffer.view((const T*)(base + sec->offset), sec->count);
+            return true;
+        };
+
+        auto g = std::make_unique<CHGraph>(n);
+        Buffer<int> ranks;
+        bind(ranks, chfile::RANK, n, true);
+        g->rank.assign(ranks.begin(), ranks.end());
+        Metric metric;
+        for (auto [up, wts, vias, off, tgt, wt, via] : {
+                 std::make_tuple(&g->fwd_up, &metric.fwd_weights, &metric.fwd_via,
+                                 chfile::FWD_OFFSETS, chfile::FWD_TARGETS, chfile::FWD_WEIGHTS, chfile::FWD_VIA),
+                 std::make_tuple(&g->bwd_up, &metric.bwd_weights, &metric.bwd_via,
+                                 chfile::BWD_OFFSETS, chfile::BWD_TARGETS, chfile::BWD_WEIGHTS, chfile::BWD_VIA)}) {
+            bind(up->offsets, off, (uint64_t)n + 1, true);
+            if (up->offsets[0] != 0) throw std::runtime_error(path + ": corrupt arc offsets");
+            for (int u = 0; u < n; ++u) {
+                if (up->offsets[u] > up->offsets[u + 1]) throw std::runtime_error(path + ": corrupt arc offsets");
+            }
+            uint64_t m = (uint64_t)up->offsets[n];
+            bind(up->targets, tgt, m, true);
+            bind(*wts, wt, m, true);
+            bind(*vias, via, m, true);
+            for (uint64_t i = 0; i < m; ++i) {
+                if (up->targets[i] < 0 || up->targets[i] >= n || (*vias)[i] < -1 || (*vias)[i] >= n) {
+                    throw std::runtime_error(path + ": corrupt arcs");
+                }
+            }
+        }
+        Buffer<int> order;
+        if (bind(order, chfile::NODE_ORDER, n, false)) {
+            std::vector<char> seen(n, 0);
+            for (int u : order) {
+                if (u < 0 || u >= n || seen[u]) throw std::runtime_error(path + ": corrupt node order");
+                seen[u] = 1;
+            }
+            g->set_node_order(std::vector<int>(order.begin(), order.end()));
+        } else {
+            g->set_node_order({});
+        }
+        uint64_t num_arcs = g->fwd_up.targets.size() + g->bwd_up.targets.size();
+        bind(metric.first, chfile::ARC_FIRST, num_arcs, true);
+        bind(metric.second, chfile::ARC_SECOND, num_arcs, true);
+        bind(g->unpacking.head, chfile::ARC_HEAD, num_arcs, true);
+        g->unpacking.num_fwd = (int)g->fwd_up.targets.size();
+        {
+            // Child arcs live at the shortcut's middle node, which ranks
+            // below the node holding the shortcut; checking that keeps
+            // unpacking from looping on a corrupt file.
+            std::vector<int> owner_rank(num_arcs);
+            for (int u = 0; u < n; ++u) {
+                int r = g->rank[g->external(u)];
+                for (int i = g->fwd_up.begin(u); i < g->fwd_up.end(u); ++i) owner_rank[i] = r;
+                for (int i = g->bwd_up.begin(u); i < g->bwd_up.end(u); ++i) owner_rank[g->unpacking.bwd_arc(i)] = r;
+            }
+            for (uint64_t a = 0; a < num_arcs; ++a) {
+                int f = metric.first[a], sc = metric.second[a], hd = g->unpacking.head[a];
+                bool ok = hd >= 0 && hd < n;
+                if (f >= 0 || sc >= 0) {
+                    ok = ok && f >= 0 && sc >= 0 && (uint64_t)f < num_arcs && (uint64_t)sc < num_arcs &&
+                         owner_rank[f] < owner_rank[a] && owner_rank[sc] < owner_rank[a];
+                } else {
+                    ok = ok && f == -1 && sc == -1;
+                }
+                if (!ok) throw std::runtime_error(path + ": corrupt unpacking table");
+            }
+        }
+        bind(g->node_lat, chfile::NODE_LAT, n, false);
+        bind(g->node_lon, chfile::NODE_LON, n, false);
+        bind(g->node_ids, chfile::NODE_IDS, n, false);
+        bind(g->base_src, chfile::BASE_SRC, (uint64_t)-1, true);
+        bind(g->base_dst, chfile::BASE_DST, g->base_src.size(), true);
+        bind(g->base_weight, chfile::BASE_WEIGHT, g->base_src.size(), true);
+        metric.base_weight = g->base_weight;   // another view of the same section
+        for (size_t i = 0; i < g->base_src.size(); ++i) {
+            if (g->base_src[i] < 0 || g->base_src[i] >= n || g->base_dst[i] < 0 || g->base_dst[i] >= n) {
+                throw std::runtime_error(path + ": corrupt base edges");
+            }
+        }
+        if (bind(g->geom_offsets, chfile::GEOM_OFFSETS, g->base_src.size() + 1, false)) {
+            bind(g->geom_data, chfile::GEOM_DATA, (uint64_t)-1, true);
+            for (size_t e = 0; e < g->base_src.size(); ++e) {
+                if (g->geom_offsets[e] < 0 || g->geom_offsets[e] > g->geom_offsets[e + 1] ||
+                    (uint64_t)g->geom_offsets[e + 1] > g->geom_data.size()) {
+                    throw std::runtime_error(path + ": corrupt edge geometry");
+                }
+            }
+            // a truncated varint at the end would read past the data
+            if (!g->geom_data.empty() && (g->geom_data[g->geom_data.size() - 1] & 0x80)) {
+                throw std::runtime_error(path + ": corrupt edge geometry");
+            }
+        }
+        if (h.flags & chfile::FLAG_CUSTOMIZABLE) {
+            bind(g->base_arc, chfile::BASE_ARC, g->base_src.size(), true);
+            for (int a : g->base_arc) {
+                if (a < -1 || a >= (int)num_arcs) throw std::runtime_error(path + ": corrupt base arcs");
+            }
+            g->customizable = true;
+            g->prepare_customization();
+        }
+
+        g->reset_metric(std::move(metric));
+        g->index_base_edges();
+
+        Buffer<int> lm_nodes;
+        if (bind(lm_nodes, chfile::LANDMARK_NODES, (uint64_t)-1, false)) {
+            if (lm_nodes.size() > (size_t)n) throw std::runtime_error(path + ": corrupt landmarks");
+            const int count = (int)lm_nodes.size();
+            Buffer<double> rows;
+            bind(rows, chfile::LANDMARK_ROWS, LandmarkTable::values(n, count), true);
+            if ((uintptr_t)rows.data() % 64 != 0) throw std::runtime_error(path + ": misaligned landmarks");
+            for (int u : lm_nodes) {
+                if (u < 0 || u >= n) throw std::runtime_error(path + ": corrupt landmarks");
+            }
+            auto lm = std::make_shared<LandmarkTable>(count, std::move(rows));
+            lm->nodes.assign(lm_nodes.begin(), lm_nodes.end());
+            lm->metric_version = g->metric_snapshot()->version;
+            g->landmarks = std::move(lm);
+        }
+        Buffer<uint32_t> tt_offsets;
+        if (bind(tt_offsets, chfile::TIME_OFFSETS, (uint64_t)-1, false)) {
+            Buffer<TravelTimeProfiles::Point> points;
+            Buffer<int> edge_profile;
+            Buffer<double> scale;
+            bind(points, chfile::TIME_POINTS, (uint64_t)-1, true);
+            bind(edge_profile, chfile::TIME_EDGE_PROFILE, g->base_src.size(), true);
+            bind(scale, chfile::TIME_SCALE, 1, true);
+            auto tt = std::make_shared<TravelTimeProfiles>();
+            tt->offsets.assign(tt_offsets.begin(), tt_offsets.end());
+            tt->points.assign(points.begin(), points.end());
+            tt->edge_profile.assign(edge_profile.begin(), edge_profile.end());
+            tt->seconds_per_unit = scale[0];
+            const int num_profiles = (int)tt->offsets.size() - 1;
+            bool ok = num_profiles >= 0 && tt->offsets[0] == 0 && tt->offsets.back() == tt->points.size() &&
+                      tt->seconds_per_unit > 0;
+            for (int p = 0; ok && p < num_profiles; ++p) {
+                ok = tt->offsets[p] < tt->offsets[p + 1];
+                for (uint32_t k = tt->offsets[p]; ok && k < tt->offsets[p + 1]; ++k) {
+                    ok = tt->points[k].factor > 0 && (k == tt->offsets[p] || tt->points[k - 1].time < tt->points[k].time);
+                    tt->min_factor = std::min(tt->min_factor, tt->points[k].factor * TravelTimeProfiles::FACTOR_UNIT);
+                }
+            }
+            for (int p : tt->edge_profile) ok = ok && p >= -1 && p < num_profiles;
+            if (!ok) throw std::runtime_error(path + ": corrupt time profiles");
+            g->time_profiles = std::move(tt);
+        }
+
+        g->frozen = true;
+        g->mapping = std::move(file);
+        return g;
+    }
+
+    // Streams an osmnx GraphML file into a new, unbuilt graph (nodes in
+    // file order, their OSM ids, coordinates and edge shapes), without
+    // NetworkX. The file is read chunk_bytes at a time and each chunk is
+    // parsed on num_threads threads, so beyond the graph itself peak memory
+    // stays around one chunk.
+    static std::unique_ptr<CHGraph> from_graphml(const std::string& path, int num_threads = 0,
+                                                 size_t chunk_bytes = 64 << 20) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("cannot open " + path);
+        num_threads = resolve_threads(num_threads);
+        chunk_bytes = std::max<size_t>(chunk_bytes, 1 << 16);
+        graphml::Keys keys;
+        bool have_keys = false;
+        graphml::Records all;
+        std::vector<graphml::Records> parts(num_threads);
+        std::string buffer;
+        size_t read_size = chunk_bytes;
+        for (bool eof = false; !eof;) {
+            size_t kept = buffer.size();
+            buffer.resize(kept + read_size);
+            in.read(&buffer[kept], (std::streamsize)read_size);
+            buffer.resize(kept + (size_t)in.gcount());
+            eof = !in;
+            std::string_view text(buffer);
+            size_t first = graphml::next_element(text, 0);
+            if (!have_keys && (first != std::string_view::npos || eof)) {
+                keys = graphml::parse_keys(text.substr(0, first));
+                have_keys = true;
+            }
+            // The last element may be cut off: keep it for the next chunk.
+            size_t cut = eof ? text.size() : graphml::last_element(text);
+            if (first == std::string_view::npos || cut == std::string_view::npos || cut <= first) {
+                if (eof) break;
+                read_size = std::max(read_size, buffer.size());   // one element spans the chunk
+                continue;
+            }
+            read_size = chunk_bytes;
+
+            // Slices of about equal size, each starting at an element.
+            std::vector<size_t> bounds{first};
+            for (int k = 1; k < num_threads; ++k) {
+                size_t at = graphml::next_element(text, first + (cut - first) * k / num_threads);
+                if (at < cut && at > bounds.back()) bounds.push_back(at);
+            }
+            bounds.push_back(cut);
+            parallel_for((int)bounds.size() - 1, num_threads, [&](int k, int) {
+                graphml::parse(text.substr(bounds[k], bounds[k + 1] - bounds[k]), keys, parts[k]);
+            });
+            for (size_t k = 0; k + 1 < bounds.size(); ++k) all.append(parts[k]);
+            buffer.erase(0, cut);
+        }
+
+        // OSM ids -> node indices, by binary search over the sorted ids.
+        const int n = (int)all.node_ids.size();
+        if ((size_t)n != all.node_ids.size() || n > Edge::MAX_NODES) throw std::runtime_error(path + ": too many nodes");
+        std::vector<std::pair<int64_t, int>> by_id(n);
+        for (int u = 0; u < n; ++u) by_id[u] = {all.node_ids[u], u};
+        std::sort(by_id.begin(), by_id.end());
+        for (int u = 1; u < n; ++u) {
+            if (by_id[u].first == by_id[u - 1].first) {
+                throw std::runtime_error(path + ": duplicate node " + std::to_string(by_id[u].first));
+            }
+        }
+        const size_t m = all.src.size();
+        std::vector<int> src(m), dst(m);
+        auto index = [&](int64_t id) {
+            auto it = std::lower_bound(by_id.begin(), by_id.end(), std::make_pair(id, INT32_MIN));
+            if (it == by_id.end() || it->first != id) throw std::runtime_error(path + ": edge to unknown node " + std::to_string(id));
+            return it->second;
+        };
+        for (size_t i = 0; i < m; ++i) {
+            src[i] = index(all.src[i]);
+            dst[i] = index(all.dst[i]);
+        }
+        std::vector<std::pair<int64_t, int>>().swap(by_id);
+        std::vector<int64_t>().swap(all.src);
+        std::vector<int64_t>().swap(all.dst);
+
+        auto g = std::make_unique<CHGraph>(n);
+        g->set_nodes(all.node_ids.data(), all.lat.data(), all.lon.data(), n);
+        g->add_edges(src.data(), dst.data(), all.weight.data(), nullptr, nullptr, m);
+        std::vector<int64_t> offsets(m + 1, 0);
+        for (size_t e = 0; e < m; ++e) offsets[e + 1] = offsets[e] + all.geom_bytes[e];
+        g->geom_offsets.assign(std::move(offsets));
+        g->geom_data.assign(std::move(all.geom_data));
+        return g;
+    }
+
+    // --- CONTRACTION ---
+    struct Shortcut {
+        int from;
+        int to;
+        double weight;
+    };
+
+    // Per-thread contraction state. The lists keep their capacity from one
+    // node to the next, so after warm-up contracting a node allocates
+    // nothing.
+    struct ContractionScratch {
+        WitnessSearch ws;
+        std::vector<Edge> in_neighbors;
+        std::vector<Edge> out_neighbors;
+        std::vector<int> out_targets;
+        std::vector<Shortcut> shortcuts;
+        std::vector<Edge> spill;   // retire_contracted
+    };
+
+    // The live prefix of u's adjacency list, see live_degree.
+    template <typename F>
+    void for_each_live_entry(int u, F&& fn) const {
+        const Edge* entries = adj[u].data();
+        for (uint32_t i = 0; i < live_degree[u]; ++i) fn(entries[i]);
+    }
+
+    // Shortcuts needed to contract `node` out of the remaining graph, without
+    // modifying anything (safe to call from several threads, one scratch
+    // each). `removed` gets the number of remaining edges that contracting
+    // `node` would delete.
+    void collect_shortcuts(int node, ContractionScratch& s, std::vector<Shortcut>& out, int& removed) const {
+        auto& in_neighbors = s.in_neighbors;
+        auto& out_neighbors = s.out_neighbors;
+        auto& out_targets = s.out_targets;
+        in_neighbors.clear();
+        out_neighbors.clear();
+        out_targets.clear();
+        double max_out = 0.0;
+        for_each_live_entry(node, [&](const Edge& e) {
+            if (contracted[e.target] || e.target == node) return;
+            if (e.has(Edge::BWD)) in_neighbors.push_back(e);
+            if (!e.has(Edge::FWD)) return;
+            out_neighbors.push_back(e);
+            out_targets.push_back(e.target);
+            max_out = std::max(max_out, e.weight);
+        });
+        removed = (int)(in_neighbors.size() + out_neighbors.size());
+        if (out_neighbors.empty()) return;
+
+        for (const auto& in_edge : in_neighbors) {
+            int u = in_edge.target;
+            double d_uv = in_edge.weight;
+            s.ws.run(adj, live_degree, contracted, u, node, d_uv + max_out, out_targets,
+                     witness_settled_limit, witness_hop_limit);
+            for (const auto& out_edge : out_neighbors) {
+                int w = out_edge.target;
+                if (u == w) continue;
+
+                double total = d_uv + out_edge.weight;
+                if (s.ws.dist_of(w) > total) out.push_back({u, w, total});
+            }
+        }
+    }
+
+    // Calls fn(v) for every remaining (uncontracted) neighbour of u.
+    template <typename F>
+    void for_each_remaining_neighbor(int u, F&& fn) const {
+        for_each_live_entry(u, [&](const Edge& e) {
+            if (contracted[e.target] || e.target == u) return;
+            if (e.has(Edge::FWD)) fn(e.target);
+            if (e.has(Edge::BWD)) fn(e.target);
+        });
+    }
+
+    // Compaction: moves u's entries to contracted nodes behind its live
+    // prefix, keeping the order of both parts. They stay in the list for
+    // freeze() and export_edges() but no contraction step scans them again.
+    void retire_contracted(int u, std::vector<Edge>& spill) {
+        Edge* entries = adj[u].data();
+        uint32_t keep = 0;
+        spill.clear();
+        for (uint32_t i = 0; i < live_degree[u]; ++i) {
+            if (contracted[entries[i].target]) spill.push_back(entries[i]);
+            else entries[keep++] = entries[i];
+        }
+        std::copy(spill.begin(), spill.end(), entries + keep);
+        live_degree[u] = keep;
+    }
+
+    void begin_contraction() {
+        live_degree.resize(num_nodes);
+        for (int u = 0; u < num_nodes; ++u) live_degree[u] = (uint32_t)adj[u].size();
+    }
+
+    // Releases the contraction-only state in one go: the live prefixes and
+    // the growth slack the shortcuts left in the adjacency lists.
+    void end_contraction() {
+        std::vector<uint32_t>().swap(live_degree);
+        for (auto& list : adj) list.shrink_to_fit();
+    }
+
+    // Inserts a shortcut unless an arc at least as short already exists; a
+    // longer shortcut between the same nodes is replaced in place, so there
+    // are no parallel shortcuts. Returns false if nothing changed.
+    bool add_shortcut(const Shortcut& sc, int via) {
+        for (uint32_t i = 0; i < live_degree[sc.from]; ++i) {
+            Edge& e = adj[sc.from][i];
+            if (e.target != sc.to || !e.has(Edge::FWD)) continue;
+            if (e.weight <= sc.weight) return false;
+            if (!e.is_shortcut()) continue;
+            Edge& r = twin(sc.from, e);
+            if (e.has(Edge::BWD)) {
+                // two-way shortcut: the reverse direction keeps its weight
+                e.bits &= ~Edge::FWD;
+                r.bits &= ~Edge::BWD;
+                insert_edge(sc.from, sc.to, sc.weight, true, via);
+                return true;
+            }
+            r.weight = e.weight = sc.weight;
+            r.set_via(via);
+            e.set_via(via);
+            return true;
+        }
+        insert_edge(sc.from, sc.to, sc.weight, true, via);
+        return true;
+    }
+
+    // Inserts the shortcuts of a contracted node, records them under its
+    // level and lifts its remaining neighbours to at least level + 1.
+    int apply_contraction(int node, const std::vector<Shortcut>& shortcuts) {
+        int added = 0;
+        for (const auto& sc : shortcuts) { if (add_shortcut(sc, node)) added++; }
+        if ((int)shortcuts_per_level.size() <= level[node]) shortcuts_per_level.resize(level[node] + 1, 0);
+        shortcuts_per_level[level[node]] += added;
+        for_each_remaining_neighbor(node, [&](int v) { level[v] = std::max(level[v], level[node] + 1); });
+        return added;
+    }
+
+    void reset_build_stats() {
+        level.assign(num_nodes, 0);
+        shortcuts_per_level.clear();
+    }
+
+    // Every shortcut the witness search cannot rule out is added, so the
+    // hierarchy preserves all shortest paths whatever the order.
+    int contract_node(int node, ContractionScratch& s) {
+        contracted[node] = true;
+        s.shortcuts.clear();
+        int removed;
+        collect_shortcuts(node, s, s.shortcuts, removed);
+        int added = apply_contraction(node, s.shortcuts);
+        for_each_live_entry(node, [&](const Edge& e) {
+            if (!contracted[e.target]) retire_contracted(e.target, s.spill);
+        });
+        return added;
+    }
+
+    void build_ch(std::vector<int> order) {
+        check_mutable();
+        node_order = order;
+        reset_build_stats();
+        begin_contraction();
+        ContractionScratch scratch;
+        int r = 0;
+        for (int node : node_order) {
+            rank[node] = r++;
+            contract_node(node, scratch);
+            if (r % 5000 == 0) std::cout << "Progress: " << r << "/" << node_order.size() << std::endl;
+        }
+        end_contraction();
+        freeze();
+    }
+
+    // --- NATIVE ORDERING ---
+
+    // Bottom-up contraction that picks its own order instead of taking one
+    // from Python. Priority = 2 * edge difference + contracted neighbours +
+    // depth, recomputed lazily only for nodes whose neighbourhood changed.
+    // Each round contracts an independent set of local priority minima in
+    // parallel; their witness searches skip the whole set, so two nodes of
+    // one round can never serve as each other's witness.
+    void build_ch_auto(int num_threads = 0) {
+        check_mutable();
+        std::vector<int> priority(num_nodes, 0);
+        std::vector<int> contracted_neighbors(num_nodes, 0);
+        std::vector<char> dirty(num_nodes, 1);
+        std::vector<int> remaining(num_nodes);
+        for (int u = 0; u < num_nodes; ++u) remaining[u] = u;
+        node_order.clear();
+        node_order.reserve(num_nodes);
+        reset_build_stats();
+
+        auto less = [&](int a, int b) {
+            return priority[a] < priority[b] || (priority[a] == priority[b] && a < b);
+        };
+
+        num_threads = resolve_threads(num_threads);
+        std::vector<ContractionScratch> scratch(num_threads);
+        std::vector<int> batch, touched;
+        std::vector<std::vector<Shortcut>> batch_shortcuts;
+        begin_contraction();
+        while (!remaining.empty()) {
+            // 1. Refresh the priorities that went stale in the last round.
+            std::vector<int> stale;
+            for (int u : remaining) { if (dirty[u]) stale.push_back(u); }
+            parallel_for((int)stale.size(), num_threads, [&](int i, int t) {
+                int u = stale[i];
+                auto& shortcuts = scratch[t].shortcuts;
+                shortcuts.clear();
+                int removed;
+                collect_shortcuts(u, scratch[t], shortcuts, removed);
+                priority[u] = 2 * ((int)shortcuts.size() - removed) + contracted_neighbors[u] + level[u];
+                dirty[u] = 0;
+            });
+
+            // 2. Independent set: nodes that beat all their remaining neighbours.
+            batch.clear();
+            for (int u : remaining) {
+                bool is_min = true;
+                for_each_remaining_neighbor(u, [&](int v) { if (less(v, u)) is_min = false; });
+                if (is_min) batch.push_back(u);
+            }
+
+            // 3. Contract the set in parallel, then insert its shortcuts.
+            for (int u : batch) {
+                contracted[u] = true;
+                rank[u] = (int)node_order.size();
+                node_order.push_back(u);
+            }
+            // The per-slot lists are reused from round to round.
+            if (batch_shortcuts.size() < batch.size()) batch_shortcuts.resize(batch.size());
+            parallel_for((int)batch.size(), num_threads, [&](int i, int t) {
+                int removed;
+                batch_shortcuts[i].clear();
+                collect_shortcuts(batch[i], scratch[t], batch_shortcuts[i], removed);
+            });
+            for (size_t i = 0; i < batch.size(); ++i) {
+                int u = batch[i];
+                apply_contraction(u, batch_shortcuts[i]);
+                for_each_remaining_neighbor(u, [&](int v) {
+                    contracted_neighbors[v]++;
+                    dirty[v] = 1;
+                });
+            }
+
+            remaining.erase(std::remove_if(remaining.begin(), remaining.end(),
+                                           [&](int u) { return contracted[u]; }),
+                            remaining.end());
+
+            // 4. Compact the lists of the set's neighbours (exactly the
+            // nodes just marked dirty).
+            touched.clear();
+            for (int u : remaining) { if (dirty[u]) touched.push_back(u); }
+            parallel_for((int)touched.size(), num_threads, [&](int i, int t) {
+                retire_contracted(touched[i], scratch[t].spill);
+            });
+            int done = (int)node_order.size();
+            if (done / 5000 != (done - (int)batch.size()) / 5000) {
+                std::cout << "Progress: " << done << "/" << num_nodes << std::endl;
+            }
+        }
+        end_contraction();
+        freeze();
+    }
+
+    // --- CUSTOMIZABLE CH ---
+    // Metric-independent hierarchy for changing weights. build_cch() fixes
+    // an order and adds every shortcut that order can ever need (no witness
+    // search), so only the weights depend on the metric; customize() then
+    // recomputes them bottom-up from new base edge weights.
+
+    // Orders the nodes of `nodes` (appending to `order`) by recursive
+    // bisection at the median of the wider coordinate axis. Nodes of the
+    // lower half that touch the upper half form the separator and are
+    // ranked above both halves.
+    void dissect(std::vector<int>& nodes, const std::vector<std::vector<int>>& nbrs,
+                 std::vector<int>& mark, int& stamp, std::vector<int>& order) const {
+        auto by_degree = [&](int a, int b) {
+            return nbrs[a].size() < nbrs[b].size() || (nbrs[a].size() == nbrs[b].size() && a < b);
+        };
+        if (nodes.size() <= 64) {
+            std::sort(nodes.begin(), nodes.end(), by_degree);
+            order.insert(order.end(), nodes.begin(), nodes.end());
+            return;
+        }
+        double min_lat = 90, max_lat = -90, min_lon = 180, max_lon = -180;
+        for (int u : nodes) {
+            min_lat = std::min(min_lat, node_lat[u]);
+            max_lat = std::max(max_lat, node_lat[u]);
+            min_lon = std::min(min_lon, node_lon[u]);
+            max_lon = std::max(max_lon, node_lon[u]);
+        }
+        double lon_scale = std::cos((min_lat + max_lat) / 2 * (3.14159265358979323846 / 180.0));
+        bool split_lon = (max_lon - min_lon) * lon_scale > max_lat - min_lat;
+        const Buffer<double>& key = split_lon ? node_lon : node_lat;
+        size_t mid = nodes.size() / 2;
+        std::nth_element(nodes.begin(), nodes.begin() + mid, nodes.end(),
+                         [&](int a, int b) { return key[a] < key[b] || (key[a] == key[b] && a < b); });
+
+        std::vector<int> lower, upper(nodes.begin() + mid, nodes.end()), separator;
+        ++stamp;
+        for (int u : upper) mark[u] = stamp;
+        for (size_t i = 0; i < mid; ++i) {
+            int u = nodes[i];
+            bool touches = false;
+            for (int v : nbrs[u]) { if (mark[v] == stamp) { touches = true; break; } }
+            (touches ? separator : lower).push_back(u);
+        }
+        std::vector<int>().swap(nodes);
+        dissect(lower, nbrs, mark, stamp, order);
+        dissect(upper, nbrs, mark, stamp, order);
+        std::sort(separator.begin(), separator.end(), by_degree);
+        order.insert(order.end(), separator.begin(), separator.end());
+    }
+
+    // Default order for build_cch(): nested dissection on the node
+    // coordinates, or by degree if some node has none.
+    std::vector<int> nested_dissection_order() const {
+        std::vector<std::vector<int>> nbrs(num_nodes);
+        for (size_t i = 0; i < base_src.size(); ++i) {
+            int a = base_src[i], b = base_dst[i];
+            if (a == b) continue;
+            nbrs[a].push_back(b);
+            nbrs[b].push_back(a);
+        }
+        for (auto& nb : nbrs) {
+            std::sort(nb.begin(), nb.end());
+            nb.erase(std::unique(nb.begin(), nb.end()), nb.end());
+        }
+
+        std::vector<int> nodes(num_nodes), order;
+        for (int u = 0; u < num_nodes; ++u) nodes[u] = u;
+        bool has_coords = (int)node_lat.size() == num_nodes && (int)node_lon.size() == num_nodes;
+        for (int u = 0; has_coords && u < num_nodes; ++u) {
+            has_coords = std::isfinite(node_lat[u]) && std::isfinite(node_lon[u]);
+        }
+        if (!has_coords) {
+            std::stable_sort(nodes.begin(), nodes.end(),
+                             [&](int a, int b) { return nbrs[a].size() < nbrs[b].size(); });
+            return nodes;
+        }
+        order.reserve(num_nodes);
+        std::vector<int> mark(num_nodes, 0);
+        int stamp = 0;
+        dissect(nodes, nbrs, mark, stamp, order);
+        return order;
+    }
+
+    // Builds the metric-independent hierarchy for `order` (empty: nested
+    // dissection) and customizes it with the edges' current weights.
+    // Contracting a node connects all its higher-ranked neighbours, so the
+    // upward graphs become the chordal completion of the base graph; both
+    // directions share that topology, with +inf for a missing direction.
+    void build_cch(std::vector<int> order, int num_threads = 0) {
+        check_mutable();
+        if (order.empty()) order = nested_dissection_order();
+        if ((int)order.size() != num_nodes) throw std::invalid_argument("build_cch needs one order entry per node");
+        std::vector<int> new_rank(num_nodes, -1);
+        for (int r = 0; r < num_nodes; ++r) {
+            int u = order[r];
+            if (u < 0 || u >= num_nodes || new_rank[u] != -1) throw std::invalid_argument("build_cch order is not a permutation");
+            new_rank[u] = r;
+        }
+        rank = std::move(new_rank);
+        node_order = std::move(order);
+        set_node_order({});   // customization works on external numbers
+
+        // Symbolic contraction in rank order. The upper neighbours of v,
+        // minus the lowest one p, all become upper neighbours of p.
+        std::vector<std::vector<int>> up(num_nodes);
+        for (size_t i = 0; i < base_src.size(); ++i) {
+            int a = base_src[i], b = base_dst[i];
+            if (a == b) continue;
+            if (rank[a] < rank[b]) up[a].push_back(b); else up[b].push_back(a);
+        }
+        std::vector<int> base_count(num_nodes);
+        for (int u = 0; u < num_nodes; ++u) {
+            std::sort(up[u].begin(), up[u].end());
+            up[u].erase(std::unique(up[u].begin(), up[u].end()), up[u].end());
+            base_count[u] = (int)up[u].size();
+        }
+        reset_build_stats();
+        for (int v : node_order) {
+            auto& nb = up[v];
+            std::sort(nb.begin(), nb.end());
+            nb.erase(std::unique(nb.begin(), nb.end()), nb.end());
+            if (nb.empty()) continue;
+            int p = *std::min_element(nb.begin(), nb.end(), [&](int a, int b) { return rank[a] < rank[b]; });
+            for (int x : nb) {
+                level[x] = std::max(level[x], level[v] + 1);
+                if (x != p) up[p].push_back(x);
+            }
+            if ((int)shortcuts_per_level.size() <= level[v]) shortcuts_per_level.resize(level[v] + 1, 0);
+            shortcuts_per_level[level[v]] += (long long)nb.size() - base_count[v];
+        }
+
+        std::vector<int> offs(num_nodes + 1, 0), tgts;
+        for (int u = 0; u < num_nodes; ++u) {
+            tgts.insert(tgts.end(), up[u].begin(), up[u].end());
+            std::vector<int>().swap(up[u]);
+            offs[u + 1] = (int)tgts.size();
+        }
+        const size_t num_up = tgts.size();
+        fwd_up.offsets.assign(std::move(offs));
+        fwd_up.targets.assign(std::move(tgts));
+        bwd_up = fwd_up;
+        Metric m;
+        m.fwd_weights.assign(std::vector<double>(num_up, std::numeric_limits<double>::infinity()));
+        m.bwd_weights = m.fwd_weights;
+        m.fwd_via.assign(std::vector<int>(num_up, -1));
+        m.bwd_via = m.fwd_via;
+        unpacking.build(fwd_up, bwd_up, m);
+        m.base_weight.assign(std::vector<double>(base_weight.begin(), base_weight.end()));
+        reset_metric(std::move(m));
+
+        std::vector<int> arcs(base_src.size(), -1);
+        for (size_t i = 0; i < arcs.size(); ++i) {
+            int a = base_src[i], b = base_dst[i];
+            if (a == b) continue;
+            arcs[i] = rank[a] < rank[b] ? fwd_up.find(a, b) : unpacking.bwd_arc(bwd_up.find(b, a));
+        }
+        base_arc.assign(std::move(arcs));
+        customizable = true;
+        index_base_edges();
+        frozen = true;
+        prepare_customization();
+        std::vector<double> weights(base_weight.begin(), base_weight.end());
+        customize(weights.data(), weights.size(), num_threads);
+    }
+
+    // Derives what customize() needs from the upward topology: for every
+    // node the arcs reaching it from below, and the nodes grouped by level
+    // (one more than the highest level below them), so that all lower
+    // triangles of a level are final before it is processed.
+    void prepare_customization() {
+        std::vector<int> by_rank(num_nodes, -1);
+        for (int u = 0; u < num_nodes; ++u) {
+            if (rank[u] < 0 || rank[u] >= num_nodes || by_rank[rank[u]] != -1) {
+                throw std::runtime_error("CCH ranks are not a permutation");
+            }
+            by_rank[rank[u]] = u;
+        }
+
+        down_offsets.assign(num_nodes + 1, 0);
+        for (int v = 0; v < num_nodes; ++v) {
+            for (int i = fwd_up.begin(v); i < fwd_up.end(v); ++i) down_offsets[fwd_up.targets[i] + 1]++;
+        }
+        for (int u = 0; u < num_nodes; ++u) down_offsets[u + 1] += down_offsets[u];
+        down_from.resize(down_offsets[num_nodes]);
+        down_arc.resize(down_offsets[num_nodes]);
+        std::vector<int> fill(down_offsets.begin(), down_offsets.end() - 1);
+        for (int v = 0; v < num_nodes; ++v) {
+            for (int i = fwd_up.begin(v); i < fwd_up.end(v); ++i) {
+                int k = fill[fwd_up.targets[i]]++;
+                down_from[k] = v;
+                down_arc[k] = i;
+            }
+        }
+
+        level.assign(num_nodes, 0);
+        int max_level = 0;
+        for (int v : by_rank) {
+            for (int i = fwd_up.begin(v); i < fwd_up.end(v); ++i) {
+                int& l = level[fwd_up.targets[i]];
+                l = std::max(l, level[v] + 1);
+                max_level = std::max(max_level, l);
+            }
+        }
+        level_offsets.assign(max_level + 2, 0);
+        for (int u = 0; u < num_nodes; ++u) level_offsets[level[u] + 1]++;
+        for (int l = 0; l <= max_level; ++l) level_offsets[l + 1] += level_offsets[l];
+        level_nodes.resize(num_nodes);
+        std::vector<int> next(level_offsets.begin(), level_offsets.end() - 1);
+        for (int u = 0; u < num_nodes; ++u) level_nodes[next[level[u]]++] = u;
+
+        int num_arcs = 2 * unpacking.num_fwd;
+        arc_base_offsets.assign(num_arcs + 1, 0);
+        for (int a : base_arc) { if (a >= 0) arc_base_offsets[a + 1]++; }
+        for (int a = 0; a < num_arcs; ++a) arc_base_offsets[a + 1] += arc_base_offsets[a];
+        arc_base_edges.resize(arc_base_offsets[num_arcs]);
+        std::vector<int> slot(arc_base_offsets.begin(), arc_base_offsets.end() - 1);
+        for (size_t e = 0; e < base_arc.size(); ++e) {
+            if (base_arc[e] >= 0) arc_base_edges[slot[base_arc[e]]++] = (int)e;
+        }
+    }
+
+    // Recomputes every hierarchy weight from `weights` (one per base edge,
+    // in base edge order) and publishes them as the next metric version.
+    // Arcs start at their cheapest base edge; then, level by level and in
+    // parallel within a level, arc u -> w is relaxed through every lower
+    // triangle u -> v -> w. Queries keep using the previous version
+    // meanwhile.
+    void customize(const double* weights, size_t m, int num_threads = 0) {
+        if (!customizable) throw std::logic_error("customize() needs a graph built with build_cch()");
+        if (m != base_src.size()) throw std::invalid_argument("customize needs one weight per base edge");
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        Metric& next = begin_metric_update(false);
+        const double INF = std::numeric_limits<double>::infinity();
+        const int F = unpacking.num_fwd;
+        next.fwd_weights.resize(F);
+        next.bwd_weights.resize(F);
+        next.fwd_via.resize(F);
+        next.bwd_via.resize(F);
+        next.first.resize(2 * F);
+        next.second.resize(2 * F);
+        double* fw = next.fwd_weights.mutable_data();
+        double* bw = next.bwd_weights.mutable_data();
+        int* fvia = next.fwd_via.mutable_data();
+        int* bvia = next.bwd_via.mutable_data();
+        int* first = next.first.mutable_data();
+        int* second = next.second.mutable_data();
+        std::fill(fw, fw + F, INF);
+        std::fill(bw, bw + F, INF);
+        std::fill(fvia, fvia + F, -1);
+        std::fill(bvia, bvia + F, -1);
+        std::fill(first, first + 2 * F, -1);
+        std::fill(second, second + 2 * F, -1);
+        next.cache_offset.clear();   // cached expansions belong to the old metric
+        next.cache_nodes.clear();
+
+        for (size_t e = 0; e < m; ++e) {
+            int a = base_arc[e];
+            if (a < 0) continue;
+            double& slot = a < F ? fw[a] : bw[a - F];
+            slot = std::min(slot, weights[e]);
+        }
+        next.base_weight.assign(std::vector<double>(weights, weights + m));
+
+        // Arcs at u are written only by u's task; the triangle arcs read
+        // live at lower levels. Up(v) and up(u) are both sorted by target,
+        // so their common targets w come from one merge.
+        auto relax_node = [&](int u) {
+            for (int k = down_offsets[u]; k < down_offsets[u + 1]; ++k) {
+                int v = down_from[k], vu = down_arc[k];
+                int i = fwd_up.begin(u), j = fwd_up.begin(v);
+                while (i < fwd_up.end(u) && j < fwd_up.end(v)) {
+                    int wi = fwd_up.targets[i], wj = fwd_up.targets[j];
+                    if (wi < wj) { ++i; continue; }
+                    if (wj < wi) { ++j; continue; }
+                    double up_cost = bw[vu] + fw[j];     // u -> v -> w
+                    if (up_cost < fw[i]) {
+                        fw[i] = up_cost;
+                        fvia[i] = v;
+                        first[i] = unpacking.bwd_arc(vu);
+                        second[i] = j;
+                    }
+                    double down_cost = bw[j] + fw[vu];   // w -> v -> u
+                    if (down_cost < bw[i]) {
+                        bw[i] = down_cost;
+                        bvia[i] = v;
+                        first[unpacking.bwd_arc(i)] = unpacking.bwd_arc(j);
+                        second[unpacking.bwd_arc(i)] = vu;
+                    }
+                    ++i;
+                    ++j;
+                }
+            }
+        };
+        for (size_t l = 0; l + 1 < level_offsets.size(); ++l) {
+            const int* nodes = level_nodes.data() + level_offsets[l];
+            int count = level_offsets[l + 1] - level_offsets[l];
+            parallel_for(count, count < 256 ? 1 : num_threads, [&](int k, int) { relax_node(nodes[k]); });
+        }
+        publish_metric(true);
+    }
+
+    // Sets one direction of arc pair i (global id a) in m if `cost` is
+    // cheaper, recording its middle node (-1: base edge) and child arcs.
+    bool improve_arc(Metric& m, int i, int a, double cost, int via, int first, int second) {
+        bool up = a == i;
+        const double current = up ? m.fwd_weights[i] : m.bwd_weights[i];
+        if (!(cost < current)) return false;
+        (up ? m.fwd_weights : m.bwd_weights).mutable_data()[i] = cost;
+        (up ? m.fwd_via : m.bwd_via).mutable_data()[i] = via;
+        m.first.mutable_data()[a] = first;
+        m.second.mutable_data()[a] = second;
+        return true;
+    }
+
+    // Offers arc pair i (u -> w and w -> u) its cheapest base edges, or the
+    // lower triangle through v (v >= 0; vu is arc v -> u if known).
+    // Returns true if a weight changed.
+    bool relax_arc(Metric& m, int u, int i, int v, int vu = -1) {
+        const double INF = std::numeric_limits<double>::infinity();
+        const int bi = unpacking.bwd_arc(i);
+        if (v < 0) {
+            double up = INF, down = INF;
+            for (int k = arc_base_offsets[i]; k < arc_base_offsets[i + 1]; ++k) up = std::min(up, m.base_weight[arc_base_edges[k]]);
+            for (int k = arc_base_offsets[bi]; k < arc_base_offsets[bi + 1]; ++k) down = std::min(down, m.base_weight[arc_base_edges[k]]);
+            bool changed = improve_arc(m, i, i, up, -1, -1, -1);
+            return improve_arc(m, i, bi, down, -1, -1, -1) || changed;
+        }
+        if (vu < 0) vu = fwd_up.find(v, u);
+        int j = fwd_up.find(v, fwd_up.targets[i]);
+        if (vu < 0 || j < 0) return false;
+        bool changed = improve_arc(m, i, i, m.bwd_weights[vu] + m.fwd_weights[j], v, unpacking.bwd_arc(vu), j);
+        return improve_arc(m, i, bi, m.bwd_weights[j] + m.fwd_weights[vu], v, unpacking.bwd_arc(j), vu) || changed;
+    }
+
+    // Recomputes arc pair i from scratch. Returns true if a weight changed;
+    // `relinked` is set if the weights held but a tied triangle replaced
+    // the middle node or child arcs, which the spare metric must copy too.
+    bool recustomize_arc(Metric& m, int u, int i, bool& relinked) {
+        const double INF = std::numeric_limits<double>::infinity();
+        const int bi = unpacking.bwd_arc(i);
+        const double old_up = m.fwd_weights[i], old_down = m.bwd_weights[i];
+        const int old_links[6] = {m.fwd_via[i], m.bwd_via[i], m.first[i], m.second[i], m.first[bi], m.second[bi]};
+        m.fwd_weights.mutable_data()[i] = INF;
+        m.bwd_weights.mutable_data()[i] = INF;
+        m.fwd_via.mutable_data()[i] = -1;
+        m.bwd_via.mutable_data()[i] = -1;
+        for (int a : {i, bi}) {
+            m.first.mutable_data()[a] = -1;
+            m.second.mutable_data()[a] = -1;
+        }
+        relax_arc(m, u, i, -1);
+        for (int k = down_offsets[u]; k < down_offsets[u + 1]; ++k) relax_arc(m, u, i, down_from[k], down_arc[k]);
+        const int links[6] = {m.fwd_via[i], m.bwd_via[i], m.first[i], m.second[i], m.first[bi], m.second[bi]};
+        relinked = !std::equal(links, links + 6, old_links);
+        return m.fwd_weights[i] != old_up || m.bwd_weights[i] != old_down;
+    }
+
+    // Applies a batch of base edge weight changes without a full
+    // customize() and publishes the result as the next metric version. A
+    // worklist ordered by the rank of an arc's lower end visits every arc
+    // after its lower triangles; each entry names what changed under the
+    // arc (a triangle's middle node, or -1 for its base edges). That part
+    // is simply re-offered, unless the arc's current best came through it
+    // and may have got worse, in which case the arc is recomputed. A
+    // changed arc queues the upper triangles it is a side of, so the work
+    // stays proportional to the affected arcs. Returns the number of arcs
+    // visited. On a classic CH only the base edge weights change: the
+    // hierarchy keeps its build-time weights and A* picks up the new ones.
+    int update_weights(const int* edges, const double* weights, size_t m) {
+        if (!frozen) throw std::logic_error("update_weights() needs a frozen graph");
+        for (size_t k = 0; k < m; ++k) {
+            if (edges[k] < 0 || (size_t)edges[k] >= base_src.size()) {
+                throw std::out_of_range("edge id " + std::to_string(edges[k]) + " out of range");
+            }
+        }
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        Metric& next = begin_metric_update(true);
+        double* bw = next.base_weight.mutable_data();
+
+        // (rank of the lower end u, storage index, u, changed part)
+        std::vector<std::tuple<int, int, int, int>> heap;
+        auto enqueue = [&](int i, int via) {
+            int u = (int)(std::upper_bound(fwd_up.offsets.begin(), fwd_up.offsets.end(), i) - fwd_up.offsets.begin()) - 1;
+            heap.push_back({rank[u], i, u, via});
+            std::push_heap(heap.begin(), heap.end(), std::greater<>());
+        };
+        auto pop = [&]() {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+            auto top = heap.back();
+            heap.pop_back();
+            return top;
+        };
+        for (size_t k = 0; k < m; ++k) {
+            bw[edges[k]] = weights[k];
+            spare_stale_edges.push_back(edges[k]);
+            if (!customizable) continue;
+            int a = base_arc[edges[k]];
+            if (a >= 0) enqueue(a < unpacking.num_fwd ? a : a - unpacking.num_fwd, -1);
+        }
+
+        int touched = 0;
+        std::vector<int> parts;
+        while (!heap.empty()) {
+            auto [r, i, u, via] = pop();
+            parts.assign(1, via);
+            while (!heap.empty() && std::get<1>(heap.front()) == i) parts.push_back(std::get<3>(pop()));
+            touched++;
+
+            bool full = false;
+            for (int p : parts) full |= p == next.fwd_via[i] || p == next.bwd_via[i];
+            bool changed = false, relinked = false;
+            if (full) {
+                changed = recustomize_arc(next, u, i, relinked);
+            } else {
+                for (int p : parts) changed |= relax_arc(next, u, i, p);
+            }
+            if (changed || relinked) spare_stale_arcs.push_back(i);
+            if (!changed) continue;
+            // Arc u - w is a side of the lower triangle u of w - x, for every other x above u.
+            int w = fwd_up.targets[i];
+            for (int k = fwd_up.begin(u); k < fwd_up.end(u); ++k) {
+                int x = fwd_up.targets[k];
+                if (x != w) enqueue(rank[w] < rank[x] ? fwd_up.find(w, x) : fwd_up.find(x, w), u);
+            }
+        }
+        if (touched) {
+            next.cache_offset.clear();   // cached expansions may be stale
+            next.cache_nodes.clear();
+        }
+        publish_metric(false);
+        return touched;
+    }
+
+    // --- CH QUERIES ---
+    // Everything below is const and keeps its scratch state in the caller's
+    // QueryContext, so any number of threads can query a frozen graph.
+    
+    // Appends the base-edge nodes of hierarchy arc `arc` (a global arc id,
+    // without its start node) to path. Iterative: shortcuts are expanded
+    // through their child arcs in m, or copied from m's path cache.
+    void unpack_arc(int arc, std::vector<int>& path, std::vector<int>& stack, const Metric& m) const {
+        stack.clear();
+        stack.push_back(arc);
+        while (!stack.empty()) {
+            int a = stack.back();
+            stack.pop_back();
+            if (!m.cache_offset.empty() && m.cache_offset[a] != m.cache_offset[a + 1]) {
+                path.insert(path.end(), m.cache_nodes.begin() + m.cache_offset[a],
+                            m.cache_nodes.begin() + m.cache_offset[a + 1]);
+            } else if (m.first[a] < 0) {
+                path.push_back(unpacking.head[a]);
+            } else {
+                stack.push_back(m.second[a]);
+                stack.push_back(m.first[a]);
+            }
+        }
+    }
+
+    // Precomputes the full expansion of every shortcut stored at the
+    // top_nodes highest-ranked nodes, so long routes copy their top-level
+    // segments instead of walking child arcs. Stops caching once
+    // max_cached_nodes path nodes are stored; top_nodes = 0 drops the cache.
+    // The cache is part of the metric and published as a new version.
+    // Returns the number of cached arcs.
+    int cache_top_shortcuts(int top_nodes, size_t max_cached_nodes) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        Metric& next = begin_metric_update(true);
+        int total = (int)unpacking.head.size();
+        std::vector<char> wanted(total, 0);
+        int min_rank = num_nodes - top_nodes;
+        for (int u = 0; u < num_nodes; ++u) {
+            if (rank[external(u)] < min_rank) continue;
+            for (int i = fwd_up.begin(u); i < fwd_up.end(u); ++i) wanted[i] = 1;
+            for (int i = bwd_up.begin(u); i < bwd_up.end(u); ++i) wanted[unpacking.bwd_arc(i)] = 1;
+        }
+
+        next.cache_offset.clear();   // expand through child arcs only
+        next.cache_nodes.clear();
+        std::vector<int> offset, nodes, stack;
+        int cached = 0;
+        if (top_nodes > 0) {
+            offset.assign(total + 1, 0);
+            for (int a = 0; a < total; ++a) {
+                offset[a] = (int)nodes.size();
+                if (wanted[a] && next.first[a] >= 0 && nodes.size() < max_cached_nodes) {
+                    unpack_arc(a, nodes, stack, next);
+                    cached++;
+                }
+            }
+            offset[total] = (int)nodes.size();
+        }
+        next.cache_offset = std::move(offset);
+        next.cache_nodes = std::move(nodes);
+        publish_metric(false);
+        return cached;
+    }
+
+    // A node settled at distance d in the search over `up` is stalled if some
+    // higher-ranked w reaches it cheaper through a downward arc, i.e. through
+    // an arc of the opposite direction's graph `down` (weights down_w)
+    // stored at u.
+    bool is_stalled(int u, double d, const UpwardGraph& down, const double* down_w,
+                    const SearchSpace& space) const {
+        for (int i = down.begin(u); i < down.end(u); ++i) {
+            int w = down.targets[i];
+            if (space.reached(w) && space.dist[w] + down_w[i] < d) return true;
+        }
+        return false;
+    }
+
+    // Bidirectional upward search shared by query() and query_dist(), on
+    // the weights of m. Returns the tentative distance mu (infinity if
+    // unreachable) and sets meet_node to the node where the two searches
+    // met. The pruning rules are switched by stop_early / stall_on_demand /
+    // skip_settled; Heap is one of the heaps above.
+    template <typename Heap = CH_QUERY_HEAP>
+    double bidirectional_search(int origin, int dest, QueryContext& ctx, int& meet_node, const Metric& m) const {
+        ctx.reset(num_nodes);
+        SearchSpace& fwd = ctx.fwd;
+        SearchSpace& bwd = ctx.bwd;
+        Heap& fwd_heap = ctx.heaps<Heap>().fwd;
+        Heap& bwd_heap = ctx.heaps<Heap>().bwd;
+        fwd_heap.reset(num_nodes);
+        bwd_heap.reset(num_nodes);
+        const double INF = std::numeric_limits<double>::infinity();
+
+        fwd.visit(origin, 0.0, -1);
+        fwd_heap.update(origin, 0.0);
+        bwd.visit(dest, 0.0, -1);
+        bwd_heap.update(dest, 0.0);
+        ctx.heap_pushes = 2;
+
+        double mu = INF;
+        meet_node = -1;
+        if (origin == dest) { mu = 0.0; meet_node = origin; }
+        const double* fw = m.fwd_weights.data();
+        const double* bw = m.bwd_weights.data();
+
+        // Stop a direction once its smallest key can no longer improve mu.
+        auto active = [&](Heap& heap) {
+            return !heap.empty() && (!stop_early || heap.min_key() < mu);
+        };
+
+        // Settles one node of one direction and relaxes its upward arcs.
+        auto step = [&](Heap& heap, const UpwardGraph& up, const double* up_w,
+                        const UpwardGraph& down, const double* down_w, SearchSpace& self, const SearchSpace& other,
+                        long long& settled) {
+            auto [d, u] = heap.pop();
+            if (skip_settled && d > self.dist[u]) return;   // stale duplicate
+            if (d > mu) return;
+            settled++;
+            if (stall_on_demand && is_stalled(u, d, down, down_w, self)) return;
+            for (int i = up.begin(u); i < up.end(u); ++i) {
+                int v = up.targets[i];
+                double new_dist = d + up_w[i];
+                ctx.relaxed_edges++;
+                if (new_dist < self.dist_of(v)) {
+                    self.visit(v, new_dist, u, i);
+                    heap.update(v, new_dist);
+                    ctx.heap_pushes++;
+                    if (other.reached(v)) {
+                        double total = new_dist + other.dist[v];
+                        if (total < mu) { mu = total; meet_node = v; }
+                    }
+                }
+            }
+        };
+
+        while (true) {
+            bool fwd_active = active(fwd_heap);
+            bool bwd_active = active(bwd_heap);
+            if (!fwd_active && !bwd_active) break;
+            if (fwd_active) step(fwd_heap, fwd_up, fw, bwd_up, bw, fwd, bwd, ctx.settled_fwd);
+            if (bwd_active) step(bwd_heap, bwd_up, bw, fwd_up, fw, bwd, fwd, ctx.settled_bwd);
+        }
+        ctx.settled_nodes = ctx.settled_fwd + ctx.settled_bwd;
+        if (meet_node >= 0 && !rank.empty()) ctx.meet_rank = rank[external(meet_node)];
+        return mu;
+    }
+
+    // Distance on the current metric; ctx.metric_version tells which one.
+    template <typename Heap = CH_QUERY_HEAP>
+    double query_dist(int origin, int dest, QueryContext& ctx) const {
+        return query_dist<Heap>(origin, dest, ctx, *metric_snapshot());
+    }
+
+    template <typename Heap = CH_QUERY_HEAP>
+    double query_dist(int origin, int dest, QueryContext& ctx, const Metric& m) const {
+        ctx.metric_version = m.version;
+        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes) {
+            ctx.clear_stats();
+            return std::numeric_limits<double>::infinity();
+        }
+        QueryMetrics& metrics = QueryMetrics::global();
+        const bool timed = ctx.timed || metrics.enabled();
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        int meet_node;
+        double mu = bidirectional_search<Heap>(internal(origin), internal(dest), ctx, meet_node, m);
+        if (timed) ctx.search_ns = elapsed_ns(start);
+        if (metrics.enabled()) metrics.record(QueryMetrics::DIST_QUERIES, meet_node >= 0, ctx);
+
+        // Return infinity if no path, otherwise km
+        return (mu == std::numeric_limits<double>::infinity()) ? -1.0 : mu / 1000.0;
+    }
+
+    // Returns (node path, km); an empty path if dest is unreachable. Path
+    // and distance come from one metric version, stored in
+    // qc.metric_version.
+    template <typename Heap = CH_QUERY_HEAP>
+    std::pair<std::vector<int>, double> query(int origin, int dest, QueryContext& qc) const {
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        return query<Heap>(origin, dest, qc, *m);
+    }
+
+    template <typename Heap = CH_QUERY_HEAP>
+    std::pair<std::vector<int>, double> query(int origin, int dest, QueryContext& qc, const Metric& m) const {
+        qc.metric_version = m.version;
+        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes) {
+            qc.clear_stats();
+            return {{}, 0.0};
+        }
+        origin = internal(origin);
+        dest = internal(dest);
+        QueryMetrics& metrics = QueryMetrics::global();
+        const bool timed = qc.timed || metrics.enabled();
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        int meet_node;
+        double mu = bidirectional_search<Heap>(origin, dest, qc, meet_node, m);
+        if (timed) {
+            qc.search_ns = elapsed_ns(start);
+            start = std::chrono::steady_clock::now();
+        }
+
+        if (meet_node == -1) {
+            if (metrics.enabled()) metrics.record(QueryMetrics::PATH_QUERIES, false, qc);
+            return {{}, 0.0};
+        }
+
+        std::vector<int> path;
+        path.push_back(origin);
+
+        // Origin -> Meet: collect the forward arcs, then expand them in order
+        qc.arcs.clear();
+        for (int curr = meet_node; curr != origin; curr = qc.fwd.parent[curr]) {
+            qc.arcs.push_back(qc.fwd.parent_arc[curr]);
+        }
+        for (auto it = qc.arcs.rbegin(); it != qc.arcs.rend(); ++it) unpack_arc(*it, path, qc.unpack_stack, m);
+
+        // Meet -> Dest: backward arcs are already in travel order
+        for (int curr = meet_node; curr != dest; curr = qc.bwd.parent[curr]) {
+            unpack_arc(unpacking.bwd_arc(qc.bwd.parent_arc[curr]), path, qc.unpack_stack, m);
+        }
+
+        if (!to_external.empty()) {
+            for (int& v : path) v = to_external[v];
+        }
+        qc.path_nodes = (long long)path.size();
+        if (timed) qc.unpack_ns = elapsed_ns(start);
+        if (metrics.enabled()) metrics.record(QueryMetrics::PATH_QUERIES, true, qc);
+        return {path, mu / 1000.0};
+    }
+
+    // --- ALTERNATIVE ROUTES ---
+    // Via-node alternatives: full upward searches from origin and dest, so
+    // every node v reached by both is a candidate route origin -> v -> dest
+    // of length d_fwd(v) + d_bwd(v), the CH counterpart of a plateau. In
+    // increasing length, a candidate is accepted if it is
+    //   - at most (1 + max_stretch) times as long as the shortest route,
+    //   - sharing at most max_sharing of the shortest route's length with
+    //     each route accepted so far, and
+    //   - locally optimal: the stretch of local_optimality times the
+    //     shortest length on either side of v is itself a shortest path
+    //     (the T-test, one bidirectional search).
+    // Returns the shortest route followed by up to k alternatives, each as
+    // (node path, km); empty if dest is unreachable.
+    static constexpr int ALTERNATIVE_POOL = 4;   // candidates T-tested per requested route
+
+    std::vector<std::pair<std::vector<int>, double>> query_alternatives(
+        int origin, int dest, int k, QueryContext& ctx, double max_stretch = 0.25, double max_sharing = 0.8,
+        double local_optimality = 0.25) const {
+        std::shared_ptr<const Metric> snapshot = metric_snapshot();
+        const Metric& m = *snapshot;
+        ctx.metric_version = m.version;
+        ctx.clear_stats();
+        std::vector<std::pair<std::vector<int>, double>> routes;
+        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes) return routes;
+        QueryMetrics& metrics = QueryMetrics::global();
+        const bool timed = ctx.timed || metrics.enabled();
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        const int s = internal(origin), t = internal(dest);
+        const double* fw = m.fwd_weights.data();
+        const double* bw = m.bwd_weights.data();
+
+        std::vector<std::pair<int, double>> fwd_space, bwd_space;
+        auto& heaps = ctx.heaps<CH_QUERY_HEAP>();
+        upward_search(fwd_up, fw, bwd_up, bw, s, ctx.fwd, heaps.fwd, fwd_space);
+        upward_search(bwd_up, bw, fwd_up, fw, t, ctx.bwd, heaps.bwd, bwd_space);
+        long long settled_fwd = (long long)fwd_space.size(), settled_bwd = (long long)bwd_space.size();
+
+        std::vector<std::pair<double, int>> candidates;   // (length, via node)
+        for (const auto& [v, d] : fwd_space) {
+            if (ctx.bwd.reached(v)) candidates.push_back({d + ctx.bwd.dist[v], v});
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        // A candidate as base arcs (global arc ids) in travel order; the
+        // first `split` of them lead from the origin to the via node.
+        struct Route {
+            std::vector<int> arcs;
+            size_t split;
+            double length;
+        };
+        auto expand = [&](int via, double length) {
+            Route r{{}, 0, length};
+            ctx.arcs.clear();
+            for (int c = via; c != s; c = ctx.fwd.parent[c]) ctx.arcs.push_back(ctx.fwd.parent_arc[c]);
+            for (auto it = ctx.arcs.rbegin(); it != ctx.arcs.rend(); ++it) {
+                unpack_base_arcs(*it, r.arcs, ctx.unpack_stack, m);
+            }
+            r.split = r.arcs.size();
+            for (int c = via; c != t; c = ctx.bwd.parent[c]) {
+                unpack_base_arcs(unpacking.bwd_arc(ctx.bwd.parent_arc[c]), r.arcs, ctx.unpack_stack, m);
+            }
+            return r;
+        };
+        // Length of the arcs of r that also lie on a route whose arcs are `sorted`.
+        auto shared_length = [&](const Route& r, const std::vector<int>& sorted) {
+            double shared = 0.0;
+            for (int a : r.arcs) {
+                if (std::binary_search(sorted.begin(), sorted.end(), a)) shared += arc_weight(a, m);
+            }
+            return shared;
+        };
+        auto route_hash = [](const Route& r) {
+            uint64_t h = 1469598103934665603ull;   // FNV-1a
+            for (int a : r.arcs) h = (h ^ (uint32_t)a) * 1099511628211ull;
+            return h;
+        };
+
+        std::vector<Route> pool;
+        std::vector<std::vector<int>> accepted;   // sorted arcs of the routes taken so far
+        if (!candidates.empty()) {
+            // 1. While the search spaces are still in ctx: the shortest route
+            // and the candidates passing the stretch and sharing tests against it.
+            const double best = candidates[0].first;
+            const double max_length = (1.0 + max_stretch) * best;
+            pool.push_back(expand(candidates[0].second, best));
+            accepted.push_back(pool[0].arcs);
+            std::sort(accepted[0].begin(), accepted[0].end());
+            std::vector<uint64_t> seen = {route_hash(pool[0])};
+            for (size_t i = 1; i < candidates.size() && (int)pool.size() <= ALTERNATIVE_POOL * k; ++i) {
+                if (candidates[i].first > max_length) break;
+                Route r = expand(candidates[i].second, candidates[i].first);
+                if (shared_length(r, accepted[0]) > max_sharing * best) continue;
+                uint64_t h = route_hash(r);
+                if (std::find(seen.begin(), seen.end(), h) != seen.end()) continue;
+                seen.push_back(h);
+                pool.push_back(std::move(r));
+            }
+
+            // 2. Sharing among the alternatives, then the T-test.
+            const double window = local_optimality * best;
+            routes.push_back({route_nodes(s, pool[0].arcs), best / 1000.0});
+            for (size_t i = 1; i < pool.size() && (int)routes.size() <= k; ++i) {
+                const Route& r = pool[i];
+                bool distinct = true;
+                for (size_t j = 1; j < accepted.size() && distinct; ++j) {
+                    distinct = shared_length(r, accepted[j]) <= max_sharing * best;
+                }
+                if (!distinct) continue;
+                size_t a = r.split, b = r.split;
+                double before = 0.0, after = 0.0;
+                while (a > 0 && before < window) before += arc_weight(r.arcs[--a], m);
+                while (b < r.arcs.size() && after < window) after += arc_weight(r.arcs[b++], m);
+                double segment = before + after;
+                int from = a == 0 ? s : unpacking.head[r.arcs[a - 1]];
+                int to = b == 0 ? s : unpacking.head[r.arcs[b - 1]];
+                int meet_node;
+                double shortest = bidirectional_search(from, to, ctx, meet_node, m);
+                settled_fwd += ctx.settled_fwd;
+                settled_bwd += ctx.settled_bwd;
+                if (segment > shortest + 1e-9 * std::max(1.0, shortest)) continue;
+                accepted.push_back(r.arcs);
+                std::sort(accepted.back().begin(), accepted.back().end());
+                routes.push_back({route_nodes(s, r.arcs), r.length / 1000.0});
+            }
+        }
+
+        ctx.clear_stats();
+        ctx.settled_fwd = settled_fwd;
+        ctx.settled_bwd = settled_bwd;
+        ctx.settled_nodes = settled_fwd + settled_bwd;
+        for (const auto& route : routes) ctx.path_nodes += (long long)route.first.size();
+        if (timed) ctx.search_ns = elapsed_ns(start);
+        if (metrics.enabled()) metrics.record(QueryMetrics::ALTERNATIVE_QUERIES, !routes.empty(), ctx);
+        return routes;
+    }
+
+    // Appends the base arcs (global ids) of hierarchy arc `arc`, in travel
+    // order. Unlike unpack_arc it ignores the path cache, which stores nodes.
+    void unpack_base_arcs(int arc, std::vector<int>& out, std::vector<int>& stack, const Metric& m) const {
+        stack.clear();
+        stack.push_back(arc);
+        while (!stack.empty()) {
+            int a = stack.back();
+            stack.pop_back();
+            if (m.first[a] < 0) {
+                out.push_back(a);
+            } else {
+                stack.push_back(m.second[a]);
+                stack.push_back(m.first[a]);
+            }
+        }
+    }
+
+    double arc_weight(int arc, const Metric& m) const {
+        return arc < unpacking.num_fwd ? m.fwd_weights[arc] : m.bwd_weights[arc - unpacking.num_fwd];
+    }
+
+    // External node path of a route starting at internal node s.
+    std::vector<int> route_nodes(int s, const std::vector<int>& arcs) const {
+        std::vector<int> path;
+        path.reserve(arcs.size() + 1);
+        path.push_back(external(s));
+        for (int a : arcs) path.push_back(external(unpacking.head[a]));
+        return path;
+    }
+
+    // --- ROUTE CACHE ---
+
+    // Replaces the result cache of cached_query() with an empty one of
+    // max_bytes (0 turns caching off).
+    void set_route_cache(size_t max_bytes, int num_shards = 64) {
+        std::shared_ptr<RouteCache> cache;
+        if (max_bytes > 0) cache = std::make_shared<RouteCache>(max_bytes, num_shards);
+        std::atomic_store(&route_cache, std::move(cache));
+    }
+
+    // query() on m, answered from route_cache when it holds the pair for
+    // m's version (qc.cache_hit); misses are computed and stored.
+    std::pair<std::vector<int>, double> cached_query(int origin, int dest, QueryContext& qc, const Metric& m) const {
+        std::shared_ptr<RouteCache> cache = std::atomic_load(&route_cache);
+        bool valid = origin >= 0 && origin < num_nodes && dest >= 0 && dest < num_nodes;
+        if (!cache || !valid) return query(origin, dest, qc, m);
+        std::pair<std::vector<int>, double> result;
+        if (cache->lookup(origin, dest, m.version, result.first, result.second)) {
+            qc.clear_stats();
+            qc.metric_version = m.version;
+            qc.cache_hit = true;
+            qc.path_nodes = (long long)result.first.size();
+            return result;
+        }
+        result = query(origin, dest, qc, m);
+        cache->insert(origin, dest, m.version, result.first, result.second);
+        return result;
+    }
+
+    std::pair<std::vector<int>, double> cached_query(int origin, int dest, QueryContext& qc) const {
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        return cached_query(origin, dest, qc, *m);
+    }
+
+    // Plain Dijkstra over one upward graph (weights g_w), exploring the whole
+    // upward search space of `source`. Appends every settled (node, dist) to
+    // `settled`; with stall_on_demand, stalled nodes (checked against
+    // `down`, the opposite direction's graph) are neither reported nor
+    // expanded. Parents and parent arcs are recorded in `space`.
+    template <typename Heap>
+    void upward_search(const UpwardGraph& g, const double* g_w, const UpwardGraph& down, const double* down_w,
+                       int source, SearchSpace& space, Heap& heap,
+                       std::vector<std::pair<int, double>>& settled) const {
+        space.reset(num_nodes);
+        heap.reset(num_nodes);
+        space.visit(source, 0.0, -1);
+        heap.update(source, 0.0);
+        while (!heap.empty()) {
+            auto [d, u] = heap.pop();
+            if (d > space.dist[u]) continue;   // stale entry (lazy heaps)
+            if (stall_on_demand && is_stalled(u, d, down, down_w, space)) continue;
+            settled.push_back({u, d});
+            for (int i = g.begin(u); i < g.end(u); ++i) {
+                int v = g.targets[i];
+                double new_dist = d + g_w[i];
+                if (new_dist < space.dist_of(v)) {
+                    space.visit(v, new_dist, u, i);
+                    heap.update(v, new_dist);
+                }
+            }
+        }
+    }
+
+    // Many-to-many distances (km, -1 if unreachable) written row-major into
+    // out[sources.size() * targets.size()]. Bucket-based CH: one backward
+    // upward search per target fills per-node buckets, then one forward
+    // upward search per source scans the buckets of the nodes it settles.
+    // Returns the metric version used for the whole matrix.
+    uint64_t distance_matrix(const std::vector<int>& sources, const std::vector<int>& targets,
+                             double* out, int num_threads = 0) const {
+        const double INF = std::numeric_limits<double>::infinity();
+        const int S = (int)sources.size();
+        const int T = (int)targets.size();
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        const double* fw = m->fwd_weights.data();
+        const double* bw = m->bwd_weights.data();
+        num_threads = resolve_threads(num_threads);
+
+        // 1. Backward searches, one per target.
+        struct BucketEntry { int target; double dist; };
+        std::vector<std::vector<std::pair<int, double>>> spaces(T);
+        parallel_for(T, num_threads, [&](int j, int) {
+            int node = targets[j];
+            if (node < 0 || node >= num_nodes) return;
+            node = internal(node);
+            QueryContext& ctx = QueryContext::local();
+            upward_search(bwd_up, bw, fwd_up, fw, node, ctx.bwd, ctx.heaps<CH_QUERY_HEAP>().bwd, spaces[j]);
+        });
+
+        // 2. Group the backward search spaces into per-node buckets (CSR).
+        std::vector<int> bucket_offsets(num_nodes + 1, 0);
+        for (const auto& space : spaces) {
+            for (const auto& [v, d] : space) bucket_offsets[v + 1]++;
+        }
+        for (int v = 0; v < num_nodes; ++v) bucket_offsets[v + 1] += bucket_offsets[v];
+        std::vector<BucketEntry> buckets(bucket_offsets[num_nodes]);
+        std::vector<int> fill(bucket_offsets.begin(), bucket_offsets.end() - 1);
+        for (int j = 0; j < T; ++j) {
+            for (const auto& [v, d] : spaces[j]) buckets[fill[v]++] = {j, d};
+            std::vector<std::pair<int, double>>().swap(spaces[j]);
+        }
+
+        // 3. Forward searches, one per source; each owns its output row.
+        parallel_for(S, num_threads, [&](int i, int) {
+            double* row = out + (size_t)i * T;
+            std::fill(row, row + T, INF);
+            int node = sources[i];
+            if (node >= 0 && node < num_nodes) {
+                node = internal(node);
+                std::vector<std::pair<int, double>> settled;
+                QueryContext& ctx = QueryContext::local();
+                upward_search(fwd_up, fw, bwd_up, bw, node, ctx.fwd, ctx.heaps<CH_QUERY_HEAP>().fwd, settled);
+                for (const auto& [v, d] : settled) {
+                    for (int b = bucket_offsets[v]; b < bucket_offsets[v + 1]; ++b) {
+                        double total = d + buckets[b].dist;
+                        if (total < row[buckets[b].target]) row[buckets[b].target] = total;
+                    }
+                }
+            }
+            for (int j = 0; j < T; ++j) row[j] = (row[j] == INF) ? -1.0 : row[j] / 1000.0;
+        });
+        return m->version;
+    }
+
+    // --- ONE-TO-ALL (PHAST) ---
+    // Distances from a source to every node: an upward search from the
+    // source, then one pass over all nodes in descending rank order that
+    // relaxes each node's incoming downward arcs (bwd_up, stored at the
+    // lower end), whose tails are already final. The pass reads the arc
+    // arrays front to back, and on renumbered graphs the distances too.
+    // L sources can share one pass: their distances are interleaved per
+    // node (dist[v * L + k]), so each arc is one vector min over all lanes.
+    static constexpr int PHAST_LANES = 4;
+
+    // Upward search from `source` (internal) into lane `lane`, keeping the
+    // smaller value where the lane already has one.
+    template <int L>
+    void phast_up(int source, int lane, std::vector<double>& dist, QueryContext& ctx, const Metric& m) const {
+        std::vector<std::pair<int, double>> settled;
+        upward_search(fwd_up, m.fwd_weights.data(), bwd_up, m.bwd_weights.data(), source, ctx.fwd,
+                      ctx.heaps<CH_QUERY_HEAP>().fwd, settled);
+        for (const auto& [v, d] : settled) {
+            double& slot = dist[(size_t)v * L + lane];
+            slot = std::min(slot, d);
+        }
+    }
+
+    template <int L>
+    void phast_down(std::vector<double>& dist, const Metric& m) const {
+        const double* bw = m.bwd_weights.data();
+        for (int i = 0; i < num_nodes; ++i) {
+            int u = sweep_order.empty() ? i : sweep_order[i];
+            double* du = &dist[(size_t)u * L];
+#ifdef CH_SSE2
+            if constexpr (L == 4) {
+                __m128d lo = _mm_loadu_pd(du), hi = _mm_loadu_pd(du + 2);
+                for (int a = bwd_up.begin(u); a < bwd_up.end(u); ++a) {
+                    const double* dv = &dist[(size_t)bwd_up.targets[a] * L];
+                    __m128d w = _mm_set1_pd(bw[a]);
+                    lo = _mm_min_pd(lo, _mm_add_pd(_mm_loadu_pd(dv), w));
+                    hi = _mm_min_pd(hi, _mm_add_pd(_mm_loadu_pd(dv + 2), w));
+                }
+                _mm_storeu_pd(du, lo);
+                _mm_storeu_pd(du + 2, hi);
+                continue;
+            }
+#endif
+            for (int a = bwd_up.begin(u); a < bwd_up.end(u); ++a) {
+                const double* dv = &dist[(size_t)bwd_up.targets[a] * L];
+                for (int k = 0; k < L; ++k) du[k] = std::min(du[k], dv[k] + bw[a]);
+            }
+        }
+    }
+
+    // Rows out[k * num_nodes] (km, -1 if unreachable) for up to L sources
+    // (external ids) from one sweep.
+    template <int L>
+    void phast_rows(const int* sources, int count, double* out, std::vector<double>& dist, QueryContext& ctx,
+                    const Metric& m) const {
+        const double INF = std::numeric_limits<double>::infinity();
+        dist.assign((size_t)num_nodes * L, INF);
+        for (int k = 0; k < count; ++k) {
+            if (sources[k] >= 0 && sources[k] < num_nodes) phast_up<L>(internal(sources[k]), k, dist, ctx, m);
+        }
+        phast_down<L>(dist, m);
+        for (int k = 0; k < count; ++k) {
+            double* row = out + (size_t)k * num_nodes;
+            for (int v = 0; v < num_nodes; ++v) {
+                double d = dist[(size_t)internal(v) * L + k];
+                row[v] = d == INF ? -1.0 : d / 1000.0;
+            }
+        }
+    }
+
+    // One-to-all distances in km (-1 if unreachable) from each source,
+    // row-major into out[sources.size() * num_nodes]. Sources go through
+    // the sweep PHAST_LANES at a time, groups in parallel. Returns the
+    // metric version used.
+    uint64_t one_to_all(const std::vector<int>& sources, double* out, int num_threads = 0) const {
+        constexpr int L = PHAST_LANES;
+        const int S = (int)sources.size();
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        num_threads = resolve_threads(num_threads);
+        std::vector<std::vector<double>> buffers(num_threads);
+        parallel_for((S + L - 1) / L, num_threads, [&](int group, int t) {
+            const int first = group * L, count = std::min(L, S - first);
+            double* rows = out + (size_t)first * num_nodes;
+            if (count == 1) phast_rows<1>(&sources[first], 1, rows, buffers[t], QueryContext::local(), *m);
+            else phast_rows<L>(&sources[first], count, rows, buffers[t], QueryContext::local(), *m);
+        });
+        return m->version;
+    }
+
+    // Service area: the nodes (ascending) within max_km of the nearest of
+    // `sources`, from one single-lane sweep seeded by all of them.
+    std::vector<int> isochrone(const std::vector<int>& sources, double max_km, QueryContext& ctx) const {
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        ctx.metric_version = m->version;
+        std::vector<double> dist((size_t)num_nodes, std::numeric_limits<double>::infinity());
+        for (int s : sources) {
+            if (s >= 0 && s < num_nodes) phast_up<1>(internal(s), 0, dist, ctx, *m);
+        }
+        phast_down<1>(dist, *m);
+        std::vector<int> nodes;
+        const double limit = max_km * 1000.0;
+        for (int v = 0; v < num_nodes; ++v) {
+            if (dist[internal(v)] <= limit) nodes.push_back(v);
+        }
+        return nodes;
+    }
+
+    // --- BASE-EDGE SEARCH (A*, ALT) ---
+    // Searches on the original edges only, with the live base edge weights
+    // of the pinned metric; no hierarchy involved.
+
+    // Plain Dijkstra over base graph g (base_out or base_in) with weights w,
+    // in metres. Stops at dest if dest >= 0; fills dist for every node.
+    void base_dijkstra(const BaseGraph& g, const double* w, int source, int dest,
+                       std::vector<double>& dist) const {
+        dist.assign(num_nodes, std::numeric_limits<double>::infinity());
+        CH_QUERY_HEAP heap;
+        heap.reset(num_nodes);
+        dist[source] = 0.0;
+        heap.update(source, 0.0);
+        while (!heap.empty()) {
+            auto [d, u] = heap.pop();
+            if (d > dist[u]) continue;
+            if (u == dest) return;
+            for (int i = g.begin(u); i < g.end(u); ++i) {
+                double new_dist = d + w[g.edges[i]];
+                if (new_dist < dist[g.targets[i]]) {
+                    dist[g.targets[i]] = new_dist;
+                    heap.update(g.targets[i], new_dist);
+                }
+            }
+        }
+    }
+
+    // Great-circle distance u -> v in metres (0 without coordinates). Road
+    // lengths are at least this, so it is an admissible bound.
+    double geo_distance(int u, int v) const {
+        const double R = 6371000.0, RAD = 3.14159265358979323846 / 180.0;
+        double lat1 = node_lat[u] * RAD, lat2 = node_lat[v] * RAD;
+        double dlat = lat2 - lat1, dlon = (node_lon[v] - node_lon[u]) * RAD;
+        double a = std::sin(dlat / 2) * std::sin(dlat / 2) +
+                   std::cos(lat1) * std::cos(lat2) * std::sin(dlon / 2) * std::sin(dlon / 2);
+        double d = 2 * R * std::atan2(std::sqrt(a), std::sqrt(1 - a));
+        return std::isfinite(d) ? d : 0.0;
+    }
+
+    // Picks `count` landmarks (16-32 work well) by farthest selection: the
+    // first is the node farthest from node 0, each next one the node
+    // farthest from all chosen so far. Only reachable nodes count (a node
+    // the chosen ones cannot reach has mostly infinite rows and would prune
+    // nothing), unless none is left. Distances are taken on the current
+    // metric; the bounds stay admissible as long as live weights do not
+    // drop below it, which holds for traffic factors >= 1 on free-flow
+    // weights. The reverse searches run in parallel.
+    int build_landmarks(int count, int num_threads = 0) {
+        if (!frozen) throw std::logic_error("build_landmarks() needs a frozen graph");
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        const double* w = m->base_weight.data();
+        count = std::max(0, std::min(count, num_nodes));
+        auto lm = std::make_shared<LandmarkTable>(num_nodes, count);
+        lm->metric_version = m->version;
+
+        std::vector<double> closest, dist;
+        if (count > 0) base_dijkstra(base_out, w, 0, -1, closest);
+        // Farthest finite entry, else the first node not chosen yet.
+        auto farthest = [&]() {
+            int best = -1, unchosen = -1;
+            for (int v = 0; v < num_nodes; ++v) {
+                if (closest[v] < 0) continue;
+                if (unchosen < 0) unchosen = v;
+                if (std::isfinite(closest[v]) && (best < 0 || closest[v] > closest[best])) best = v;
+            }
+            return best >= 0 ? best : unchosen;
+        };
+        for (int k = 0; k < count; ++k) {
+            int next = farthest();
+            lm->nodes.push_back(next);
+            base_dijkstra(base_out, w, next, -1, dist);
+            for (int v = 0; v < num_nodes; ++v) lm->from(v)[k] = dist[v];
+            if (k == 0) closest = dist;   // node 0 was only the seed
+            for (int v = 0; v < num_nodes; ++v) closest[v] = std::min(closest[v], dist[v]);
+            for (int v : lm->nodes) closest[v] = -1.0;   // never pick a landmark twice
+        }
+        parallel_for(count, num_threads, [&](int k, int) {
+            std::vector<double> d;
+            base_dijkstra(base_in, w, lm->nodes[k], -1, d);
+            for (int v = 0; v < num_nodes; ++v) lm->to(v)[k] = d[v];
+        });
+        std::atomic_store(&landmarks, std::shared_ptr<const LandmarkTable>(std::move(lm)));
+        return count;
+    }
+
+    // The landmarks if use_landmarks, else null.
+    std::shared_ptr<const LandmarkTable> landmark_snapshot(bool use_landmarks) const {
+        if (!use_landmarks) return nullptr;
+        auto lm = std::atomic_load(&landmarks);
+        if (!lm) throw std::logic_error("ALT needs build_landmarks() first");
+        return lm;
+    }
+
+    // A* over the base edges on the current metric. epsilon > 1 gives
+    // weighted A* (greedier, at most epsilon times the optimum);
+    // use_landmarks adds ALT bounds from build_landmarks() to the
+    // great-circle bound. Returns (node path, km) like query(), with the
+    // metric version in ctx.metric_version.
+    std::pair<std::vector<int>, double> astar(int origin, int dest, QueryContext& ctx,
+                                              double epsilon = 1.0, bool use_landmarks = false) const {
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        std::shared_ptr<const LandmarkTable> lm = landmark_snapshot(use_landmarks);
+        ctx.metric_version = m->version;
+        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes) {
+            ctx.clear_stats();
+            return {{}, 0.0};
+        }
+
+        const double INF = std::numeric_limits<double>::infinity();
+        QueryMetrics& metrics = QueryMetrics::global();
+        const bool timed = ctx.timed || metrics.enabled();
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        ctx.reset(num_nodes);
+        SearchSpace& g = ctx.fwd;
+        SearchSpace& h = ctx.bwd;   // per-node heuristic cache
+        const double* w = m->base_weight.data();
+        const bool has_coords = (int)node_lat.size() == num_nodes && (int)node_lon.size() == num_nodes;
+        auto heuristic = [&](int u) {
+            if (h.reached(u)) return h.dist[u];
+            double bound = has_coords ? geo_distance(u, dest) : 0.0;
+            if (lm) bound = std::max(bound, lm->bound(u, dest));
+            h.visit(u, bound, -1);
+            return bound;
+        };
+
+        auto& heap = ctx.heaps<CH_ASTAR_HEAP>().fwd;
+        heap.reset(num_nodes);
+        g.visit(origin, 0.0, -1);
+        heap.update(origin, epsilon * heuristic(origin));
+        ctx.heap_pushes = 1;
+        bool found = false;
+        while (!heap.empty()) {
+            auto [key, u] = heap.pop();
+            if (key > g.dist[u] + epsilon * heuristic(u)) continue;   // stale entry
+            ctx.settled_nodes++;
+            if (u == dest) { found = true; break; }
+            for (int i = base_out.begin(u); i < base_out.end(u); ++i) {
+                int v = base_out.targets[i];
+                double new_dist = g.dist[u] + w[base_out.edges[i]];
+                ctx.relaxed_edges++;
+                if (new_dist < g.dist_of(v)) {
+                    double key = new_dist + epsilon * heuristic(v);
+                    if (key == INF) continue;   // landmarks prove dest unreachable from v
+                    g.visit(v, new_dist, u);
+                    heap.update(v, key);
+                    ctx.heap_pushes++;
+                }
+            }
+        }
+        ctx.settled_fwd = ctx.settled_nodes;
+        if (timed) ctx.search_ns = elapsed_ns(start);
+        if (metrics.enabled()) metrics.record(QueryMetrics::ASTAR_QUERIES, found, ctx);
+        if (!found) return {{}, 0.0};
+
+        std::vector<int> path;
+        for (int curr = dest; curr != -1; curr = g.parent[curr]) path.push_back(curr);
+        std::reverse(path.begin(), path.end());
+        ctx.path_nodes = (long long)path.size();
+        return {path, g.dist[dest] / 1000.0};
+    }
+
+    // --- TIME-DEPENDENT ROUTING ---
+    // Earliest-arrival queries on the base edges under the profiles of
+    // set_time_profiles(): time-dependent A*, i.e. Dijkstra on arrival
+    // times (seconds, same clock as the departure) with each edge's travel
+    // time taken at the moment it is entered. Exact for FIFO profiles
+    // (leaving later never arrives earlier). The heuristic is the
+    // great-circle / ALT bound at the pool's smallest factor, which holds at
+    // every time of day.
+
+    // Installs a new profile pool for all base edges; see TravelTimeProfiles.
+    void set_time_profiles(const int64_t* profile_offsets, size_t num_profiles, const double* times,
+                           const double* factors, const int* edge_profile, size_t m, double seconds_per_unit) {
+        if (m != base_src.size()) throw std::invalid_argument("set_time_profiles needs one profile id per base edge");
+        auto pool = std::make_shared<const TravelTimeProfiles>(profile_offsets, num_profiles, times, factors,
+                                                               edge_profile, m, seconds_per_unit);
+        std::atomic_store(&time_profiles, std::shared_ptr<const TravelTimeProfiles>(std::move(pool)));
+    }
+
+    // Runs the search in ctx.fwd (arrival times, parents) and returns the
+    // arrival time at dest, infinity if unreachable.
+    double td_search(int origin, int dest, double departure, QueryContext& ctx, const Metric& m,
+                     const TravelTimeProfiles& tt, const LandmarkTable* lm) const {
+        const double INF = std::numeric_limits<double>::infinity();
+        ctx.reset(num_nodes);
+        SearchSpace& g = ctx.fwd;
+        SearchSpace& h = ctx.bwd;   // per-node heuristic cache
+        const double* w = m.base_weight.data();
+        const double scale = tt.seconds_per_unit * tt.min_factor;
+        const bool has_coords = (int)node_lat.size() == num_nodes && (int)node_lon.size() == num_nodes;
+        auto heuristic = [&](int u) {
+            if (h.reached(u)) return h.dist[u];
+            double bound = has_coords ? geo_distance(u, dest) : 0.0;
+            if (lm) bound = std::max(bound, lm->bound(u, dest));
+            bound *= scale;
+            h.visit(u, bound, -1);
+            return bound;
+        };
+
+        auto& heap = ctx.heaps<CH_ASTAR_HEAP>().fwd;
+        heap.reset(num_nodes);
+        g.visit(origin, departure, -1);
+        heap.update(origin, departure + heuristic(origin));
+        ctx.heap_pushes = 1;
+        while (!heap.empty()) {
+            auto [key, u] = heap.pop();
+            if (key > g.dist[u] + heuristic(u)) continue;   // stale entry
+            ctx.settled_nodes++;
+            if (u == dest) break;
+            const double t = g.dist[u];
+            for (int i = base_out.begin(u); i < base_out.end(u); ++i) {
+                int v = base_out.targets[i];
+                int e = base_out.edges[i];
+                double arrival = t + tt.travel_time(e, w[e], t);
+                ctx.relaxed_edges++;
+                if (arrival < g.dist_of(v)) {
+                    double key = arrival + heuristic(v);
+                    if (key == INF) continue;   // landmarks prove dest unreachable from v
+                    g.visit(v, arrival, u);
+                    heap.update(v, key);
+                    ctx.heap_pushes++;
+                }
+            }
+        }
+        ctx.settled_fwd = ctx.settled_nodes;
+        return g.dist_of(dest);
+    }
+
+    std::shared_ptr<const TravelTimeProfiles> time_profile_snapshot() const {
+        auto tt = std::atomic_load(&time_profiles);
+        if (!tt) throw std::logic_error("time-dependent queries need set_time_profiles() first");
+        return tt;
+    }
+
+    // Returns (node path, arrival time) for leaving origin at `departure`;
+    // an empty path and -1 if dest is unreachable.
+    std::pair<std::vector<int>, double> td_query(int origin, int dest, double departure, QueryContext& ctx,
+                                                 bool use_landmarks = false) const {
+        auto tt = time_profile_snapshot();
+        auto lm = landmark_snapshot(use_landmarks);
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        ctx.metric_version = m->version;
+        if (origin < 0 || origin >= num_nodes || dest < 0 || dest >= num_nodes || !std::isfinite(departure)) {
+            ctx.clear_stats();
+            return {{}, -1.0};
+        }
+        QueryMetrics& metrics = QueryMetrics::global();
+        const bool timed = ctx.timed || metrics.enabled();
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        double arrival = td_search(origin, dest, departure, ctx, *m, *tt, lm.get());
+        const bool found = std::isfinite(arrival);
+        std::vector<int> path;
+        if (found) {
+            for (int curr = dest; curr != -1; curr = ctx.fwd.parent[curr]) path.push_back(curr);
+            std::reverse(path.begin(), path.end());
+        }
+        ctx.path_nodes = (long long)path.size();
+        if (timed) ctx.search_ns = elapsed_ns(start);
+        if (metrics.enabled()) metrics.record(QueryMetrics::TD_QUERIES, found, ctx);
+        return {path, found ? arrival : -1.0};
+    }
+
+    // Arrival times (-1 if unreachable) for every departure of one
+    // origin / dest pair, e.g. a whole schedule, written into out. All
+    // searches use one metric; returns its version.
+    uint64_t td_earliest_arrivals(int origin, int dest, const double* departures, size_t count, double* out,
+                                  bool use_landmarks = false, int num_threads = 0) const {
+        auto tt = time_profile_snapshot();
+        auto lm = landmark_snapshot(use_landmarks);
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        num_threads = resolve_threads(num_threads);
+        const bool valid = origin >= 0 && origin < num_nodes && dest >= 0 && dest < num_nodes;
+        parallel_for((int)count, num_threads, [&](int i, int) {
+            double arrival = -1.0;
+            if (valid && std::isfinite(departures[i])) {
+                arrival = td_search(origin, dest, departures[i], QueryContext::local(), *m, *tt, lm.get());
+                if (!std::isfinite(arrival)) arrival = -1.0;
+            }
+            out[i] = arrival;
+        });
+        return m->version;
+    }
+
+    // --- GEOMETRY ---
+
+    // Interleaved (lat, lon) of a node path: each node plus the shape of the
+    // cheapest base edge (under m) of each hop.
+    std::vector<double> path_geometry(const std::vector<int>& path, const Metric& m) const {
+        if ((int)node_lat.size() != num_nodes || (int)node_lon.size() != num_nodes) {
+            throw std::logic_error("path geometry needs node coordinates (set_nodes)");
+        }
+        std::vector<double> out;
+        for (size_t i = 0; i < path.size(); ++i) {
+            if (path[i] < 0 || path[i] >= num_nodes) throw std::out_of_range("node " + std::to_string(path[i]) + " out of range");
+            if (i > 0 && !geom_offsets.empty()) {
+                int best = -1;
+                for (int k = base_out.begin(path[i - 1]); k < base_out.end(path[i - 1]); ++k) {
+                    int e = base_out.edges[k];
+                    if (base_out.targets[k] == path[i] && (best < 0 || m.base_weight[e] < m.base_weight[best])) best = e;
+                }
+                if (best >= 0) {
+                    const uint8_t* p = geom_data.data() + geom_offsets[best];
+                    const uint8_t* end = geom_data.data() + geom_offsets[best + 1];
+                    int64_t lat = 0, lon = 0;
+                    while (p < end) {
+                        lat += geometry::get_varint(p);
+                        lon += geometry::get_varint(p);
+                        out.push_back(lat / geometry::SCALE);
+                        out.push_back(lon / geometry::SCALE);
+                    }
+                }
+            }
+            out.push_back(node_lat[path[i]]);
+            out.push_back(node_lon[path[i]]);
+        }
+        return out;
+    }
+
+    // --- SNAPPING ---
+
+    std::shared_ptr<const SpatialIndex> spatial_index() {
+        std::shared_ptr<const SpatialIndex> index = std::atomic_load(&spatial);
+        if (index) return index;
+        std::lock_guard<std::mutex> lock(spatial_mutex);
+        index = std::atomic_load(&spatial);
+        if (!index) {
+            if ((int)node_lat.size() != num_nodes || (int)node_lon.size() != num_nodes) {
+                throw std::logic_error("snapping needs node coordinates (set_nodes)");
+            }
+            auto built = std::make_shared<SpatialIndex>();
+            built->build(node_lat.data(), node_lon.data(), num_nodes,
+                         base_src.data(), base_dst.data(), base_src.size());
+            index = built;
+            std::atomic_store(&spatial, index);
+        }
+        return index;
+    }
+
+    // Nearest node index for each (lat, lon), -1 if none. Batches below
+    // 256 points run on the calling thread.
+    void nearest_nodes(const double* lat, const double* lon, size_t n, int* out, int num_threads = 0) {
+        std::shared_ptr<const SpatialIndex> index = spatial_index();
+        parallel_for((int)n, n < 256 ? 1 : num_threads, [&](int i, int) {
+            out[i] = index->nearest_node(lat[i], lon[i]);
+        });
+    }
+
+    // Nearest base edge id (-1 if none) and fraction along it for each point.
+    void nearest_edges(const double* lat, const double* lon, size_t n, int* edge, double* fraction,
+                       int num_threads = 0) {
+        std::shared_ptr<const SpatialIndex> index = spatial_index();
+        parallel_for((int)n, n < 256 ? 1 : num_threads, [&](int i, int) {
+            std::tie(edge[i], fraction[i]) = index->nearest_edge(lat[i], lon[i]);
+        });
+    }
+
+    // --- VERIFICATION ---
+
+    struct VerifyResult {
+        int checked = 0;
+        int mismatches = 0;
+        double max_error_km = 0.0;
+    };
+
+    // Compares query_dist against base_dijkstra for random (origin, dest)
+    // pairs, both on one metric version. Any mismatch means the hierarchy
+    // lost a shortest path. Works on loaded graphs too, since the base
+    // edges are part of the file.
+    VerifyResult verify(int num_samples, unsigned seed = 0, int num_threads = 0) const {
+        if (num_nodes == 0) return {};
+        std::vector<std::pair<int, int>> pairs(std::max(0, num_samples));
+        uint64_t state = seed * 2654435761ULL + 1;
+        auto next = [&]() {   // splitmix64
+            state += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return (int)((z ^ (z >> 31)) % (uint64_t)num_nodes);
+        };
+        for (auto& p : pairs) p = {next(), next()};
+
+        std::shared_ptr<const Metric> m = metric_snapshot();
+        std::vector<double> error(pairs.size(), 0.0);
+        std::vector<char> bad(pairs.size(), 0);
+        parallel_for((int)pairs.size(), num_threads, [&](int i, int) {
+            auto [o, d] = pairs[i];
+            std::vector<double> dist;
+            base_dijkstra(base_out, m->base_weight.data(), o, d, dist);
+            double expected = dist[d];
+            double got = query_dist(o, d, QueryContext::local(), *m);
+            if (expected == std::numeric_limits<double>::infinity()) {
+                bad[i] = got != -1.0;
+            } else {
+                error[i] = std::abs(got - expected / 1000.0);
+                bad[i] = got < 0 || error[i] > 1e-9 * expected + 1e-9;
+            }
+        });
+
+        VerifyResult res;
+        res.checked = (int)pairs.size();
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            res.mismatches += bad[i];
+            if (bad[i]) res.max_error_km = std::max(res.max_error_km, error[i]);
+        }
+        return res;
+    }
+};
+
+// Asynchronous query service for servers: submit() queues a request and
+// returns at once. A fixed set of workers, each with its own
+// QueryContext, take requests off per-worker deques in micro-batches of up
+// to max_batch; a worker whose deque is empty steals half of another's.
+// Each batch runs on one metric snapshot and is handed to on_batch in a
+// single call, so a binding can take its interpreter lock once per batch
+// instead of once per query. on_batch runs on the worker threads.
+class QueryPool {
+public:
+    enum Kind { DIST, PATH, GEOMETRY };
+
+    struct Request {
+        uint64_t tag;
+        int origin, dest;
+        Kind kind;
+    };
+
+    struct Result {
+        uint64_t tag = 0;
+        Kind kind = DIST;
+        std::vector<int> path;        // PATH, GEOMETRY
+        std::vector<double> latlon;   // GEOMETRY, see path_geometry
+        double km = -1.0;             // -1 if unreachable
+        uint64_t metric_version = 0;
+        std::string error;            // set instead of a result if the query threw
+    };
+
+    struct Stats {
+        uint64_t submitted = 0, completed = 0, batches = 0, steals = 0;
+    };
+
+    using BatchCallback = std::function<void(std::vector<Result>&)>;
+
+    QueryPool(const CHGraph& graph, BatchCallback on_batch, int num_threads = 0, int max_batch = 64)
+        : graph(graph), on_batch(std::move(on_batch)), max_batch(std::max(1, max_batch)),
+          queues(resolve_threads(num_threads)) {
+        for (int w = 0; w < (int)queues.size(); ++w) workers.emplace_back([this, w] { run(w); });
+    }
+
+    ~QueryPool() { stop(); }
+
+    QueryPool(const QueryPool&) = delete;
+    QueryPool& operator=(const QueryPool&) = delete;
+
+    void submit(const Request& r) {
+        if (stopping.load()) throw std::logic_error("QueryPool is stopped");
+        WorkerQueue& q = queues[next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.requests.push_back(r);
+        }
+        submitted.fetch_add(1, std::memory_order_relaxed);
+        queued.fetch_add(1);
+        { std::lock_guard<std::mutex> lock(wake_mutex); }   // a worker checking `queued` has seen it or will be woken
+        wake.notify_one();
+    }
+
+    // Finishes every queued request, then joins the workers. Requests that
+    // raced with stop() are failed with an error, so each one still gets
+    // its result.
+    void stop() {
+        stopping.store(true);
+        { std::lock_guard<std::mutex> lock(wake_mutex); }
+        wake.notify_all();
+        for (auto& t : workers) {
+            if (t.joinable()) t.join();
+        }
+        std::vector<Request> late;
+        for (WorkerQueue& q : queues) take_from(q, late, std::numeric_limits<size_t>::max(), true);
+        if (late.empty()) return;
+        queued.fetch_sub(late.size());
+        std::vector<Result> results(late.size());
+        for (size_t i = 0; i < late.size(); ++i) {
+            results[i].tag = late[i].tag;
+            results[i].kind = late[i].kind;
+            results[i].error = "QueryPool is stopped";
+        }
+        on_batch(results);
+    }
+
+    int num_threads() const { return (int)queues.size(); }
+    size_t pending() const { return queued.load(); }
+
+    Stats stats() const {
+        Stats s;
+        s.submitted = submitted.load(std::memory_order_relaxed);
+        s.completed = completed.load(std::memory_order_relaxed);
+        s.batches = batches.load(std::memory_order_relaxed);
+        s.steals = steals.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    struct alignas(64) WorkerQueue {
+        std::mutex mutex;
+        std::deque<Request> requests;
+    };
+
+    const CHGraph& graph;
+    BatchCallback on_batch;
+    const int max_batch;
+    std::vector<WorkerQueue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next_queue{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<bool> stopping{false};
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> submitted{0}, completed{0}, batches{0}, steals{0};
+
+    // Moves up to `limit` requests from the front (own deque) or the back
+    // (stolen) of q into batch.
+    size_t take_from(WorkerQueue& q, std::vector<Request>& batch, size_t limit, bool front) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        size_t n = std::min(limit, q.requests.size());
+        for (size_t i = 0; i < n; ++i) {
+            if (front) {
+                batch.push_back(q.requests.front());
+                q.requests.pop_front();
+            } else {
+                batch.push_back(q.requests.back());
+                q.requests.pop_back();
+            }
+        }
+        return n;
+    }
+
+    // Next batch for worker w; false once stopped and drained.
+    bool next_batch(int w, std::vector<Request>& batch) {
+        for (;;) {
+            size_t n = take_from(queues[w], batch, max_batch, true);
+            for (size_t k = 1; n == 0 && k < queues.size(); ++k) {
+                WorkerQueue& victim = queues[(w + k) % queues.size()];
+                size_t size;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    size = victim.requests.size();
+                }
+                if (size == 0) continue;
+                n = take_from(victim, batch, std::min<size_t>(max_batch, (size + 1) / 2), false);
+                if (n > 0) steals.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (n > 0) {
+                queued.fetch_sub(n);
+                return true;
+            }
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake.wait(lock, [&] { return queued.load() > 0 || stopping.load(); });
+            if (stopping.load() && queued.load() == 0) return false;
+        }
+    }
+
+    void run(int w) {
+        QueryContext ctx;
+        std::vector<Request> batch;
+        std::vector<Result> results;
+        while (true) {
+            batch.clear();
+            if (!next_batch(w, batch)) break;
+            // Dropped before on_batch, which may wait for the GIL while a
+            // metric writer holding it waits for this snapshot's release.
+            std::shared_ptr<const Metric> m = graph.metric_snapshot();
+            results.assign(batch.size(), Result());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                const Request& r = batch[i];
+                Result& out = results[i];
+                out.tag = r.tag;
+                out.kind = r.kind;
+                out.metric_version = m->version;
+                try {
+                    if (r.kind == DIST) {
+                        out.km = graph.query_dist(r.origin, r.dest, ctx, *m);
+                    } else {
+                        auto [path, km] = graph.cached_query(r.origin, r.dest, ctx, *m);
+                        out.km = path.empty() ? -1.0 : km;
+                        if (r.kind == GEOMETRY && !path.empty()) out.latlon = graph.path_geometry(path, *m);
+                        out.path = std::move(path);
+                    }
+                } catch (const std::exception& e) {
+                    out.error = e.what();
+                }
+            }
+            m.reset();
+            on_batch(results);
+            completed.fetch_add(batch.size(), std::memory_order_relaxed);
+            batches.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
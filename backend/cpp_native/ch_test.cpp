@@ -0,0 +1,732 @@
+// backend/cpp_native/ch_test.cpp
+// Correctness checks of the ch_native engine (ch_engine.h) against plain
+// Dijkstra on random grid networks. Build and run with `make test`.
+//
+//   ch_test [--size W] [--queries N] [--seed S]
+//
+// The network is a W x W grid with random lengths, one-way and missing
+// streets, diagonals and a self-loop. Every build (CH with a given order,
+// auto-ordered CH, CCH) is checked for distances and paths, then CCH
+// customization and incremental updates, save/load, the distance matrix,
+// PHAST, A*/ALT, alternatives, time-dependent queries, the route cache,
+// the QueryPool (with work stealing), verify() and incremental updates on
+// a grid full of tied weights. A grid written as GraphML covers
+// from_graphml, path_geometry and snapping. Prints one line per check and
+// exits 1 if any failed.
+#include "ch_engine.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <queue>
+#include <random>
+
+namespace {
+
+constexpr double TOLERANCE_KM = 1e-6;
+constexpr double INF = std::numeric_limits<double>::infinity();
+
+struct Network {
+    int width = 0, num_nodes = 0;
+    std::vector<int> src, dst;
+    std::vector<double> weight;   // metres
+};
+
+Network make_network(int width, std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> length(10.0, 200.0);
+    Network net;
+    net.width = width;
+    net.num_nodes = width * width;
+    auto add = [&](int u, int v, double w) {
+        net.src.push_back(u);
+        net.dst.push_back(v);
+        net.weight.push_back(w);
+    };
+    auto street = [&](int u, int v) {
+        double w = length(rng);
+        int kind = (int)(rng() % 10);   // 0: one-way v -> u, 1: one-way u -> v, 2: missing
+        if (kind == 2) return;
+        if (kind != 0) add(u, v, w);
+        if (kind != 1) add(v, u, w);
+    };
+    for (int y = 0; y < width; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int u = y * width + x;
+            if (x + 1 < width) street(u, u + 1);
+            if (y + 1 < width) street(u, u + width);
+            if (x + 1 < width && y + 1 < width && rng() % 7 == 0) add(u, u + width + 1, 1.5 * length(rng));
+        }
+    }
+    add(3, 3, 5.0);
+    return net;
+}
+
+// Plain Dijkstra on the input edges: metres from source to every node,
+// INF where unreachable.
+class Reference {
+public:
+    Reference(const Network& net, const std::vector<double>& weight) : out_(net.num_nodes) {
+        for (size_t e = 0; e < net.src.size(); ++e) out_[net.src[e]].push_back({net.dst[e], weight[e]});
+        for (size_t e = 0; e < net.src.size(); ++e) {
+            auto key = std::make_pair(net.src[e], net.dst[e]);
+            auto it = shortest_edge_.find(key);
+            if (it == shortest_edge_.end() || weight[e] < it->second) shortest_edge_[key] = weight[e];
+        }
+    }
+
+    std::vector<double> from(int source) const {
+        std::vector<double> dist(out_.size(), INF);
+        using Item = std::pair<double, int>;
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> heap;
+        dist[source] = 0.0;
+        heap.push({0.0, source});
+        while (!heap.empty()) {
+            auto [d, u] = heap.top();
+            heap.pop();
+            if (d > dist[u]) continue;
+            for (auto [v, w] : out_[u]) {
+                if (d + w < dist[v]) {
+                    dist[v] = d + w;
+                    heap.push({dist[v], v});
+                }
+            }
+        }
+        return dist;
+    }
+
+    double km(int source, int dest) const {
+        double d = from(source)[dest];
+        return d < INF ? d / 1000.0 : -1.0;
+    }
+
+    // Length of `path` in km if it runs origin -> dest along input edges,
+    // -1 otherwise.
+    double path_km(const std::vector<int>& path, int origin, int dest) const {
+        if (path.empty() || path.front() != origin || path.back() != dest) return -1.0;
+        double metres = 0.0;
+        for (size_t i = 0; i + 1 < path.size(); ++i) {
+            auto it = shortest_edge_.find({path[i], path[i + 1]});
+            if (it == shortest_edge_.end()) return -1.0;
+            metres += it->second;
+        }
+        return metres / 1000.0;
+    }
+
+private:
+    std::vector<std::vector<std::pair<int, double>>> out_;
+    std::map<std::pair<int, int>, double> shortest_edge_;
+};
+
+class Checker {
+public:
+    // Records one comparison of `name`; the first few failures are printed.
+    void expect(bool ok, const std::string& name, const std::string& detail = std::string()) {
+        if (!tallies_.count(name)) order_.push_back(name);
+        Tally& t = tallies_[name];
+        ++t.checks;
+        if (ok) return;
+        if (++t.failures <= 3) std::fprintf(stderr, "FAIL %s: %s\n", name.c_str(), detail.c_str());
+    }
+
+    bool report() const {
+        bool ok = true;
+        for (const std::string& name : order_) {
+            const Tally& t = tallies_.at(name);
+            std::printf("%-4s %-28s %d checks", t.failures ? "FAIL" : "ok", name.c_str(), t.checks);
+            if (t.failures) std::printf(", %d failed", t.failures);
+            std::printf("\n");
+            ok = ok && t.failures == 0;
+        }
+        return ok;
+    }
+
+private:
+    struct Tally {
+        int checks = 0, failures = 0;
+    };
+    std::map<std::string, Tally> tallies_;
+    std::vector<std::string> order_;
+};
+
+std::string describe(int origin, int dest, double got, double want) {
+    char buf[128];
+    std::snprintf(buf, sizeof buf, "%d -> %d: %.9f km, expected %.9f", origin, dest, got, want);
+    return buf;
+}
+
+std::vector<std::pair<int, int>> random_pairs(int num_nodes, int count, std::mt19937_64& rng) {
+    std::uniform_int_distribution<int> node(0, num_nodes - 1);
+    std::vector<std::pair<int, int>> pairs(count);
+    for (auto& p : pairs) p = {node(rng), node(rng)};
+    return pairs;
+}
+
+// query_dist and query against the reference, including path validity.
+void check_queries(const CHGraph& g, const Reference& ref, const std::string& name, int queries,
+                   std::mt19937_64& rng, Checker& check) {
+    QueryContext ctx;
+    for (auto [s, t] : random_pairs(g.num_nodes, queries, rng)) {
+        double want = ref.km(s, t);
+        double got = g.query_dist(s, t, ctx);
+        check.expect(std::abs(got - want) < TOLERANCE_KM, name, describe(s, t, got, want));
+        auto [path, km] = g.query(s, t, ctx);
+        if (want < 0) {
+            check.expect(path.empty(), name, describe(s, t, km, want) + ", path for unreachable dest");
+        } else {
+            double walked = ref.path_km(path, s, t);
+            check.expect(std::abs(km - want) < TOLERANCE_KM && std::abs(walked - want) < TOLERANCE_KM, name,
+                         describe(s, t, walked, want) + " along the returned path");
+        }
+    }
+}
+
+void check_verify(const CHGraph& g, const std::string& name, Checker& check) {
+    CHGraph::VerifyResult r = g.verify(100, 1, 2);
+    check.expect(r.checked > 0 && r.mismatches == 0, name,
+                 std::to_string(r.mismatches) + " of " + std::to_string(r.checked) + " mismatched");
+}
+
+std::unique_ptr<CHGraph> make_graph(const Network& net) {
+    auto g = std::make_unique<CHGraph>(net.num_nodes);
+    g->add_edges(net.src.data(), net.dst.data(), net.weight.data(), nullptr, nullptr, net.src.size());
+    // ~5.5 m between grid neighbours, below every edge length, so the
+    // geometric A* bound stays admissible.
+    for (int u = 0; u < net.num_nodes; ++u) {
+        g->set_node(u, 1000 + u, 52.0 + (u / net.width) * 0.5e-4, 13.0 + (u % net.width) * 0.8e-4);
+    }
+    return g;
+}
+
+std::unique_ptr<CHGraph> reload(const CHGraph& g, const std::string& path) {
+    g.save(path);
+    auto loaded = CHGraph::load(path);
+    std::filesystem::remove(path);
+    return loaded;
+}
+
+void check_matrix(const CHGraph& g, const Reference& ref, std::mt19937_64& rng, Checker& check) {
+    std::vector<int> sources, targets;
+    for (auto [s, t] : random_pairs(g.num_nodes, 12, rng)) {
+        sources.push_back(s);
+        targets.push_back(t);
+    }
+    std::vector<double> out(sources.size() * targets.size());
+    g.distance_matrix(sources, targets, out.data(), 3);
+    for (size_t i = 0; i < sources.size(); ++i) {
+        std::vector<double> dist = ref.from(sources[i]);
+        for (size_t j = 0; j < targets.size(); ++j) {
+            double want = dist[targets[j]] < INF ? dist[targets[j]] / 1000.0 : -1.0;
+            double got = out[i * targets.size() + j];
+            check.expect(std::abs(got - want) < TOLERANCE_KM, "distance_matrix",
+                         describe(sources[i], targets[j], got, want));
+        }
+    }
+}
+
+void check_phast(const CHGraph& g, const Reference& ref, std::mt19937_64& rng, Checker& check) {
+    std::uniform_int_distribution<int> node(0, g.num_nodes - 1);
+    std::vector<int> sources(5);
+    for (int& s : sources) s = node(rng);
+    std::vector<double> out(sources.size() * g.num_nodes);
+    g.one_to_all(sources, out.data(), 2);
+    for (size_t i = 0; i < sources.size(); ++i) {
+        std::vector<double> dist = ref.from(sources[i]);
+        for (int v = 0; v < g.num_nodes; ++v) {
+            double want = dist[v] < INF ? dist[v] / 1000.0 : -1.0;
+            double got = out[i * g.num_nodes + v];
+            check.expect(std::abs(got - want) < TOLERANCE_KM, "one_to_all", describe(sources[i], v, got, want));
+        }
+    }
+}
+
+void check_astar(const CHGraph& g, const Reference& ref, int queries, std::mt19937_64& rng, Checker& check) {
+    QueryContext ctx;
+    for (auto [s, t] : random_pairs(g.num_nodes, queries, rng)) {
+        double want = ref.km(s, t);
+        for (bool alt : {false, true}) {
+            for (double eps : {1.0, 2.0}) {
+                std::string name = std::string(alt ? "alt" : "astar") + (eps > 1.0 ? " eps=2" : "");
+                auto [path, km] = g.astar(s, t, ctx, eps, alt);
+                if (want < 0) {
+                    check.expect(path.empty(), name, describe(s, t, km, want) + ", path for unreachable dest");
+                    continue;
+                }
+                double walked = ref.path_km(path, s, t);
+                bool bounded = eps == 1.0 ? std::abs(km - want) < TOLERANCE_KM
+                                          : km > want - TOLERANCE_KM && km < eps * want + TOLERANCE_KM;
+                check.expect(bounded && std::abs(walked - km) < TOLERANCE_KM, name, describe(s, t, km, want));
+            }
+        }
+    }
+}
+
+void check_alternatives(const CHGraph& g, const Reference& ref, int queries, std::mt19937_64& rng,
+                        Checker& check) {
+    const double max_stretch = 0.25;
+    QueryContext ctx;
+    for (auto [s, t] : random_pairs(g.num_nodes, queries, rng)) {
+        double want = ref.km(s, t);
+        auto routes = g.query_alternatives(s, t, 2, ctx, max_stretch);
+        if (want < 0) {
+            check.expect(routes.empty(), "query_alternatives", describe(s, t, -1.0, want) + ", routes returned");
+            continue;
+        }
+        if (routes.empty()) {
+            check.expect(false, "query_alternatives", describe(s, t, -1.0, want) + ", no route");
+            continue;
+        }
+        check.expect(std::abs(routes[0].second - want) < TOLERANCE_KM, "query_alternatives",
+                     describe(s, t, routes[0].second, want) + " for the first route");
+        for (size_t i = 0; i < routes.size(); ++i) {
+            const auto& [path, km] = routes[i];
+            double walked = ref.path_km(path, s, t);
+            bool distinct = true;
+            for (size_t j = 0; j < i; ++j) distinct = distinct && routes[j].first != path;
+            check.expect(std::abs(walked - km) < TOLERANCE_KM && km < (1.0 + max_stretch) * want + TOLERANCE_KM &&
+                             distinct,
+                         "query_alternatives", describe(s, t, km, want) + " for route " + std::to_string(i));
+        }
+    }
+}
+
+// Two profiles (a rush-hour one and a mild one) spread over the edges;
+// td_query against a time-dependent Dijkstra on the same travel times.
+void check_time_dependent(CHGraph& g, int queries, std::mt19937_64& rng, Checker& check) {
+    std::vector<int64_t> offsets = {0, 6, 9};
+    std::vector<double> times = {0, 6 * 3600, 8 * 3600, 10 * 3600, 16 * 3600, 19 * 3600, 0, 12 * 3600, 20 * 3600};
+    std::vector<double> factors = {1, 1, 3, 1, 2.5, 1, 0.9, 1.5, 1.1};
+    size_t m = g.base_src.size();
+    std::vector<int> edge_profile(m);
+    for (size_t e = 0; e < m; ++e) edge_profile[e] = (int)(e % 3) - 1;
+    g.set_time_profiles(offsets.data(), 2, times.data(), factors.data(), edge_profile.data(), m, 3.6 / 50);
+    auto tt = g.time_profile_snapshot();
+    auto metric = g.metric_snapshot();
+
+    auto earliest_arrival = [&](int source, int dest, double departure) {
+        std::vector<double> arrival(g.num_nodes, INF);
+        using Item = std::pair<double, int>;
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> heap;
+        arrival[source] = departure;
+        heap.push({departure, source});
+        while (!heap.empty()) {
+            auto [a, u] = heap.top();
+            heap.pop();
+            if (a > arrival[u]) continue;
+            if (u == dest) return a;
+            for (int i = g.base_out.begin(u); i < g.base_out.end(u); ++i) {
+                int v = g.base_out.targets[i], e = g.base_out.edges[i];
+                double next = a + tt->travel_time(e, metric->base_weight[e], a);
+                if (next < arrival[v]) {
+                    arrival[v] = next;
+                    heap.push({next, v});
+                }
+            }
+        }
+        return -1.0;
+    };
+
+    std::uniform_real_distribution<double> departure(0.0, 86400.0);
+    QueryContext ctx;
+    for (auto [s, t] : random_pairs(g.num_nodes, queries, rng)) {
+        double dep = departure(rng);
+        double want = earliest_arrival(s, t, dep);
+        for (bool alt : {false, true}) {
+            auto [path, arrival] = g.td_query(s, t, dep, ctx, alt);
+            bool ok = std::abs(arrival - want) < 1e-6 * std::max(1.0, want) &&
+                      (want < 0 ? path.empty() : !path.empty() && path.front() == s && path.back() == t);
+            check.expect(ok, alt ? "td_query alt" : "td_query", describe(s, t, arrival, want) + " (s)");
+        }
+    }
+}
+
+void check_route_cache(CHGraph& g, int queries, std::mt19937_64& rng, Checker& check) {
+    g.set_route_cache(1 << 20, 4);
+    QueryContext ctx, plain;
+    auto pairs = random_pairs(g.num_nodes, queries, rng);
+    for (int round = 0; round < 2; ++round) {
+        for (auto [s, t] : pairs) {
+            auto got = g.cached_query(s, t, ctx);
+            auto want = g.query(s, t, plain);
+            check.expect(got == want && (round == 0 || ctx.cache_hit), "cached_query",
+                         describe(s, t, got.second, want.second) + (round ? " on a hit" : " on a miss"));
+        }
+    }
+    g.set_route_cache(0);
+}
+
+// CCH update_weights on a two-way grid with only 100 m and 200 m edges, so
+// recomputed arcs often keep their weight through a different, tied
+// triangle. Both metric buffers must follow such a switch; checked after
+// every batch, as each batch is applied to the other buffer.
+void check_tied_updates(std::mt19937_64& rng, Checker& check) {
+    const int width = 12, batches = 400;
+    Network net;
+    net.width = width;
+    net.num_nodes = width * width;
+    auto tied = [&]() { return rng() % 2 ? 100.0 : 200.0; };
+    for (int u = 0; u < net.num_nodes; ++u) {
+        for (int v : {u + 1, u + width}) {
+            if ((v == u + 1 && (u + 1) % width == 0) || v >= net.num_nodes) continue;
+            double w = tied();
+            for (auto [a, b] : {std::make_pair(u, v), std::make_pair(v, u)}) {
+                net.src.push_back(a);
+                net.dst.push_back(b);
+                net.weight.push_back(w);
+            }
+        }
+    }
+    auto g = make_graph(net);
+    g->build_cch({}, 1);
+    std::vector<double> weight = net.weight;
+    for (int batch = 0; batch < batches; ++batch) {
+        for (int call = 0; call < 3; ++call) {
+            int e = (int)(rng() % weight.size());
+            weight[e] = tied();
+            g->update_weights(&e, &weight[e], 1);
+        }
+        check_queries(*g, Reference(net, weight), "update_weights tied", 10, rng, check);
+    }
+}
+
+// Requests through a QueryPool against direct queries. The first batch's
+// callback blocks its worker until every other request is done; a third
+// of them were queued on that worker, so they only finish by stealing.
+void check_query_pool(const CHGraph& g, int queries, std::mt19937_64& rng, Checker& check) {
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool blocked = false, release = false;
+    std::map<uint64_t, QueryPool::Result> results;
+    auto on_batch = [&](std::vector<QueryPool::Result>& batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto& r : batch) results[r.tag] = std::move(r);
+        if (!blocked) {
+            blocked = true;
+            changed.notify_all();
+            changed.wait(lock, [&] { return release; });
+        }
+        changed.notify_all();
+    };
+    const auto pairs = random_pairs(g.num_nodes, queries, rng);
+    uint64_t steals = 0;
+    {
+        QueryPool pool(g, on_batch, 3, 8);
+        pool.submit({0, pairs[0].first, pairs[0].second, QueryPool::PATH});
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return blocked; });
+        }
+        const QueryPool::Kind kinds[] = {QueryPool::DIST, QueryPool::PATH, QueryPool::GEOMETRY};
+        for (size_t i = 1; i < pairs.size(); ++i) pool.submit({i, pairs[i].first, pairs[i].second, kinds[i % 3]});
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            bool done = changed.wait_for(lock, std::chrono::seconds(60), [&] { return results.size() == pairs.size(); });
+            check.expect(done, "QueryPool stealing",
+                         std::to_string(results.size()) + " of " + std::to_string(pairs.size()) +
+                             " results while one worker was blocked");
+            release = true;
+        }
+        changed.notify_all();
+        pool.stop();
+        steals = pool.stats().steals;
+    }
+    check.expect(steals > 0, "QueryPool stealing", "no steals");
+
+    const auto metric = g.metric_snapshot();
+    QueryContext ctx;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        auto [s, t] = pairs[i];
+        auto it = results.find(i);
+        if (it == results.end()) {
+            check.expect(false, "QueryPool", describe(s, t, -1.0, -1.0) + ", no result");
+            continue;
+        }
+        const QueryPool::Result& r = it->second;
+        auto [path, km] = g.query(s, t, ctx);
+        if (path.empty()) km = -1.0;   // the pool's unreachable marker
+        bool ok = r.error.empty() && r.metric_version == metric->version && r.km == km;
+        if (r.kind != QueryPool::DIST) ok = ok && r.path == path;
+        if (r.kind == QueryPool::GEOMETRY) ok = ok && r.latlon == (path.empty() ? std::vector<double>() : g.path_geometry(path, *metric));
+        check.expect(ok, "QueryPool", describe(s, t, r.km, km) + (r.error.empty() ? "" : ", " + r.error));
+    }
+}
+
+// Point (lat, lon) of grid node u in the GraphML check.
+std::pair<double, double> graphml_coords(const Network& net, int u) {
+    return {52.0 + (u / net.width) * 1e-3, 13.0 + (u % net.width) * 1.5e-3};
+}
+
+// A two-way grid written as an osmnx GraphML file: OSM-like ids, lengths
+// with three decimals and a one-point LINESTRING on every third edge.
+// Returns the network and the expected interior point (lat, lon) per edge.
+Network write_graphml(const std::string& path, int width, std::mt19937_64& rng,
+                      std::vector<std::vector<double>>& shapes) {
+    std::uniform_real_distribution<double> length(100.0, 300.0), jitter(-2e-4, 2e-4);
+    Network net;
+    net.width = width;
+    net.num_nodes = width * width;
+    for (int u = 0; u < net.num_nodes; ++u) {
+        for (int v : {u + 1, u + width}) {
+            if ((v == u + 1 && (u + 1) % width == 0) || v >= net.num_nodes) continue;
+            double w = std::round(length(rng) * 1000.0) / 1000.0;
+            for (auto [a, b] : {std::make_pair(u, v), std::make_pair(v, u)}) {
+                net.src.push_back(a);
+                net.dst.push_back(b);
+                net.weight.push_back(w);
+            }
+        }
+    }
+    std::ofstream out(path);
+    out << "<?xml version='1.0' encoding='utf-8'?>\n"
+           "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+           "  <key id=\"d4\" for=\"node\" attr.name=\"y\" attr.type=\"string\" />\n"
+           "  <key id=\"d5\" for=\"node\" attr.name=\"x\" attr.type=\"string\" />\n"
+           "  <key id=\"d9\" for=\"edge\" attr.name=\"length\" attr.type=\"string\" />\n"
+           "  <key id=\"d10\" for=\"edge\" attr.name=\"geometry\" attr.type=\"string\" />\n"
+           "  <graph edgedefault=\"directed\">\n";
+    char buf[256];
+    for (int u = 0; u < net.num_nodes; ++u) {
+        auto [lat, lon] = graphml_coords(net, u);
+        std::snprintf(buf, sizeof buf, "    <node id=\"%lld\">\n      <data key=\"d4\">%.6f</data>\n"
+                      "      <data key=\"d5\">%.6f</data>\n    </node>\n", 5000000000LL + 7LL * u, lat, lon);
+        out << buf;
+    }
+    shapes.assign(net.src.size(), {});
+    for (size_t e = 0; e < net.src.size(); ++e) {
+        std::snprintf(buf, sizeof buf, "    <edge source=\"%lld\" target=\"%lld\" id=\"0\">\n"
+                      "      <data key=\"d9\">%.3f</data>\n", 5000000000LL + 7LL * net.src[e],
+                      5000000000LL + 7LL * net.dst[e], net.weight[e]);
+        out << buf;
+        if (e % 3 == 0) {
+            auto [alat, alon] = graphml_coords(net, net.src[e]);
+            auto [blat, blon] = graphml_coords(net, net.dst[e]);
+            double mlat = std::round(((alat + blat) / 2 + jitter(rng)) * 1e6) / 1e6;
+            double mlon = std::round(((alon + blon) / 2 + jitter(rng)) * 1e6) / 1e6;
+            shapes[e] = {mlat, mlon};
+            std::snprintf(buf, sizeof buf, "      <data key=\"d10\">LINESTRING (%.6f %.6f, %.6f %.6f, %.6f %.6f)</data>\n",
+                          alon, alat, mlon, mlat, blon, blat);
+            out << buf;
+        }
+        out << "    </edge>\n";
+    }
+    out << "  </graph>\n</graphml>\n";
+    if (!out) throw std::runtime_error("cannot write " + path);
+    return net;
+}
+
+// from_graphml on a file read in several chunks, path_geometry before and
+// after save/load, and nearest_nodes / nearest_edges against a brute-force
+// scan in the index's projection (equirectangular at the mean latitude).
+void check_graphml(const std::string& tmp, int queries, std::mt19937_64& rng, Checker& check) {
+    const std::string xml = tmp + ".graphml";
+    std::vector<std::vector<double>> shapes;
+    const Network net = write_graphml(xml, 20, rng, shapes);
+    auto g = CHGraph::from_graphml(xml, 2, 1 << 16);
+    std::filesystem::remove(xml);
+
+    bool same = g->num_nodes == net.num_nodes && g->base_src.size() == net.src.size();
+    for (int u = 0; same && u < net.num_nodes; ++u) {
+        auto [lat, lon] = graphml_coords(net, u);
+        same = g->node_ids[u] == 5000000000LL + 7LL * u && std::abs(g->node_lat[u] - lat) < 1e-9 &&
+               std::abs(g->node_lon[u] - lon) < 1e-9;
+    }
+    for (size_t e = 0; same && e < net.src.size(); ++e) {
+        same = g->base_src[e] == net.src[e] && g->base_dst[e] == net.dst[e] &&
+               std::abs(g->base_weight[e] - net.weight[e]) < 1e-9;
+    }
+    check.expect(same, "from_graphml", "nodes or edges differ from the file");
+    if (!same) return;
+
+    g->build_ch_auto(2);
+    const Reference ref(net, net.weight);
+    check_queries(*g, ref, "from_graphml", queries, rng, check);
+
+    auto loaded = reload(*g, tmp);
+    for (const CHGraph* graph : {(const CHGraph*)g.get(), (const CHGraph*)loaded.get()}) {
+        const auto metric = graph->metric_snapshot();
+        QueryContext ctx;
+        for (auto [s, t] : random_pairs(net.num_nodes, queries / 4, rng)) {
+            std::vector<int> path = graph->query(s, t, ctx).first;
+            std::vector<double> want;
+            for (size_t i = 0; i < path.size(); ++i) {
+                if (i > 0) {
+                    for (size_t e = 0; e < net.src.size(); ++e) {
+                        if (net.src[e] != path[i - 1] || net.dst[e] != path[i]) continue;
+                        want.insert(want.end(), shapes[e].begin(), shapes[e].end());
+                    }
+                }
+                auto [lat, lon] = graphml_coords(net, path[i]);
+                want.push_back(lat);
+                want.push_back(lon);
+            }
+            std::vector<double> got = graph->path_geometry(path, *metric);
+            bool ok = got.size() == want.size();
+            for (size_t i = 0; ok && i < got.size(); ++i) ok = std::abs(got[i] - want[i]) < 1e-6;
+            check.expect(ok, graph == g.get() ? "path_geometry" : "load path_geometry",
+                         std::to_string(s) + " -> " + std::to_string(t) + ": " + std::to_string(got.size() / 2) +
+                             " points, expected " + std::to_string(want.size() / 2));
+        }
+    }
+
+    const double R = 6371000.0, RAD = 3.14159265358979323846 / 180.0;
+    double lat_sum = 0.0;
+    for (int u = 0; u < net.num_nodes; ++u) lat_sum += graphml_coords(net, u).first;
+    const double kx = R * RAD * std::cos(lat_sum / net.num_nodes * RAD), ky = R * RAD;
+    auto [lat0, lon0] = graphml_coords(net, 0);
+    auto [lat1, lon1] = graphml_coords(net, net.num_nodes - 1);
+    std::uniform_real_distribution<double> qlat(lat0 - 2e-3, lat1 + 2e-3), qlon(lon0 - 2e-3, lon1 + 2e-3);
+    const int points = 300;   // above the single-thread cutoff of the batch calls
+    std::vector<double> lat(points), lon(points), fraction(points);
+    for (int i = 0; i < points; ++i) {
+        lat[i] = qlat(rng);
+        lon[i] = qlon(rng);
+    }
+    std::vector<int> node(points), edge(points);
+    loaded->nearest_nodes(lat.data(), lon.data(), points, node.data(), 2);
+    loaded->nearest_edges(lat.data(), lon.data(), points, edge.data(), fraction.data(), 2);
+    auto xy = [&](int u) {
+        auto [la, lo] = graphml_coords(net, u);
+        return std::make_pair(lo * kx, la * ky);
+    };
+    for (int i = 0; i < points; ++i) {
+        const double qx = lon[i] * kx, qy = lat[i] * ky;
+        double best_node = INF, best_edge = INF;
+        for (int u = 0; u < net.num_nodes; ++u) {
+            auto [x, y] = xy(u);
+            best_node = std::min(best_node, std::hypot(x - qx, y - qy));
+        }
+        for (size_t e = 0; e < net.src.size(); ++e) {
+            auto [ax, ay] = xy(net.src[e]);
+            auto [bx, by] = xy(net.dst[e]);
+            double dx = bx - ax, dy = by - ay;
+            double f = std::clamp(((qx - ax) * dx + (qy - ay) * dy) / (dx * dx + dy * dy), 0.0, 1.0);
+            best_edge = std::min(best_edge, std::hypot(ax + f * dx - qx, ay + f * dy - qy));
+        }
+        bool node_ok = node[i] >= 0 && node[i] < net.num_nodes;
+        if (node_ok) {
+            auto [x, y] = xy(node[i]);
+            node_ok = std::abs(std::hypot(x - qx, y - qy) - best_node) < 1e-6;
+        }
+        check.expect(node_ok, "nearest_nodes", "point " + std::to_string(i) + ": node " + std::to_string(node[i]));
+        bool edge_ok = edge[i] >= 0 && (size_t)edge[i] < net.src.size() && fraction[i] >= 0.0 && fraction[i] <= 1.0;
+        if (edge_ok) {
+            auto [ax, ay] = xy(net.src[edge[i]]);
+            auto [bx, by] = xy(net.dst[edge[i]]);
+            double d = std::hypot(ax + fraction[i] * (bx - ax) - qx, ay + fraction[i] * (by - ay) - qy);
+            edge_ok = std::abs(d - best_edge) < 1e-6;
+        }
+        check.expect(edge_ok, "nearest_edges", "point " + std::to_string(i) + ": edge " + std::to_string(edge[i]));
+    }
+}
+
+[[noreturn]] void usage(const char* msg) {
+    if (msg) std::fprintf(stderr, "ch_test: %s\n", msg);
+    std::fprintf(stderr, "usage: ch_test [--size W] [--queries N] [--seed S]\n");
+    std::exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int width = 24, queries = 200;
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (++i >= argc) usage(("missing value for " + arg).c_str());
+            return argv[i];
+        };
+        if (arg == "--size") width = std::atoi(value().c_str());
+        else if (arg == "--queries") queries = std::atoi(value().c_str());
+        else if (arg == "--seed") seed = std::strtoull(value().c_str(), nullptr, 10);
+        else usage(("unknown option " + arg).c_str());
+    }
+    if (width < 3) usage("--size must be at least 3");
+    if (queries <= 0) usage("--queries must be positive");
+
+    Checker check;
+    try {
+        std::mt19937_64 rng(seed);
+        const Network net = make_network(width, rng);
+        const Reference ref(net, net.weight);
+        const std::string tmp = (std::filesystem::temp_directory_path() /
+                                 ("ch_test." + std::to_string(seed) + ".bin")).string();
+
+        // CH on a caller-given order: low degree first.
+        {
+            auto g = make_graph(net);
+            std::vector<int> degree(net.num_nodes), order(net.num_nodes);
+            for (size_t e = 0; e < net.src.size(); ++e) {
+                degree[net.src[e]]++;
+                degree[net.dst[e]]++;
+            }
+            for (int u = 0; u < net.num_nodes; ++u) order[u] = u;
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+            g->build_ch(order);
+            check_queries(*g, ref, "build_ch", queries, rng, check);
+            check_verify(*g, "verify build_ch", check);
+        }
+
+        // Auto-ordered CH, then everything that runs on a static graph.
+        auto ch = make_graph(net);
+        ch->build_ch_auto(2);
+        check_queries(*ch, ref, "build_ch_auto", queries, rng, check);
+        check_verify(*ch, "verify build_ch_auto", check);
+        ch->build_landmarks(8, 2);
+        auto loaded = reload(*ch, tmp);
+        check_queries(*loaded, ref, "load build_ch_auto", queries, rng, check);
+        check_matrix(*loaded, ref, rng, check);
+        check_phast(*loaded, ref, rng, check);
+        check_astar(*loaded, ref, queries, rng, check);
+        check_alternatives(*loaded, ref, queries, rng, check);
+        check_time_dependent(*loaded, queries / 2, rng, check);
+        check_route_cache(*loaded, queries / 2, rng, check);
+        check_query_pool(*loaded, queries, rng, check);
+        check_graphml(tmp, queries, rng, check);
+
+        // CCH: the first customization, a full re-customization with new
+        // weights, incremental updates, and the same after save/load.
+        auto cch = make_graph(net);
+        cch->build_cch({}, 2);
+        check_queries(*cch, ref, "build_cch", queries, rng, check);
+        check_verify(*cch, "verify build_cch", check);
+
+        // New weights in whole 50 m steps, so many paths tie from here on.
+        std::vector<double> weight = net.weight;
+        for (double& w : weight) {
+            w = 50.0 * std::ceil(w / 50.0);
+            if (rng() % 3 == 0) w *= (double)(1 + rng() % 10);
+        }
+        cch->customize(weight.data(), weight.size(), 2);
+        check_queries(*cch, Reference(net, weight), "customize", queries, rng, check);
+        check_phast(*cch, Reference(net, weight), rng, check);
+
+        auto cch_loaded = reload(*cch, tmp);
+        check_queries(*cch_loaded, Reference(net, weight), "load build_cch", queries, rng, check);
+        // Updates in whole 50 m steps as well, checked after every batch:
+        // consecutive batches are applied to alternate metric buffers.
+        for (int round = 0; round < 50; ++round) {
+            std::vector<int> ids;
+            std::vector<double> values;
+            for (int k = 0; k < 5; ++k) {
+                int e = (int)(rng() % weight.size());
+                ids.push_back(e);
+                values.push_back(50.0 * (double)(1 + rng() % 4));
+                weight[e] = values.back();
+            }
+            cch_loaded->update_weights(ids.data(), values.data(), ids.size());
+            check_queries(*cch_loaded, Reference(net, weight), "update_weights", std::max(queries / 4, 10), rng,
+                          check);
+        }
+        Reference updated(net, weight);
+        check_verify(*cch_loaded, "verify update_weights", check);
+        check_matrix(*cch_loaded, updated, rng, check);
+        check_tied_updates(rng, check);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "ch_test: %s\n", e.what());
+        return 1;
+    }
+    return check.report() ? 0 : 1;
+}
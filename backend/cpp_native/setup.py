@@ -1,16 +1,24 @@
 # backend/cpp_native/setup.py
+import sys
 from setuptools import setup, Extension
 import pybind11
 
-cpp_args = ['/std:c++17'] # Windows standard flag. Use '-std=c++17' for Linux/Mac.
+if sys.platform == 'win32':
+    cpp_args = ['/std:c++17', '/O2']
+    link_args = []
+else:
+    cpp_args = ['-std=c++17', '-O3', '-pthread']  # distance_matrix uses std::thread
+    link_args = ['-pthread']
 
 ext_modules = [
     Extension(
         'ch_native',
         ['ch_core.cpp'],
+        depends=['ch_engine.h'],
         include_dirs=[pybind11.get_include()],
         language='c++',
         extra_compile_args=cpp_args,
+        extra_link_args=link_args,
     ),
 ]
 
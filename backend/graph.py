@@ -7,4 +7,58 @@ def load_graph(filepath: str):
 
 def get_nearest_node(G, lat, lon):
     """Finds the nearest network node to a given lat/lon point."""
-    return ox.distance.nearest_nodes(G, lon, lat)
\ No newline at end of file
+    return ox.distance.nearest_nodes(G, lon, lat)
+
+def edge_geometry_arrays(edge_data):
+    """Packs edge shapes for CHGraph.set_edge_geometry().
+
+    `edge_data` yields the attribute dicts of the base edges in the order they
+    were added to the engine. Each shape keeps only the points between the
+    end nodes; edges without 'geometry' get none.
+    """
+    import numpy as np
+    lats, lons, offsets = [], [], [0]
+    for data in edge_data:
+        if 'geometry' in data:
+            # OSMnx geometry is (Lon, Lat)
+            for lon, lat in list(data['geometry'].coords)[1:-1]:
+                lats.append(lat)
+                lons.append(lon)
+        offsets.append(len(lats))
+    return (np.array(offsets, dtype=np.int64),
+            np.array(lats, dtype=np.float64),
+            np.array(lons, dtype=np.float64))
+
+# Typical weekday congestion as factors on free-flow time, (hour, factor)
+# breakpoints interpolated linearly and across midnight. Major roads get
+# sharp rush hours, minor ones a flatter curve.
+TIME_PROFILES = {
+    "major": [(0, 1.0), (6, 1.0), (8, 2.5), (10, 1.3), (15, 1.3), (17.5, 2.8), (20, 1.1)],
+    "minor": [(0, 1.0), (7, 1.1), (8.5, 1.6), (10, 1.1), (16.5, 1.2), (18, 1.7), (20, 1.0)],
+}
+MAJOR_ROADS = {"motorway", "motorway_link", "trunk", "trunk_link", "primary", "primary_link",
+               "secondary", "secondary_link"}
+
+def time_profile_arrays(edge_data):
+    """Packs TIME_PROFILES for CHGraph.set_time_profiles().
+
+    `edge_data` yields the attribute dicts of the base edges in engine order;
+    each edge gets the profile of its OSM 'highway' class.
+    """
+    import numpy as np
+    names = list(TIME_PROFILES)
+    offsets, times, factors = [0], [], []
+    for name in names:
+        for hour, factor in TIME_PROFILES[name]:
+            times.append(hour * 3600.0)
+            factors.append(factor)
+        offsets.append(len(times))
+    major, minor = names.index("major"), names.index("minor")
+    edge_profile = []
+    for data in edge_data:
+        highway = data.get('highway', '')
+        if isinstance(highway, list):
+            highway = highway[0] if highway else ''
+        edge_profile.append(major if highway in MAJOR_ROADS else minor)
+    return (np.array(offsets, dtype=np.int64), np.array(times, dtype=np.float64),
+            np.array(factors, dtype=np.float64), np.array(edge_profile, dtype=np.int32))
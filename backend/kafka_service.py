@@ -4,11 +4,19 @@ import random
 import networkx as nx
 
 class TrafficManager:
-    def __init__(self, G):
+    def __init__(self, G, engine=None, edge_ids=None):
         self.G = G
         self.running = False
         self.lock = threading.Lock() # Thread safety for graph updates
 
+        # Optional CHGraph: every batch of updates is pushed into it with
+        # update_weights(), so its A* (and, if customizable, CH) queries
+        # follow live traffic.
+        self.engine = engine
+        self.edge_ids = edge_ids or {}   # (u, v) node ids -> base edge ids (parallel edges)
+        # Free-flow weight per base edge, which the traffic factor scales
+        self.free_flow = engine.get_base_edges()["weight"].tolist() if engine is not None else []
+
     def start_consumer(self):
         self.running = True
         # Start background thread to simulate/consume Kafka
@@ -29,6 +37,7 @@ class TrafficManager:
                 # Pick 5 random edges to update
                 affected = random.sample(edges, 5)
                 
+                changed_ids, changed_weights = [], []
                 with self.lock:
                     for u, v, data in affected:
                         # TRAFFIC LOGIC: Increase weight (slow down)
@@ -49,5 +58,17 @@ class TrafficManager:
                             
                         # print(f"⚠️ Traffic update on edge {u}->{v}: Factor {new_factor}x")
 
+                        for edge_id in self.edge_ids.get((u, v), ()):
+                            changed_ids.append(edge_id)
+                            changed_weights.append(self.free_flow[edge_id] * new_factor)
+
+                # Update the engine's base edge weights (a customizable CH
+                # also re-customizes the shortcuts depending on them). The
+                # engine builds the next weight snapshot and swaps it in
+                # atomically, so native queries never wait for this or see a
+                # half-applied batch.
+                if self.engine is not None and changed_ids:
+                    self.engine.update_weights(changed_ids, changed_weights)
+
     def stop(self):
         self.running = False
\ No newline at end of file
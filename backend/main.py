@@ -1,12 +1,18 @@
 # backend/main.py
 from fastapi import FastAPI, Query
+from fastapi.responses import StreamingResponse
+from pydantic import BaseModel
 from fastapi.middleware.cors import CORSMiddleware
 from pathlib import Path
+import asyncio
+import json
 import pickle
 import os
 import time
+import threading
 import sys
 import networkx as nx
+import numpy as np
 import osmnx as ox
 
 # --- Load C++ Module ---
@@ -18,7 +24,7 @@ except ImportError:
     print("⚠️ C++ Module not found. Running in pure Python mode (slow).")
 
 # --- Imports ---
-from graph import load_graph
+from graph import load_graph, edge_geometry_arrays, time_profile_arrays
 from algorithms import astar_route, traffic_astar_route
 from kafka_service import TrafficManager 
 
@@ -30,6 +36,7 @@ app.add_middleware(
 
 BASE_DIR = Path(__file__).resolve().parent.parent
 CH_FILE = BASE_DIR / "data" / "ch_graph.pkl"
+CH_BIN_FILE = BASE_DIR / "data" / "ch_graph.bin"   # memory-mapped CH (preprocess_map.py)
 GRAPH_FILE = BASE_DIR / "data" / "map_graph.graphml"
 
 # Global Variables
@@ -39,6 +46,14 @@ USE_CH = False
 node_map = {}        # Map Node ID -> Array Index
 index_map = {}       # Map Array Index -> Node ID
 traffic_manager = None 
+query_pool = None    # Native worker pool behind /route_batch
+warm_up_done = threading.Event()   # G, time profiles, landmarks and traffic layer are loaded
+
+def require_warm_up(needed=True):
+    """Waits, when `needed`, for what a fast start from the CH file leaves to
+    the background: G, and the time profiles and landmarks the file lacks."""
+    if needed:
+        warm_up_done.wait()
 
 # --- NEW HELPER: GEOMETRY INJECTOR ---
 def get_path_with_geometry(G, node_list):
@@ -91,17 +106,45 @@ def get_path_with_geometry(G, node_list):
             
     return full_coords
 
+def native_path_coords(path_indices):
+    """(Lat, Lon) list for a node-index path from the C++ engine, assembled
+    natively from the packed edge shapes when the engine has them."""
+    if cpp_graph.has_edge_geometry:
+        return cpp_graph.path_geometry(path_indices).tolist()
+    require_warm_up()
+    return get_path_with_geometry(G, [index_map[i] for i in path_indices])
+
+def snap_endpoints(o_lat, o_lon, d_lat, d_lon):
+    """Nearest graph nodes (OSM ids) to origin and destination, in one native batch when available."""
+    if USE_CH:
+        o_idx, d_idx = cpp_graph.nearest(np.array([o_lat, d_lat]), np.array([o_lon, d_lon])).tolist()
+        return index_map[o_idx], index_map[d_idx]
+    return (ox.distance.nearest_nodes(G, o_lon, o_lat),
+            ox.distance.nearest_nodes(G, d_lon, d_lat))
+
 @app.on_event("startup")
 def startup_event():
-    global G, cpp_graph, USE_CH, node_map, index_map, traffic_manager
+    global G, cpp_graph, USE_CH, node_map, index_map, traffic_manager, query_pool
     
-    if CH_FILE.exists():
-        print(f"⚡ Loading CH Graph from {CH_FILE}...")
-        with open(CH_FILE, "rb") as f:
-            G = pickle.load(f)
+    if CH_FILE.exists() or (ch_native and CH_BIN_FILE.exists()):
+        if CH_FILE.exists():
+            print(f"⚡ Loading CH Graph from {CH_FILE}...")
+            with open(CH_FILE, "rb") as f:
+                G = pickle.load(f)
+        # else natively preprocessed: no pickle, so the Python side (traffic,
+        # fallbacks) runs on the raw graph, loaded by warm_up()
         
         # --- POPULATE C++ ENGINE ---
-        if ch_native:
+        if ch_native and CH_BIN_FILE.exists():
+            # Zero-copy: the CSR arrays are used straight from the mapped file
+            print(f"🚀 Mapping C++ Engine from {CH_BIN_FILE}...")
+            cpp_graph = ch_native.CHGraph.load(str(CH_BIN_FILE))
+            for idx, node_id in enumerate(cpp_graph.get_node_ids().tolist()):
+                node_map[node_id] = idx
+                index_map[idx] = node_id
+            USE_CH = True
+            print("✅ C++ Engine Ready for Queries.")
+        elif ch_native:
             print("🚀 Hydrating C++ Engine (This takes a few seconds)...")
             nodes = list(G.nodes())
             num_nodes = len(nodes)
@@ -114,30 +157,69 @@ def startup_event():
             cpp_graph = ch_native.CHGraph(num_nodes)
             
             # Load Ranks
-            for idx, node_id in enumerate(nodes):
-                rank = G.nodes[node_id].get('rank', -1)
-                cpp_graph.set_rank(idx, rank)
+            cpp_graph.set_ranks(np.fromiter((G.nodes[n].get('rank', -1) for n in nodes),
+                                            dtype=np.int32, count=num_nodes))
             
-            # Load Edges
-            for u, v, data in G.edges(data=True):
-                if u in node_map and v in node_map:
-                    u_idx = node_map[u]
-                    v_idx = node_map[v]
-                    w = data.get('weight', data.get('length', 1.0))
-                    is_shortcut = data.get('shortcut', False)
-                    
-                    via_node_id = data.get('via')
-                    via_idx = -1
-                    if via_node_id is not None and via_node_id in node_map:
-                        via_idx = node_map[via_node_id]
-                    
-                    cpp_graph.add_ch_edge(u_idx, v_idx, w, is_shortcut, via_idx)
+            # Load Edges (bulk numpy transfer, one call)
+            edges = [(node_map[u], node_map[v], data) for u, v, data in G.edges(data=True)
+                     if u in node_map and v in node_map]
+            m = len(edges)
+            cpp_graph.add_ch_edges(
+                np.fromiter((u for u, _, _ in edges), dtype=np.int32, count=m),
+                np.fromiter((v for _, v, _ in edges), dtype=np.int32, count=m),
+                np.fromiter((d.get('weight', d.get('length', 1.0)) for _, _, d in edges), dtype=np.float64, count=m),
+                np.fromiter((bool(d.get('shortcut', False)) for _, _, d in edges), dtype=np.bool_, count=m),
+                np.fromiter((node_map.get(d.get('via'), -1) for _, _, d in edges), dtype=np.int32, count=m),
+            )
+            # Node coordinates for the native A* heuristic
+            cpp_graph.set_nodes(
+                np.fromiter(nodes, dtype=np.int64, count=num_nodes),
+                np.fromiter((G.nodes[n]['y'] for n in nodes), dtype=np.float64, count=num_nodes),
+                np.fromiter((G.nodes[n]['x'] for n in nodes), dtype=np.float64, count=num_nodes),
+            )
+            # Road shapes of the base edges, in the order add_ch_edges saw them
+            cpp_graph.set_edge_geometry(*edge_geometry_arrays(
+                d for _, _, d in edges if not d.get('shortcut', False)))
             
+            # Flatten into the query-time CSR arrays
+            cpp_graph.freeze()
             USE_CH = True
             print("✅ C++ Engine Ready for Queries.")
         else:
             print("⚠️ C++ Native module missing. Skipping CH hydration.")
 
+        if USE_CH:
+            if cpp_graph.is_customizable:
+                print("🔁 Customizable CH: live traffic is applied to C++ queries.")
+            # Process-wide native query counters, served by /metrics/queries
+            ch_native.enable_query_metrics()
+            # Repeated (origin, dest) pairs skip search and unpacking until
+            # the next traffic update; ROUTE_CACHE_MB=0 turns it off
+            cpp_graph.set_route_cache(float(os.environ.get("ROUTE_CACHE_MB", "64")))
+            # Worker threads that coalesce /route_batch queries into micro-batches
+            query_pool = ch_native.QueryPool(cpp_graph)
+
+        if G is None:
+            # Native queries are served from the mapped CH file right away
+            threading.Thread(target=warm_up, daemon=True).start()
+        else:
+            warm_up()
+
+    else:
+        print("⚠️ CH file not found. Using Standard A*.")
+        G = load_graph(GRAPH_FILE)
+        USE_CH = False
+        warm_up_done.set()
+
+def warm_up():
+    """Loads G if only the CH file was read, the time profiles and landmarks the
+    file lacks, and the live traffic layer."""
+    global G, traffic_manager
+    try:
+        if G is None:
+            print(f"⚡ Loading raw graph from {GRAPH_FILE}...")
+            G = load_graph(GRAPH_FILE)
+
         # --- INITIALIZE LIVE TRAFFIC LAYER ---
         print("🚦 Initializing Live Traffic Manager...")
         edge_count = 0
@@ -145,38 +227,65 @@ def startup_event():
             if 'weight' not in data:
                 data['weight'] = data.get('length', 1.0)
             edge_count += 1
-            
-        traffic_manager = TrafficManager(G)
+
+        if USE_CH:
+            # Traffic updates go into the engine's base edge weights, which
+            # cpp_graph.astar() reads. A customizable CH also re-customizes,
+            # so cpp_graph.query() itself becomes traffic-aware.
+            base = cpp_graph.get_base_edges()
+            edge_ids = {}   # every parallel edge of a pair gets the update
+            for i, (s, d) in enumerate(zip(base["src"].tolist(), base["dst"].tolist())):
+                edge_ids.setdefault((index_map[s], index_map[d]), []).append(i)
+            traffic_manager = TrafficManager(G, cpp_graph, edge_ids)
+            if not cpp_graph.has_time_profiles:
+                # Time-of-day congestion per road class, for /route/depart and /route/schedule
+                def base_edge_data(u, v):
+                    data = G.get_edge_data(u, v) or {}
+                    return next(iter(data.values()), {}) if G.is_multigraph() else data
+                cpp_graph.set_time_profiles(*time_profile_arrays(
+                    base_edge_data(index_map[s], index_map[d])
+                    for s, d in zip(base["src"].tolist(), base["dst"].tolist())))
+            if not len(cpp_graph.get_landmarks()):
+                # ALT landmarks on free-flow weights stay valid lower bounds
+                # while traffic only slows edges down (factors >= 1).
+                cpp_graph.build_landmarks(16)
+        else:
+            traffic_manager = TrafficManager(G)
         traffic_manager.start_consumer()
         print(f"📡 Live Traffic Active on {edge_count} edges.")
-
-    else:
-        print("⚠️ CH file not found. Using Standard A*.")
-        G = load_graph(GRAPH_FILE)
-        USE_CH = False
+    finally:
+        warm_up_done.set()
 
 @app.get("/route")
-def get_route(origin: str = Query(...), destination: str = Query(...)):
-    """Standard Static Route (Fastest, unaware of traffic changes)"""
+def get_route(origin: str = Query(...), destination: str = Query(...), stats: bool = False):
+    """Standard Static Route (Fastest, unaware of traffic changes unless the CH is customizable).
+    stats=true adds the native search stats (search space, unpacking and geometry timings)."""
     o_lat, o_lon = map(float, origin.split(","))
     d_lat, d_lon = map(float, destination.split(","))
 
-    origin_node = ox.distance.nearest_nodes(G, o_lon, o_lat)
-    dest_node = ox.distance.nearest_nodes(G, d_lon, d_lat)
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
 
     path_coords = []
     distance_km = 0
+    weights_version = None
+    search_stats = None
 
     if USE_CH:
         o_idx = node_map[origin_node]
         d_idx = node_map[dest_node]
         
-        # C++ Fast Query
-        path_indices, distance_km = cpp_graph.query(o_idx, d_idx)
-        
-        # Convert Indices -> Nodes -> Geometry-aware Coords
-        path_nodes = [index_map[i] for i in path_indices]
-        path_coords = get_path_with_geometry(G, path_nodes)
+        if cpp_graph.has_edge_geometry:
+            # C++ query and geometry in one call (one consistent weight snapshot)
+            geometry, distance_km, weights_version, *extra = cpp_graph.query_geometry(o_idx, d_idx, stats=stats)
+            path_coords = geometry.tolist()
+        else:
+            # C++ Fast Query (on one consistent weight snapshot)
+            path_indices, distance_km, weights_version, *extra = cpp_graph.query(o_idx, d_idx, stats=stats)
+
+            # Convert Indices -> Nodes -> Geometry-aware Coords
+            path_coords = native_path_coords(path_indices)
+        if stats:
+            search_stats = extra[0]
     else:
         path_coords, distance_km = astar_route(G, (o_lat, o_lon), (d_lat, d_lon))
 
@@ -185,7 +294,154 @@ def get_route(origin: str = Query(...), destination: str = Query(...)):
         path_coords.insert(0, (o_lat, o_lon))
         path_coords.append((d_lat, d_lon))
 
-    return {"path": path_coords, "distance_km": round(distance_km, 2)}
+    result = {"path": path_coords, "distance_km": round(distance_km, 2), "weights_version": weights_version}
+    if stats:
+        result["stats"] = search_stats
+    return result
+
+@app.get("/route/alternatives")
+def get_alternative_routes(origin: str = Query(...), destination: str = Query(...), k: int = Query(2, ge=0, le=5)):
+    """The fastest route plus up to k alternatives (native via-node method: bounded
+    stretch and sharing, locally optimal). Without the native engine only the fastest route."""
+    o_lat, o_lon = map(float, origin.split(","))
+    d_lat, d_lon = map(float, destination.split(","))
+
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
+
+    routes = []
+    weights_version = None
+    if USE_CH:
+        found, weights_version = cpp_graph.query_alternatives(node_map[origin_node], node_map[dest_node], k)
+        for path_indices, distance_km in found:
+            routes.append((native_path_coords(path_indices), distance_km))
+    else:
+        routes.append(astar_route(G, (o_lat, o_lon), (d_lat, d_lon)))
+
+    result = []
+    for path_coords, distance_km in routes:
+        if path_coords:
+            path_coords = [(o_lat, o_lon)] + list(path_coords) + [(d_lat, d_lon)]
+        result.append({"path": path_coords, "distance_km": round(distance_km, 2)})
+    return {"routes": result, "weights_version": weights_version}
+
+class RouteRequest(BaseModel):
+    origin: str        # "lat,lon"
+    destination: str   # "lat,lon"
+
+@app.post("/route_batch")
+async def route_batch(requests: list[RouteRequest]):
+    """Many routes at once, streamed back as NDJSON in completion order (one
+    {"index", "path", "distance_km", "weights_version"} or {"index", "error"} line
+    per request). The native query pool answers them in micro-batches off the event loop."""
+    if not USE_CH:
+        return {"error": "C++ Engine not loaded."}
+    points = np.array([list(map(float, p.split(","))) for r in requests for p in (r.origin, r.destination)],
+                      dtype=np.float64).reshape(-1, 2)
+    snapped = cpp_graph.nearest(points[:, 0].copy(), points[:, 1].copy()).tolist() if len(points) else []
+    kind = "geometry" if cpp_graph.has_edge_geometry else "path"
+    if kind == "path":
+        await asyncio.to_thread(require_warm_up)   # node paths are drawn from G
+
+    async def indexed(i, future):
+        try:
+            return i, await future, None
+        except RuntimeError as e:
+            return i, None, str(e)
+
+    tasks = [indexed(i, query_pool.submit(snapped[2 * i], snapped[2 * i + 1], kind))
+             for i in range(len(requests))]
+
+    async def lines():
+        for next_done in asyncio.as_completed(tasks):
+            i, result, error = await next_done
+            if error is not None:
+                yield json.dumps({"index": i, "error": error}) + "\n"
+                continue
+            route, distance_km, weights_version = result
+            path_coords = route.tolist() if kind == "geometry" else native_path_coords(route)
+            if path_coords:
+                o, d = points[2 * i].tolist(), points[2 * i + 1].tolist()
+                path_coords = [tuple(o)] + path_coords + [tuple(d)]
+            yield json.dumps({"index": i, "path": path_coords, "distance_km": round(distance_km, 2),
+                              "weights_version": weights_version}) + "\n"
+
+    return StreamingResponse(lines(), media_type="application/x-ndjson")
+
+def parse_clock(value: str) -> float:
+    """Seconds since midnight from 'HH:MM' or a plain number of seconds."""
+    if ":" in value:
+        hours, minutes = value.split(":", 1)
+        return int(hours) * 3600 + int(minutes) * 60
+    return float(value)
+
+@app.get("/route/depart")
+def get_departure_route(origin: str = Query(...), destination: str = Query(...), depart: str = Query(...)):
+    """Earliest-arrival route leaving at `depart` (HH:MM) under the time-of-day congestion profiles."""
+    if not USE_CH:
+        return {"error": "C++ Engine not loaded."}
+    o_lat, o_lon = map(float, origin.split(","))
+    d_lat, d_lon = map(float, destination.split(","))
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
+
+    departure = parse_clock(depart)
+    require_warm_up(not cpp_graph.has_time_profiles or not len(cpp_graph.get_landmarks()))
+    path_indices, arrival, weights_version = cpp_graph.td_query(
+        node_map[origin_node], node_map[dest_node], departure, landmarks=True)
+    path_coords = native_path_coords(path_indices)
+    if path_coords:
+        path_coords = [(o_lat, o_lon)] + list(path_coords) + [(d_lat, d_lon)]
+    return {"path": path_coords, "depart_s": departure,
+            "arrival_s": arrival if arrival >= 0 else None,
+            "travel_min": round((arrival - departure) / 60, 1) if arrival >= 0 else None,
+            "weights_version": weights_version}
+
+@app.get("/route/schedule")
+def get_departure_schedule(origin: str = Query(...), destination: str = Query(...),
+                           start: str = "06:00", end: str = "22:00", step_min: int = Query(15, ge=1)):
+    """Travel time for every departure from `start` to `end` (HH:MM) in steps of step_min, in one native call."""
+    if not USE_CH:
+        return {"error": "C++ Engine not loaded."}
+    o_lat, o_lon = map(float, origin.split(","))
+    d_lat, d_lon = map(float, destination.split(","))
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
+
+    require_warm_up(not cpp_graph.has_time_profiles or not len(cpp_graph.get_landmarks()))
+    departures = np.arange(parse_clock(start), parse_clock(end) + 1, step_min * 60, dtype=np.float64)
+    arrivals, weights_version = cpp_graph.td_earliest_arrivals(
+        node_map[origin_node], node_map[dest_node], departures, landmarks=True)
+    slots = [{"depart_s": dep, "arrival_s": arr if arr >= 0 else None,
+              "travel_min": round((arr - dep) / 60, 1) if arr >= 0 else None}
+             for dep, arr in zip(departures.tolist(), arrivals.tolist())]
+    return {"schedule": slots, "weights_version": weights_version}
+
+@app.get("/isochrone")
+def get_isochrone(origin: str = Query(...), max_km: float = Query(..., gt=0)):
+    """Service area: every node within max_km of origin (one PHAST sweep when native)."""
+    o_lat, o_lon = map(float, origin.split(","))
+    weights_version = None
+    if USE_CH:
+        o_idx = cpp_graph.nearest(np.array([o_lat]), np.array([o_lon]))[0]
+        indices, weights_version = cpp_graph.isochrone([o_idx], max_km)
+        nodes = [index_map[i] for i in indices.tolist()]
+    else:
+        source = ox.distance.nearest_nodes(G, o_lon, o_lat)
+        nodes = list(nx.single_source_dijkstra_path_length(G, source, cutoff=max_km * 1000, weight='length'))
+    require_warm_up()
+    points = [(G.nodes[n]['y'], G.nodes[n]['x']) for n in nodes]
+    return {"nodes": points, "count": len(points), "weights_version": weights_version}
+
+@app.get("/metrics/queries")
+def query_metrics():
+    """Process-wide native query counters and log2 histograms (latency in ns, settled nodes),
+    plus the route cache and query pool counters."""
+    if not ch_native:
+        return {"enabled": False}
+    metrics = ch_native.query_metrics()
+    if cpp_graph is not None:
+        metrics["route_cache"] = cpp_graph.route_cache_stats()
+    if query_pool is not None:
+        metrics["query_pool"] = query_pool.stats
+    return metrics
 
 # --- 1. A* (Python) vs CH (C++) ---
 @app.get("/compare")
@@ -194,10 +450,10 @@ def compare_algorithms(origin: str = Query(...), destination: str = Query(...)):
     o_lat, o_lon = map(float, origin.split(","))
     d_lat, d_lon = map(float, destination.split(","))
     
-    origin_node = ox.distance.nearest_nodes(G, o_lon, o_lat)
-    dest_node = ox.distance.nearest_nodes(G, d_lon, d_lat)
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
 
     # 1. Benchmark A* (Python)
+    require_warm_up()
     start_astar = time.time()
     path_astar, dist_astar = astar_route(G, (o_lat, o_lon), (d_lat, d_lon))
     time_astar = (time.time() - start_astar) * 1000 
@@ -210,12 +466,11 @@ def compare_algorithms(origin: str = Query(...), destination: str = Query(...)):
     start_ch = time.time()
     o_idx = node_map[origin_node]
     d_idx = node_map[dest_node]
-    path_indices, dist_ch = cpp_graph.query(o_idx, d_idx)
+    path_indices, dist_ch, _ = cpp_graph.query(o_idx, d_idx)
     time_ch = (time.time() - start_ch) * 1000 
 
     # Fix: Use geometry injector for C++ path
-    path_ch_nodes = [index_map[i] for i in path_indices]
-    path_ch = get_path_with_geometry(G, path_ch_nodes)
+    path_ch = native_path_coords(path_indices)
     
     if path_ch:
         path_ch.insert(0, (o_lat, o_lon))
@@ -241,19 +496,17 @@ def benchmark_traffic(origin: str = Query(...), destination: str = Query(...)):
     o_lat, o_lon = map(float, origin.split(","))
     d_lat, d_lon = map(float, destination.split(","))
     
-    origin_node = ox.distance.nearest_nodes(G, o_lon, o_lat)
-    dest_node = ox.distance.nearest_nodes(G, d_lon, d_lat)
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
     
     # 1. RUN STATIC CH (Standard)
     start_static = time.time()
     o_idx = node_map[origin_node]
     d_idx = node_map[dest_node]
-    path_indices, dist_static = cpp_graph.query(o_idx, d_idx)
+    path_indices, dist_static, static_version = cpp_graph.query(o_idx, d_idx)
     time_static = (time.time() - start_static) * 1000 
 
     # Fix: Use geometry injector for Static path
-    static_nodes = [index_map[i] for i in path_indices]
-    static_coords = get_path_with_geometry(G, static_nodes)
+    static_coords = native_path_coords(path_indices)
 
     if static_coords:
         static_coords.insert(0, (o_lat, o_lon))
@@ -261,10 +514,14 @@ def benchmark_traffic(origin: str = Query(...), destination: str = Query(...)):
     
     # 2. RUN LIVE TRAFFIC (Hybrid)
     start_live = time.time()
-    # traffic_astar_route ALREADY returns geometry-aware coords
-    live_coords, dist_live = traffic_astar_route(
-        G, origin_node, dest_node, cpp_graph, node_map
-    )
+    live_version = None
+    if cpp_graph.is_customizable:
+        # Customizable CH already holds the live weights
+        live_indices, dist_live, live_version = cpp_graph.query(o_idx, d_idx)
+    else:
+        # Native weighted A* on the base edges with the live weights
+        live_indices, dist_live, live_version = cpp_graph.astar(o_idx, d_idx, epsilon=2.0)
+    live_coords = native_path_coords(live_indices)
     time_live = (time.time() - start_live) * 1000 
     
     if live_coords:
@@ -275,12 +532,14 @@ def benchmark_traffic(origin: str = Query(...), destination: str = Query(...)):
         "static": {
             "path": static_coords,
             "time": round(time_static, 2),
-            "distance": round(dist_static, 2)
+            "distance": round(dist_static, 2),
+            "weights_version": static_version
         },
         "live": {
             "path": live_coords,
             "time": round(time_live, 2),
-            "distance": round(dist_live, 2)
+            "distance": round(dist_live, 2),
+            "weights_version": live_version
         }
     }
 
@@ -296,14 +555,19 @@ def compare_strategies(origin: str = Query(...), destination: str = Query(...)):
     
     # --- PRE-CALCULATE NODES (Geocoding) ---
     # We do this OUTSIDE the timers to measure pure algorithmic speed
-    origin_node = ox.distance.nearest_nodes(G, o_lon, o_lat)
-    dest_node = ox.distance.nearest_nodes(G, d_lon, d_lat)
+    origin_node, dest_node = snap_endpoints(o_lat, o_lon, d_lat, d_lon)
+    require_warm_up(USE_CH and not len(cpp_graph.get_landmarks()))
 
-    # 1. Run Standard A* # Note: astar_route inside algorithms.py re-calculates nearest nodes internally.
+    # 1. Run Standard A* (native ALT when the engine is loaded)
+    # Note: astar_route inside algorithms.py re-calculates nearest nodes internally.
     # To be strictly fair, we should pass nodes, but since Standard A* is already slow,
     # the extra overhead doesn't change the conclusion (Slow vs Fast).
     start_std = time.time()
-    path_std, dist_std = astar_route(G, (o_lat, o_lon), (d_lat, d_lon))
+    if USE_CH:
+        std_indices, dist_std, _ = cpp_graph.astar(node_map[origin_node], node_map[dest_node], landmarks=True)
+        path_std = native_path_coords(std_indices)
+    else:
+        path_std, dist_std = astar_route(G, (o_lat, o_lon), (d_lat, d_lon))
     time_std = (time.time() - start_std) * 1000 
     
     if path_std:
@@ -315,7 +579,12 @@ def compare_strategies(origin: str = Query(...), destination: str = Query(...)):
     
     # FIXED: We use the pre-calculated nodes here!
     # No more ox.distance.nearest_nodes() inside this timer.
-    path_live, dist_live = traffic_astar_route(G, origin_node, dest_node, cpp_graph, node_map)
+    if USE_CH:
+        live_indices, dist_live, _ = cpp_graph.astar(node_map[origin_node], node_map[dest_node],
+                                                     epsilon=2.0, landmarks=True)
+        path_live = native_path_coords(live_indices)
+    else:
+        path_live, dist_live = traffic_astar_route(G, origin_node, dest_node, cpp_graph, node_map)
     
     time_live = (time.time() - start_live) * 1000
     
@@ -14,21 +14,30 @@ except ImportError as e:
     print(f"Run 'python setup.py build_ext --inplace' inside backend/cpp_native/")
     sys.exit(1)
 
-import osmnx as ox
-import networkx as nx
-import pickle
+import numpy as np
 
 # --- Paths ---
 BASE_DIR = Path(__file__).resolve().parent.parent
 INPUT_GRAPH = BASE_DIR / "data" / "map_graph.graphml"
 OUTPUT_CH = BASE_DIR / "data" / "ch_graph.pkl"
+OUTPUT_BIN = BASE_DIR / "data" / "ch_graph.bin"
 
-def preprocess():
-    print(f"Loading raw graph from {INPUT_GRAPH}...")
-    
-    if not INPUT_GRAPH.exists():
-        print(f"Error: {INPUT_GRAPH} not found. Run download_map.py first.")
-        return
+# Random CH-vs-Dijkstra checks after contraction (0 disables)
+VERIFY_SAMPLES = int(os.environ.get("CH_VERIFY_SAMPLES", "200"))
+
+# "ch": classic CH with static weights baked into the shortcuts.
+# "cch": customizable CH; the server re-customizes it with live traffic.
+CH_MODE = os.environ.get("CH_MODE", "ch").lower()
+
+# "native": the engine streams the GraphML itself and only the binary CH
+# file is written (no NetworkX, no pickle). "networkx": the original path,
+# which also pickles the NetworkX graph with ranks and shortcuts.
+CH_PIPELINE = os.environ.get("CH_PIPELINE", "native").lower()
+
+def load_with_networkx():
+    """Builds the engine input through osmnx / NetworkX; returns (G, cpp_graph, idx_to_node)."""
+    import osmnx as ox
+    from graph import edge_geometry_arrays
 
     # 1. Load and Standardize Graph
     G_raw = ox.load_graphml(INPUT_GRAPH)
@@ -48,46 +57,108 @@ def preprocess():
     # Initialize C++ Graph
     cpp_graph = ch_native.CHGraph(len(node_list))
     
-    # Transfer Edges
-    for u, v, data in G.edges(data=True):
-        u_idx = node_to_idx[u]
-        v_idx = node_to_idx[v]
-        # Default weight to 1.0 if missing, ensure float
-        w = float(data.get('weight', data.get('length', 1.0)))
-        cpp_graph.add_edge(u_idx, v_idx, w)
-
-    # 3. Calculate Node Importance (Heuristic)
-    print("Sorting nodes by importance (Degree Heuristic)...")
-    # Sort by degree (contract simple nodes first, keep hubs for last)
-    nodes_sorted = sorted(node_list, key=lambda n: G.degree(n))
-    order_indices = [node_to_idx[n] for n in nodes_sorted]
-
-    # 4. Run Contraction Hierarchies (C++)
-    print("🚀 Running Contraction Hierarchies (C++ Accelerator)...")
-    cpp_graph.build_ch(order_indices)
-
-    # 5. Retrieve & Save Results
-    print("Retrieving optimized graph data...")
-    data = cpp_graph.get_graph_data()
+    # Node ids and coordinates travel with the binary CH file
+    cpp_graph.set_nodes(
+        np.array(node_list, dtype=np.int64),
+        np.array([G.nodes[n]['y'] for n in node_list], dtype=np.float64),
+        np.array([G.nodes[n]['x'] for n in node_list], dtype=np.float64),
+    )
+
+    # Transfer Edges (one bulk call instead of one per edge)
+    m = G.number_of_edges()
+    src = np.fromiter((node_to_idx[u] for u, _ in G.edges()), dtype=np.int32, count=m)
+    dst = np.fromiter((node_to_idx[v] for _, v in G.edges()), dtype=np.int32, count=m)
+    # Default weight to 1.0 if missing
+    weight = np.fromiter((d.get('weight', d.get('length', 1.0)) for _, _, d in G.edges(data=True)),
+                         dtype=np.float64, count=m)
+    cpp_graph.add_edges(src, dst, weight)
+
+    # Road shapes, so the server can return route geometry natively
+    cpp_graph.set_edge_geometry(*edge_geometry_arrays(d for _, _, d in G.edges(data=True)))
+    return G, cpp_graph, idx_to_node
+
+def preprocess():
+    print(f"Loading raw graph from {INPUT_GRAPH}...")
     
-    ranks = data["ranks"]
-    edges = data["edges"]
+    if not INPUT_GRAPH.exists():
+        print(f"Error: {INPUT_GRAPH} not found. Run download_map.py first.")
+        return
+
+    if CH_PIPELINE == "native":
+        # Parsed in parallel chunks straight into the engine
+        cpp_graph = ch_native.CHGraph.from_graphml(str(INPUT_GRAPH))
+        G = None
+    else:
+        G, cpp_graph, idx_to_node = load_with_networkx()
+
+    # 3. Run Contraction Hierarchies (C++)
+    if CH_MODE == "cch":
+        # Nested dissection order on the node coordinates; the shortcut
+        # topology is metric-independent and customized with `weight` here.
+        print("🚀 Building Customizable Contraction Hierarchy (C++ Accelerator)...")
+        cpp_graph.build_cch()
+    else:
+        # The engine picks the node order itself (edge difference, contracted
+        # neighbours, depth) and contracts independent node sets on all cores.
+        print("🚀 Running Contraction Hierarchies (C++ Accelerator)...")
+        cpp_graph.build_ch_auto()
+
+    stats = cpp_graph.get_build_stats()
+    print(f"Hierarchy has {stats['levels']} levels, {stats['total_shortcuts']} shortcuts.")
+    for level, count in enumerate(stats["shortcuts_per_level"]):
+        if count:
+            print(f"  level {level}: {count} shortcuts")
+
+    # Optional sanity check: random CH queries vs. plain Dijkstra
+    if VERIFY_SAMPLES > 0:
+        print(f"Verifying {VERIFY_SAMPLES} random queries against Dijkstra...")
+        result = cpp_graph.verify(VERIFY_SAMPLES)
+        if result["mismatches"]:
+            print(f"❌ {result['mismatches']}/{result['checked']} queries differ "
+                  f"(max error {result['max_error_km']:.3f} km). Not saving.")
+            return
+        print("✅ Hierarchy verified.")
+
+    # ALT landmarks (and the time-of-day profiles, when the edge attributes
+    # are at hand) are stored in the CH file, so the server need not rebuild them
+    cpp_graph.build_landmarks(16)
+    if G is not None:
+        from graph import time_profile_arrays
+        cpp_graph.set_time_profiles(*time_profile_arrays(d for _, _, d in G.edges(data=True)))
+
+    # 4. Retrieve & Save Results
+    print(f"Saving binary CH graph to {OUTPUT_BIN}...")
+    cpp_graph.save(str(OUTPUT_BIN))
+
+    if G is None:
+        # The server reads the raw GraphML when there is no pickle; drop a
+        # stale one so it cannot disagree with the new CH file.
+        if OUTPUT_CH.exists():
+            OUTPUT_CH.unlink()
+        print("Done! Backend is ready.")
+        return
+
+    import pickle
+    print("Retrieving optimized graph data...")
+    data = cpp_graph.get_graph_arrays()
     
     # Update Graph with Ranks
-    for i, r in enumerate(ranks):
+    for i, r in enumerate(data["ranks"].tolist()):
         G.nodes[idx_to_node[i]]['rank'] = r
         
     # Add Shortcuts to Graph
+    mask = data["is_shortcut"]
+    shortcuts = zip(data["src"][mask].tolist(), data["dst"][mask].tolist(),
+                    data["weight"][mask].tolist(), data["via"][mask].tolist())
     shortcut_count = 0
-    for u_idx, v_idx, w, is_shortcut, via_idx in edges:
-        if is_shortcut:
-            u = idx_to_node[u_idx]
-            v = idx_to_node[v_idx]
-            # Map the 'via' index back to the real OSM Node ID
-            via_node = idx_to_node[via_idx] if via_idx != -1 else None
-            
-            G.add_edge(u, v, weight=w, shortcut=True, via=via_node)
-            shortcut_count += 1
+    for u_idx, v_idx, w, via_idx in shortcuts:
+        u = idx_to_node[u_idx]
+        v = idx_to_node[v_idx]
+        # Map the 'via' index back to the real OSM Node ID
+        via_node = idx_to_node[via_idx] if via_idx != -1 else None
+        
+        G.add_edge(u, v, weight=w, shortcut=True, via=via_node)
+        shortcut_count += 1
             
     print(f"✅ Optimization Complete. Added {shortcut_count} shortcuts.")
     